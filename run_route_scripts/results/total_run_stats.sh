@@ -29,8 +29,8 @@ then
 fi
 
 ### Example input
-###1:orgLat, 2:orgLng, 3:destLat, 4:destLng, 5:result, 6:#Passes, 7:runtime, 8:trip time, 9:length, 10:arcDistance, 11:#Manuevers
-###34.854443,40.608334,36.366665,36.983334,success,1,81,20031,273.763855,229.100693,44
+###1:orgLat, 2:orgLng, 3:destLat, 4:destLng, 5:result, 6:#Passes, 7:runtime, 8:trip time, 9:length, 10:arcDistance, 11:#Manuevers, 12-16:stage times (us), 17:#TilesLoaded
+###34.854443,40.608334,36.366665,36.983334,success,1,81,20031,273.763855,229.100693,44,1520,70211,6804,1288,1593,35
 
 # Write total stats header
 TOTAL_STATS_FILENAME="total_${STATS_FILENAME}"
@@ -53,7 +53,7 @@ TRIP_LENGTH=0
 NUM_MANEUVERS=0
 {
   read; # Read header
-  while IFS=, read IN_ORIG_LAT IN_ORIG_LNG IN_DEST_LAT IN_DEST_LNG IN_RESULT IN_NUM_PASSES IN_RUN_TIME IN_TRIP_TIME IN_TRIP_LENGTH IN_ARC_DISTAANCE IN_NUM_MANEUVERS
+  while IFS=, read IN_ORIG_LAT IN_ORIG_LNG IN_DEST_LAT IN_DEST_LNG IN_RESULT IN_NUM_PASSES IN_RUN_TIME IN_TRIP_TIME IN_TRIP_LENGTH IN_ARC_DISTAANCE IN_NUM_MANEUVERS IN_STAGE_TIMES
   do
     #echo "$IN_ORIG_LAT|$IN_ORIG_LNG|$IN_DEST_LAT|$IN_DEST_LNG|$IN_RESULT|$IN_NUM_PASSES|$IN_RUN_TIME|$IN_TRIP_TIME|$IN_TRIP_LENGTH|$IN_ARC_DISTAANCE|$IN_NUM_MANEUVERS"
     ((NUM_PASSES+=IN_NUM_PASSES))
@@ -0,0 +1,115 @@
+// -*- mode: c++ -*-
+#ifndef VALHALLA_TOOLS_AFFINITY_H_
+#define VALHALLA_TOOLS_AFFINITY_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <functional>
+#include <stdexcept>
+#include <boost/property_tree/ptree.hpp>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//parse a cpu list like the kernel writes them, ie 0-3,8,10-11
+inline std::vector<int> parse_cpus(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream stream(list);
+  std::string range;
+  while(std::getline(stream, range, ',')) {
+    if(range.empty())
+      continue;
+    auto dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    if(last < first)
+      throw std::runtime_error("Bad cpu range: " + range);
+    for(int cpu = first; cpu <= last; ++cpu)
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+//the cpus of each numa node, empty if there's only one or we can't tell
+inline std::vector<std::vector<int> > numa_nodes() {
+  std::vector<std::vector<int> > nodes;
+  for(size_t node = 0; ; ++node) {
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if(!file || !std::getline(file, list))
+      break;
+    auto cpus = parse_cpus(list);
+    if(!cpus.empty())
+      nodes.emplace_back(std::move(cpus));
+  }
+  if(nodes.size() < 2)
+    nodes.clear();
+  return nodes;
+}
+
+//keep the calling thread on these cpus, memory it touches first is then
+//allocated on their node. does nothing for an empty set
+inline bool pin_this_thread(const std::vector<int>& cpus) {
+  if(cpus.empty())
+    return true;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for(auto cpu : cpus)
+    CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+/**
+ * How many workers a layer of a service runs and where, from the layer's
+ * <layer>.service block: "workers" is the count and "cpus" an optional cpu
+ * list every worker of the layer is kept on. A layer can instead be spread
+ * one worker per numa node in turn so that each worker and whatever it
+ * allocates, like its tile cache, stay on one socket.
+ */
+struct layer_t {
+  layer_t(const boost::property_tree::ptree& config, const std::string& name, size_t default_workers,
+      const std::vector<std::vector<int> >& nodes = {})
+    : name(name), workers(config.get<size_t>(name + ".service.workers", default_workers)) {
+    auto cpus = config.get_optional<std::string>(name + ".service.cpus");
+    if(cpus)
+      sets.emplace_back(parse_cpus(*cpus));
+    else
+      sets = nodes;
+  }
+
+  //the cpus the i'th worker runs on
+  std::vector<int> cpus(size_t worker) const {
+    return sets.empty() ? std::vector<int>() : sets[worker % sets.size()];
+  }
+
+  //the numa node the i'th worker runs on, if they are spread over them
+  size_t node(size_t worker) const {
+    return sets.empty() ? 0 : worker % sets.size();
+  }
+
+  //start the workers, each pinned before it does anything
+  void start(const std::function<void (size_t)>& run) const {
+    for(size_t i = 0; i < workers; ++i) {
+      auto set = cpus(i);
+      std::thread([set, run, i]() {
+        pin_this_thread(set);
+        run(i);
+      }).detach();
+    }
+  }
+
+  std::string name;
+  size_t workers;
+  std::vector<std::vector<int> > sets;
+};
+
+#endif
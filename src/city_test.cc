@@ -3,6 +3,12 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <array>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <list>
+#include <algorithm>
 #include <boost/program_options.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -11,6 +17,8 @@
 #include <boost/tokenizer.hpp>
 
 #include "config.h"
+#include "speculative_lane.h"
+#include "tile_cache.h"
 
 #include <valhalla/baldr/graphreader.h>
 #include <valhalla/baldr/pathlocation.h>
@@ -141,6 +149,126 @@ std::string GetJSONRequest(const Location& originloc, const Location& destloc) {
   return str;
 }
 
+// Pass 1 relaxes the hierarchy limits, pass 2 disables highway transitions
+// on top of that
+void RelaxPass(DynamicCost& cost, uint32_t pass) {
+  if (pass == 1)
+    cost.RelaxHierarchyLimits(16.0f, 4.0f);
+  else if (pass == 2)
+    cost.DisableHighwayTransitions();
+}
+
+// A thread with its own reader and path algorithm for one of the relaxed
+// passes, the lane goes first when it is destroyed
+struct PassLane {
+  PassLane(const boost::property_tree::ptree& pt, tile_cache_t* cache)
+    : reader(pt.get_child("mjolnir.hierarchy"), cache) { }
+  cached_reader_t reader;
+  PathAlgorithm pathalgorithm;
+  speculative_lane_t<std::vector<PathInfo> > lane;
+};
+
+// Everything a thread needs to route between cities, kept for all of the
+// routes it runs. The costing is only made again after a route relaxed it.
+// The readers of every thread and lane share one tile cache
+struct CityRouter {
+  CityRouter(const boost::property_tree::ptree& pt,
+             const CostFactory<DynamicCost>& factory,
+             const std::string& routetype, tile_cache_t* cache, bool speculate)
+    : pt(pt), factory(factory), routetype(routetype),
+      reader(pt.get_child("mjolnir.hierarchy"), cache) {
+    MakeCost();
+    if (speculate) {
+      for (auto& lane : lanes)
+        lane.reset(new PassLane(pt, cache));
+    }
+  }
+
+  cost_ptr_t Create() const {
+    return factory.Create(routetype, pt.get_child("costing_options." + routetype));
+  }
+
+  void MakeCost() {
+    cost = Create();
+    mode = cost->travelmode();
+    mode_costing[static_cast<uint32_t>(mode)] = cost;
+  }
+
+  // Returns how many passes after the first it took or -1 if there is no
+  // path. 2nd pass - increase hierarchy limits, 3rd pass disable highway
+  // transitions. When speculating those start now on the lanes that are
+  // free and the first pass to find a path in that order wins
+  int32_t Route(const PathLocation& from, const PathLocation& to) {
+    PathLocation origin = from, dest = to;
+    int32_t np = 0;
+    std::array<PassLane*, 2> started {{ nullptr, nullptr }};
+    if (cost->AllowMultiPass()) {
+      for (uint32_t pass = 1; pass <= lanes.size(); pass++) {
+        PassLane* lane = lanes[pass - 1].get();
+        if (!lane || !lane->lane.idle())
+          continue;
+        std::array<cost_ptr_t, 4> costing;
+        costing[static_cast<uint32_t>(mode)] = Create();
+        for (uint32_t p = 1; p <= pass; p++)
+          RelaxPass(*costing[static_cast<uint32_t>(mode)], p);
+        TravelMode lane_mode = mode;
+        auto job = [lane, origin, dest, costing, lane_mode]() mutable {
+          lane->reader.Sync();
+          auto path = lane->pathalgorithm.GetBestPath(origin, dest, lane->reader, costing.data(), lane_mode);
+          lane->pathalgorithm.Clear();
+          lane->reader.Share();
+          if (lane->reader.OverCommitted())
+            lane->reader.Clear();
+          return path;
+        };
+        if (lane->lane.start(job))
+          started[pass - 1] = lane;
+      }
+    }
+    reader.Sync();
+    std::vector<PathInfo> pathedges = pathalgorithm.GetBestPath(origin, dest, reader, mode_costing, mode);
+    pathalgorithm.Clear();
+    if (cost->AllowMultiPass()) {
+      uint32_t relaxed = 0;
+      for (uint32_t pass = 1; pass <= lanes.size() && pathedges.size() == 0; pass++) {
+        if (started[pass - 1]) {
+          pathedges = started[pass - 1]->lane.get();
+          started[pass - 1] = nullptr;
+        } else {
+          for (relaxed++; relaxed <= pass; relaxed++)
+            RelaxPass(*cost, relaxed);
+          relaxed = pass;
+          pathedges = pathalgorithm.GetBestPath(origin, dest, reader, mode_costing, mode);
+          pathalgorithm.Clear();
+        }
+        np++;
+      }
+      // The next route needs costing that hasn't been relaxed
+      if (relaxed)
+        MakeCost();
+    }
+    // Don't wait on the passes we didn't need
+    for (auto* lane : started) {
+      if (lane)
+        lane->lane.abandon();
+    }
+    reader.Share();
+    if (reader.OverCommitted())
+      reader.Clear();
+    return pathedges.size() == 0 ? -1 : np;
+  }
+
+  const boost::property_tree::ptree& pt;
+  const CostFactory<DynamicCost>& factory;
+  std::string routetype;
+  cached_reader_t reader;
+  PathAlgorithm pathalgorithm;
+  cost_ptr_t cost;
+  TravelMode mode;
+  cost_ptr_t mode_costing[4];
+  std::array<std::unique_ptr<PassLane>, 2> lanes;
+};
+
 // Main method for testing city to city routing
 int main(int argc, char *argv[]) {
   bpo::options_description options("citytest " VERSION "\n"
@@ -157,9 +285,12 @@ int main(int argc, char *argv[]) {
   std::string filename = "World_Cities_Location_table.csv";
 
   std::string ctry;
+  size_t threads = std::max(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(1));
   options.add_options()
       ("help,h", "Print this help message.")
-      ("country,c", boost::program_options::value<std::string>(&ctry), "Country");
+      ("country,c", boost::program_options::value<std::string>(&ctry), "Country")
+      ("speculate", "Run the relaxed passes on their own threads alongside the first pass.")
+      ("threads,t", boost::program_options::value<size_t>(&threads), "Concurrency to use [default=hardware concurrency].");
 
   bpo::variables_map vm;
   try {
@@ -240,73 +371,92 @@ int main(int argc, char *argv[]) {
 
   LOG_INFO("routetype: " + routetype);
 
-  // Get something we can use to fetch tiles
-  valhalla::baldr::GraphReader reader(pt.get_child("mjolnir.hierarchy"));
-
-  // Run routes
-  uint32_t error_count = 0;
-  uint32_t success_count = 0;
-  uint32_t npasses[3] = {};
+  // Find each city once, every route to or from it reuses the result. All
+  // the threads' readers share one tile cache
+  threads = std::max(threads, static_cast<size_t>(1));
+  tile_cache_t cache(pt.get<size_t>("mjolnir.max_cache_size", 1073741824));
   auto t1 = std::chrono::high_resolution_clock::now();
-  for (uint32_t l0 = 0; l0 < cities.size() - 1; l0++) {
-    for (uint32_t l1 = l0 + 1; l1 < cities.size(); l1++) {
-      // Get the costing method. We do this each time since prior route may
-      // have changed hierarchy_limits. Also, this simulates how the service
-      // works
-      cost_ptr_t mode_costing[4];
-      cost_ptr_t cost = factory.Create(
-          routetype, pt.get_child("costing_options." + routetype));
-      TravelMode mode = cost->travelmode();
-      mode_costing[static_cast<uint32_t>(mode)] = cost;
-
-
-      Location originloc(cities[l0].latlng);
-      Location destloc(cities[l1].latlng);
-
-      // Use Loki to get location information
-      PathLocation origin = Search(originloc, reader, cost->GetEdgeFilter(), cost->GetNodeFilter());
-      PathLocation dest   = Search(destloc, reader, cost->GetEdgeFilter(), cost->GetNodeFilter());
-
-      // TODO - maybe later use different path algorithms
-      uint32_t np = 0;
-      PathAlgorithm pathalgorithm;
-      std::vector<PathInfo> pathedges = pathalgorithm.GetBestPath(origin, dest, reader, mode_costing, mode);
-      if (pathedges.size() == 0) {
-        // 2nd pass - increase hierarchy limits, 3rd pass disable highway
-        // transitions
-        if (cost->AllowMultiPass()) {
-          pathalgorithm.Clear();
-          cost->RelaxHierarchyLimits(16.0f, 4.0f);
-          pathedges = pathalgorithm.GetBestPath(origin, dest, reader, mode_costing, mode);
-          np++;
-          if (pathedges.size() == 0) {
-            pathalgorithm.Clear();
-            cost->DisableHighwayTransitions();
-            pathedges = pathalgorithm.GetBestPath(origin, dest, reader, mode_costing, mode);
-            np++;
-          }
-        }
+  std::vector<std::unique_ptr<PathLocation> > locations(cities.size());
+  std::atomic<size_t> next(0);
+  auto correlate = [&]() {
+    cached_reader_t reader(pt.get_child("mjolnir.hierarchy"), &cache);
+    cost_ptr_t cost = factory.Create(routetype, pt.get_child("costing_options." + routetype));
+    for (size_t i = next++; i < cities.size(); i = next++) {
+      reader.Sync();
+      try {
+        locations[i].reset(new PathLocation(Search(Location(cities[i].latlng), reader,
+                                                   cost->GetEdgeFilter(), cost->GetNodeFilter())));
+      } catch (const std::exception& e) {
+        LOG_WARN("Could not find " + cities[i].city + ": " + e.what());
       }
-
-      if (pathedges.size() == 0) {
-        error_count++;
-      } else {
-        success_count++;
-        npasses[np]++;
-      }
-
-      // TODO - perhaps walk the edges to find total length?
+      reader.Share();
+      if (reader.OverCommitted())
+        reader.Clear();
     }
-  }
-  LOG_INFO(std::to_string(success_count) + " out of " +
-           std::to_string(success_count+error_count) + " succeeded");
-  LOG_INFO("Success on first pass: " + std::to_string(npasses[0]));
-  LOG_INFO("Success on second pass: " + std::to_string(npasses[1]));
-  LOG_INFO("Success on third pass: " + std::to_string(npasses[2]));
+  };
+  std::list<std::thread> pool;
+  for (size_t i = 0; i < threads; ++i)
+    pool.emplace_back(correlate);
+  for (auto& thread : pool)
+    thread.join();
+  pool.clear();
   auto t2 = std::chrono::high_resolution_clock::now();
   uint32_t msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
+  size_t found = std::count_if(locations.begin(), locations.end(),
+    [](const std::unique_ptr<PathLocation>& location) { return static_cast<bool>(location); });
+  LOG_INFO("Found " + std::to_string(found) + " of " + std::to_string(cities.size()) +
+           " cities in " + std::to_string(msecs) + " ms");
+
+  // Run routes, each thread takes all the routes from the next origin
+  struct Counts {
+    uint32_t error_count = 0;
+    uint32_t success_count = 0;
+    uint32_t npasses[3] = {};
+  };
+  std::vector<Counts> counts(threads);
+  bool speculate = vm.count("speculate");
+  next = 0;
+  auto route = [&](Counts& thread_counts) {
+    CityRouter router(pt, factory, routetype, &cache, speculate);
+    for (size_t l0 = next++; l0 + 1 < cities.size(); l0 = next++) {
+      for (size_t l1 = l0 + 1; l1 < cities.size(); l1++) {
+        int32_t np = -1;
+        if (locations[l0] && locations[l1])
+          np = router.Route(*locations[l0], *locations[l1]);
+        if (np < 0) {
+          thread_counts.error_count++;
+        } else {
+          thread_counts.success_count++;
+          thread_counts.npasses[np]++;
+        }
+        // TODO - perhaps walk the edges to find total length?
+      }
+    }
+  };
+  t1 = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < threads; ++i)
+    pool.emplace_back(route, std::ref(counts[i]));
+  for (auto& thread : pool)
+    thread.join();
+  t2 = std::chrono::high_resolution_clock::now();
+
+  Counts total;
+  for (const auto& c : counts) {
+    total.error_count += c.error_count;
+    total.success_count += c.success_count;
+    for (size_t i = 0; i < 3; ++i)
+      total.npasses[i] += c.npasses[i];
+  }
+  uint32_t routes = total.success_count + total.error_count;
+  LOG_INFO(std::to_string(total.success_count) + " out of " +
+           std::to_string(routes) + " succeeded");
+  LOG_INFO("Success on first pass: " + std::to_string(total.npasses[0]));
+  LOG_INFO("Success on second pass: " + std::to_string(total.npasses[1]));
+  LOG_INFO("Success on third pass: " + std::to_string(total.npasses[2]));
+  msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
   float secs = msecs * 0.001f;
-  LOG_INFO("Time = " + std::to_string(secs) + " secs");
+  LOG_INFO("Time = " + std::to_string(secs) + " secs with " + std::to_string(threads) + " threads");
+  LOG_INFO("Routes per second = " + std::to_string(secs > 0 ? routes / secs : 0.f));
 
   return EXIT_SUCCESS;
 }
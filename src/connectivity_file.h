@@ -0,0 +1,226 @@
+// -*- mode: c++ -*-
+#ifndef VALHALLA_TOOLS_CONNECTIVITY_FILE_H_
+#define VALHALLA_TOOLS_CONNECTIVITY_FILE_H_
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <stdexcept>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem/operations.hpp>
+#include <valhalla/baldr/pathlocation.h>
+
+/**
+ * The connectivity colors of every tile on every level, as written by
+ * valhalla_build_connectivity, laid out so the file can be mapped and used
+ * as is. A header, then one level_t per level, then for each level a row
+ * major grid of uint32_t colors, one per tile id, where 0 means there is no
+ * tile. Tiles with the same color are connected. Each level carries its own
+ * grid so the file can be used without the tile hierarchy. Each level also
+ * records the inode and modification time of its directory in the tile dir,
+ * which is a couple of stats to check and changes whenever the tiles are
+ * rebuilt into a fresh directory. The header records how many tiles there were
+ * and when the newest of them was written, which catches tiles changed in place
+ * but means looking at every tile so it is only checked when asked.
+ */
+namespace connectivity_file {
+
+  constexpr char kMagic[8] = {'V', 'C', 'O', 'N', 'N', 'E', 'C', 'T'};
+  constexpr uint32_t kVersion = 3;
+  constexpr const char* kDefaultName = "connectivity.bin";
+
+  struct header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t level_count;
+    //the tile set the colors were worked out from
+    uint64_t tile_count;
+    int64_t tiles_modified;
+  };
+
+  struct level_t {
+    uint32_t level;
+    uint32_t ncolumns;
+    uint32_t nrows;
+    float tile_size;
+    float min_lng;
+    float min_lat;
+    //bytes from the start of the file to this level's colors
+    uint64_t offset;
+    //the level's directory in the tile dir the colors were worked out from
+    uint64_t dir_inode;
+    int64_t dir_modified;
+  };
+
+  static_assert(sizeof(header_t) == 32 && sizeof(level_t) == 48, "connectivity file structs must be packed");
+
+  //the inode and modification time of a level's directory, zeros if there isnt one
+  inline std::pair<uint64_t, int64_t> level_stamp(const std::string& tile_dir, uint32_t level) {
+    struct stat info;
+    if(stat((tile_dir + '/' + std::to_string(level)).c_str(), &info) == -1)
+      return {0, 0};
+    return {static_cast<uint64_t>(info.st_ino), static_cast<int64_t>(info.st_mtime)};
+  }
+
+  //the number of tiles under the tile dir and the newest modification time among them
+  inline std::pair<uint64_t, int64_t> tile_set(const std::string& tile_dir) {
+    std::pair<uint64_t, int64_t> tiles{0, 0};
+    boost::filesystem::recursive_directory_iterator end;
+    for(boost::filesystem::recursive_directory_iterator i(tile_dir); i != end; ++i) {
+      if(!boost::filesystem::is_regular_file(i->status()) || i->path().extension() != ".gph")
+        continue;
+      ++tiles.first;
+      tiles.second = std::max(tiles.second, static_cast<int64_t>(boost::filesystem::last_write_time(i->path())));
+    }
+    return tiles;
+  }
+}
+
+/**
+ * A read only mapping of a connectivity file. Opening one costs a couple of
+ * system calls no matter how big the graph is and the pages are shared with
+ * every other process mapping the same file, so any number of threads and
+ * processes can check connectivity without building the map themselves.
+ */
+class mapped_connectivity_t {
+ public:
+  explicit mapped_connectivity_t(const std::string& file_name) : data(nullptr), size(0) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if(fd == -1)
+      throw std::runtime_error("Could not open " + file_name);
+    struct stat info;
+    if(fstat(fd, &info) == -1 || info.st_size < static_cast<off_t>(sizeof(connectivity_file::header_t))) {
+      close(fd);
+      throw std::runtime_error(file_name + " is too small to be a connectivity file");
+    }
+    size = info.st_size;
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapped == MAP_FAILED)
+      throw std::runtime_error("Could not map " + file_name);
+    data = static_cast<const char*>(mapped);
+
+    //make sure everything we'll look at is actually in the file
+    const auto* header = reinterpret_cast<const connectivity_file::header_t*>(data);
+    bool valid = std::memcmp(header->magic, connectivity_file::kMagic, sizeof(header->magic)) == 0 &&
+      header->version == connectivity_file::kVersion &&
+      sizeof(*header) + header->level_count * sizeof(connectivity_file::level_t) <= size;
+    for(uint32_t i = 0; valid && i < header->level_count; ++i) {
+      const auto& l = levels()[i];
+      valid = l.offset % sizeof(uint32_t) == 0 && l.tile_size > 0 && l.ncolumns && l.nrows &&
+        l.offset + static_cast<uint64_t>(l.ncolumns) * l.nrows * sizeof(uint32_t) <= size;
+    }
+    if(!valid) {
+      munmap(const_cast<char*>(data), size);
+      throw std::runtime_error(file_name + " is not a valid connectivity file");
+    }
+  }
+
+  ~mapped_connectivity_t() {
+    if(data)
+      munmap(const_cast<char*>(data), size);
+  }
+
+  //whether the level directories in the tile dir are the ones the colors were worked out from
+  bool stamped_for(const std::string& tile_dir) const {
+    const auto* header = reinterpret_cast<const connectivity_file::header_t*>(data);
+    for(uint32_t i = 0; i < header->level_count; ++i) {
+      const auto& l = levels()[i];
+      if(connectivity_file::level_stamp(tile_dir, l.level) != std::make_pair(l.dir_inode, l.dir_modified))
+        return false;
+    }
+    return true;
+  }
+
+  //whether the colors were worked out from the tiles that are in the tile dir now, looks at every tile
+  bool built_from(const std::string& tile_dir) const {
+    const auto* header = reinterpret_cast<const connectivity_file::header_t*>(data);
+    return connectivity_file::tile_set(tile_dir) == std::make_pair(header->tile_count, header->tiles_modified);
+  }
+
+  mapped_connectivity_t(const mapped_connectivity_t&) = delete;
+  mapped_connectivity_t& operator=(const mapped_connectivity_t&) = delete;
+
+  //the color of a tile, 0 if there is no such tile
+  uint32_t color(uint32_t level, uint32_t tile_id) const {
+    const auto* l = find(level);
+    if(!l || tile_id >= l->ncolumns * l->nrows)
+      return 0;
+    return colors(*l)[tile_id];
+  }
+
+  //the colors of the tiles within radius meters of the location and of the
+  //tiles its edges are in, the same as connectivity_map_t::get_colors
+  std::unordered_set<size_t> get_colors(uint32_t level, const valhalla::baldr::PathLocation& location, float radius) const {
+    std::unordered_set<size_t> result;
+    const auto* l = find(level);
+    if(!l)
+      return result;
+    const auto* grid = colors(*l);
+
+    //the tiles overlapping a box around the location
+    float lat = location.latlng_.lat(), lng = location.latlng_.lng();
+    float lat_radius = radius / 110567.f;
+    float lng_radius = radius / std::max(110567.f * std::cos(lat * static_cast<float>(M_PI) / 180.f), 1.f);
+    int32_t min_column = column(*l, lng - lng_radius), max_column = column(*l, lng + lng_radius);
+    int32_t min_row = row(*l, lat - lat_radius), max_row = row(*l, lat + lat_radius);
+    for(int32_t r = min_row; r <= max_row; ++r) {
+      for(int32_t c = min_column; c <= max_column; ++c) {
+        auto color = grid[r * l->ncolumns + c];
+        if(color)
+          result.insert(color);
+      }
+    }
+
+    //and the tiles its edges are in
+    for(const auto& edge : location.edges) {
+      if(edge.id.level() != level || edge.id.tileid() >= l->ncolumns * l->nrows)
+        continue;
+      auto color = grid[edge.id.tileid()];
+      if(color)
+        result.insert(color);
+    }
+    return result;
+  }
+
+ protected:
+  const connectivity_file::level_t* levels() const {
+    return reinterpret_cast<const connectivity_file::level_t*>(data + sizeof(connectivity_file::header_t));
+  }
+
+  const connectivity_file::level_t* find(uint32_t level) const {
+    const auto* header = reinterpret_cast<const connectivity_file::header_t*>(data);
+    for(uint32_t i = 0; i < header->level_count; ++i)
+      if(levels()[i].level == level)
+        return &levels()[i];
+    return nullptr;
+  }
+
+  const uint32_t* colors(const connectivity_file::level_t& l) const {
+    return reinterpret_cast<const uint32_t*>(data + l.offset);
+  }
+
+  //clamped to the grid so locations off the edge still land on a tile
+  static int32_t column(const connectivity_file::level_t& l, float lng) {
+    int32_t c = std::floor((lng - l.min_lng) / l.tile_size);
+    return std::min(std::max(c, 0), static_cast<int32_t>(l.ncolumns) - 1);
+  }
+  static int32_t row(const connectivity_file::level_t& l, float lat) {
+    int32_t r = std::floor((lat - l.min_lat) / l.tile_size);
+    return std::min(std::max(r, 0), static_cast<int32_t>(l.nrows) - 1);
+  }
+
+  const char* data;
+  size_t size;
+};
+
+#endif
@@ -0,0 +1,100 @@
+// -*- mode: c++ -*-
+#ifndef VALHALLA_TOOLS_COSTING_CACHE_H_
+#define VALHALLA_TOOLS_COSTING_CACHE_H_
+
+#include <string>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <stdexcept>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <valhalla/sif/costfactory.h>
+
+/**
+ * Hands out costing methods for requests without merging the request's
+ * options into the config every time. The config's options for each costing
+ * are copied once, and each distinct set of request overrides is merged into
+ * them once, so a profile is keyed on the costing name plus the overrides
+ * and never touches the config it came from. Every call still gets its own
+ * DynamicCost because the path algorithms change them (relaxing hierarchy
+ * limits on a second pass for example) and that must not leak between
+ * requests. Safe to share between threads.
+ */
+class costing_cache_t {
+ public:
+  costing_cache_t(const boost::property_tree::ptree& config, size_t max_profiles = 1024)
+    : max_profiles(max_profiles), hits(0), misses(0) {
+    factory.Register("auto", valhalla::sif::CreateAutoCost);
+    factory.Register("auto_shorter", valhalla::sif::CreateAutoShorterCost);
+    factory.Register("bus", valhalla::sif::CreateBusCost);
+    factory.Register("bicycle", valhalla::sif::CreateBicycleCost);
+    factory.Register("pedestrian", valhalla::sif::CreatePedestrianCost);
+    factory.Register("truck", valhalla::sif::CreateTruckCost);
+    factory.Register("transit", valhalla::sif::CreateTransitCost);
+    //the profiles without any overrides are always there
+    auto options = config.get_child_optional("costing_options");
+    if(options) {
+      for(const auto& costing : *options)
+        base.emplace(costing.first, std::make_shared<const boost::property_tree::ptree>(costing.second));
+    }
+  }
+
+  //get a fresh costing method with any of the request's costing_options.<costing>
+  //applied on top of the config's
+  valhalla::sif::cost_ptr_t get(const boost::property_tree::ptree& request, const std::string& costing) {
+    auto found = base.find(costing);
+    if(found == base.cend())
+      throw std::runtime_error("No costing method found for '" + costing + "'");
+    auto request_costing = request.get_child_optional("costing_options." + costing);
+    if(!request_costing || request_costing->empty())
+      return factory.Create(costing, *found->second);
+
+    //look for a profile with these overrides
+    std::stringstream key;
+    key << costing << '\n';
+    boost::property_tree::write_json(key, *request_costing, false);
+    profile_t profile;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto cached = profiles.find(key.str());
+      if(cached != profiles.cend()) {
+        ++hits;
+        profile = cached->second;
+      }
+    }
+
+    //merge the overrides in, adding any options not in the config
+    if(!profile) {
+      auto merged = std::make_shared<boost::property_tree::ptree>(*found->second);
+      for(const auto& r : *request_costing)
+        merged->put_child(r.first, r.second);
+      profile = merged;
+      std::lock_guard<std::mutex> lock(mutex);
+      ++misses;
+      //requests with ever changing overrides shouldn't grow us forever
+      if(profiles.size() >= max_profiles)
+        profiles.clear();
+      profiles.emplace(key.str(), profile);
+    }
+    return factory.Create(costing, *profile);
+  }
+
+  //how often a profile with overrides was found or had to be merged
+  size_t profile_hits() const { return hits; }
+  size_t profile_misses() const { return misses; }
+
+ protected:
+  using profile_t = std::shared_ptr<const boost::property_tree::ptree>;
+  valhalla::sif::CostFactory<valhalla::sif::DynamicCost> factory;
+  std::unordered_map<std::string, profile_t> base;
+  std::mutex mutex;
+  std::unordered_map<std::string, profile_t> profiles;
+  size_t max_profiles;
+  size_t hits;
+  size_t misses;
+};
+
+#endif
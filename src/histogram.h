@@ -0,0 +1,91 @@
+// -*- mode: c++ -*-
+#ifndef VALHALLA_TOOLS_HISTOGRAM_H_
+#define VALHALLA_TOOLS_HISTOGRAM_H_
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+/**
+ * A log-linear histogram of non-negative integers (usually microseconds) in
+ * the spirit of HdrHistogram. Values below 128 each get their own bucket and
+ * above that every power of two is split into 64 buckets. So any percentile is
+ * reported to within 1/64th of the value that was recorded, in a fixed 30kb
+ * no matter how many values go in. Histograms recorded separately, say one
+ * per thread, can be merged afterwards without losing anything.
+ */
+class histogram_t {
+ public:
+  histogram_t() : counts(kBucketCount, 0), total(0), sum(0),
+    smallest(std::numeric_limits<uint64_t>::max()), largest(0) { }
+
+  void record(uint64_t value, uint64_t count = 1) {
+    counts[bucket(value)] += count;
+    total += count;
+    sum += static_cast<double>(value) * count;
+    smallest = std::min(smallest, value);
+    largest = std::max(largest, value);
+  }
+
+  void merge(const histogram_t& other) {
+    for(size_t i = 0; i < kBucketCount; ++i)
+      counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    smallest = std::min(smallest, other.smallest);
+    largest = std::max(largest, other.largest);
+  }
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return total ? smallest : 0; }
+  uint64_t max() const { return largest; }
+  double mean() const { return total ? sum / total : 0; }
+
+  //the value that the given fraction (ie 0.99) of recorded values are at or below
+  uint64_t percentile(double fraction) const {
+    if(total == 0)
+      return 0;
+    uint64_t target = static_cast<uint64_t>(std::ceil(fraction * total));
+    target = std::min(std::max(target, static_cast<uint64_t>(1)), total);
+    uint64_t seen = 0;
+    for(size_t i = 0; i < kBucketCount; ++i) {
+      seen += counts[i];
+      if(seen >= target)
+        return std::min(highest(i), largest);
+    }
+    return largest;
+  }
+
+  //the bucket a value is counted in
+  static size_t bucket(uint64_t value) {
+    if(value < kLinear)
+      return value;
+    size_t shift = (64 - __builtin_clzll(value)) - kSubBucketBits - 1;
+    return kLinear + (shift - 1) * kSubBuckets + ((value >> shift) - kSubBuckets);
+  }
+
+  //the largest value that would be counted in a bucket
+  static uint64_t highest(size_t bucket) {
+    if(bucket < kLinear)
+      return bucket;
+    size_t shift = (bucket - kLinear) / kSubBuckets + 1;
+    uint64_t top = (bucket - kLinear) % kSubBuckets + kSubBuckets;
+    return (top << shift) + ((static_cast<uint64_t>(1) << shift) - 1);
+  }
+
+  static constexpr size_t kSubBucketBits = 6;
+  static constexpr size_t kSubBuckets = 1 << kSubBucketBits;
+  static constexpr size_t kLinear = kSubBuckets * 2;
+  static constexpr size_t kBucketCount = kLinear + (64 - kSubBucketBits - 1) * kSubBuckets;
+
+ protected:
+  std::vector<uint64_t> counts;
+  uint64_t total;
+  double sum;
+  uint64_t smallest;
+  uint64_t largest;
+};
+
+#endif
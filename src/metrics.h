@@ -0,0 +1,272 @@
+// -*- mode: c++ -*-
+#ifndef VALHALLA_TOOLS_METRICS_H_
+#define VALHALLA_TOOLS_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <prime_server/prime_server.hpp>
+#include <prime_server/http_protocol.hpp>
+
+/**
+ * A histogram of durations that any number of threads can record into
+ * without locking, with the buckets of a Prometheus histogram so each one is
+ * a single atomic increment.
+ */
+class atomic_histogram_t {
+ public:
+  atomic_histogram_t() : total(0), sum(0) {
+    for(auto& count : counts)
+      count = 0;
+  }
+
+  void record(uint64_t microseconds) {
+    const auto& bounds = upper_bounds();
+    size_t i = 0;
+    while(i < bounds.size() && microseconds > bounds[i])
+      ++i;
+    counts[i].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(microseconds, std::memory_order_relaxed);
+  }
+
+  void render(std::ostream& out, const std::string& name, const std::string& labels) const {
+    std::string prefix = labels.empty() ? "" : labels + ",";
+    uint64_t cumulative = 0;
+    const auto& bounds = upper_bounds();
+    for(size_t i = 0; i < bounds.size(); ++i) {
+      cumulative += counts[i].load(std::memory_order_relaxed);
+      out << name << "_bucket{" << prefix << "le=\"" << bounds[i] * 1e-6 << "\"} " << cumulative << '\n';
+    }
+    cumulative += counts.back().load(std::memory_order_relaxed);
+    out << name << "_bucket{" << prefix << "le=\"+Inf\"} " << cumulative << '\n';
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << braces << ' ' << sum.load(std::memory_order_relaxed) * 1e-6 << '\n';
+    out << name << "_count" << braces << ' ' << total.load(std::memory_order_relaxed) << '\n';
+  }
+
+  //upper bounds of the buckets in microseconds, 100us to a minute
+  static const std::array<uint64_t, 18>& upper_bounds() {
+    static const std::array<uint64_t, 18> bounds {{
+      100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+      1000000, 2500000, 5000000, 10000000, 30000000, 60000000 }};
+    return bounds;
+  }
+
+ protected:
+  std::array<std::atomic<uint64_t>, 19> counts;
+  std::atomic<uint64_t> total;
+  std::atomic<uint64_t> sum;
+};
+
+/**
+ * The numbers a service exposes. Histograms and counters are made up front,
+ * while the service starts, and the references handed out stay valid so
+ * recording into them never takes a lock. Renders itself in the Prometheus
+ * text format.
+ */
+class metrics_t {
+ public:
+  atomic_histogram_t& histogram(const std::string& name, const std::string& help, const std::string& labels = "") {
+    std::lock_guard<std::mutex> lock(mutex);
+    histograms.emplace_back();
+    metrics.push_back({name, help, labels, &histograms.back(), nullptr});
+    return histograms.back();
+  }
+
+  std::atomic<uint64_t>& counter(const std::string& name, const std::string& help, const std::string& labels = "") {
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.emplace_back(0);
+    metrics.push_back({name, help, labels, nullptr, &counters.back()});
+    return counters.back();
+  }
+
+  std::string render() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::stringstream out;
+    std::unordered_map<std::string, bool> described;
+    for(const auto& metric : metrics) {
+      if(described.emplace(metric.name, true).second) {
+        out << "# HELP " << metric.name << ' ' << metric.help << '\n';
+        out << "# TYPE " << metric.name << (metric.histogram ? " histogram" : " counter") << '\n';
+      }
+      if(metric.histogram)
+        metric.histogram->render(out, metric.name, metric.labels);
+      else
+        out << metric.name << (metric.labels.empty() ? "" : "{" + metric.labels + "}") << ' '
+            << metric.counter->load(std::memory_order_relaxed) << '\n';
+    }
+    return out.str();
+  }
+
+ protected:
+  struct metric_t {
+    std::string name;
+    std::string help;
+    std::string labels;
+    atomic_histogram_t* histogram;
+    std::atomic<uint64_t>* counter;
+  };
+  std::mutex mutex;
+  std::deque<atomic_histogram_t> histograms;
+  std::deque<std::atomic<uint64_t> > counters;
+  std::vector<metric_t> metrics;
+};
+
+//microseconds since some fixed point, for timing across threads
+inline uint64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * The first and last stops a request makes through a service that we own,
+ * so that the service can be timed even though the library workers between
+ * them can't be. The front workers track() each request when they pick it
+ * up and answer the metrics path themselves. The workers send their results
+ * to the fill endpoint instead of the server's loopback, and relay() passes
+ * them on to the server, timing each against when it was tracked and
+ * counting it by status code. A request can be tracked with a tag, which is
+ * handed back with its result along with the request's info so the result
+ * can be rewritten for that request before it goes on to the server.
+ *
+ * Between the layers of a staged service taps can be put in the way, each
+ * calling passed() as a request goes by on its way to the next layer. The
+ * time since the request was tracked or last passed a tap is the time the
+ * layer it just left had it, and the time from the last tap to the result
+ * is the time of the layer that answered. The library workers take requests
+ * off their queues where we can't see, so a layer's time is its queue wait
+ * and its service time together.
+ */
+class front_stage_t {
+ public:
+  front_stage_t(metrics_t& metrics, const std::string& service)
+    : metrics(metrics), service(service), requests(metrics.histogram("valhalla_request_seconds",
+        "Time from a front worker picking a request up to its response", "service=\"" + service + "\"")) {
+    for(size_t i = 0; i < responses.size(); ++i)
+      responses[i] = &metrics.counter("valhalla_responses_total", "Responses by status code class",
+        "service=\"" + service + "\",code=\"" + (i ? std::to_string(i) + "xx" : std::string("other")) + "\"");
+  }
+
+  //answer the metrics path, returns false for any other request
+  bool metrics_response(const prime_server::http_request_t& request, prime_server::worker_t::result_t& result, void* request_info) {
+    if(request.path != "/metrics")
+      return false;
+    prime_server::http_response_t response(200, "OK", metrics.render(),
+      prime_server::headers_t{{"Content-Type", "text/plain; version=0.0.4"}});
+    response.from_info(*static_cast<prime_server::http_request_t::info_t*>(request_info));
+    result = prime_server::worker_t::result_t{false, {response.to_string()}};
+    return true;
+  }
+
+  //time the layers a request goes through, in the order it goes through them
+  void layers(const std::vector<std::string>& names) {
+    for(const auto& name : names)
+      layer_times.push_back(&metrics.histogram("valhalla_layer_seconds",
+        "Time a request spends in each layer of a staged service, queueing included",
+        "service=\"" + service + "\",layer=\"" + name + "\""));
+  }
+
+  //the request left the layer its in for the next one
+  void passed(const void* request_info) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = pending.find(info_key(request_info));
+    if(found == pending.end())
+      return;
+    auto now = now_us();
+    auto& tracked = found->second;
+    if(tracked.layer < layer_times.size())
+      layer_times[tracked.layer]->record(now - tracked.last);
+    ++tracked.layer;
+    tracked.last = now;
+  }
+
+  //remember when this request was picked up, tracking it again only
+  //changes its tag
+  void track(const void* request_info, std::string tag = "") {
+    std::lock_guard<std::mutex> lock(mutex);
+    //requests whose results never come back shouldn't pile up forever
+    if(pending.size() > kMaxPending)
+      pending.clear();
+    auto& tracked = pending[info_key(request_info)];
+    if(!tracked.start)
+      tracked.start = tracked.last = now_us();
+    tracked.tag = std::move(tag);
+  }
+
+  //pass the results on to the server, timing and counting them on the way
+  void relay(zmq::context_t& context, const std::string& fill_endpoint, const std::string& loopback,
+      const std::function<void (const std::string&, prime_server::http_request_t::info_t&, zmq::message_t&)>& on_result = nullptr) {
+    zmq::socket_t results(context, ZMQ_SUB);
+    results.setsockopt(ZMQ_SUBSCRIBE, "", 0);
+    results.bind(fill_endpoint.c_str());
+    zmq::socket_t server(context, ZMQ_PUB);
+    server.connect(loopback.c_str());
+    while(true) {
+      auto messages = results.recv_all(0);
+      if(messages.size() >= 2) {
+        std::string info(static_cast<const char*>(messages.front().data()), messages.front().size());
+        pending_t tracked;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          auto found = pending.find(info);
+          if(found != pending.end()) {
+            tracked = std::move(found->second);
+            pending.erase(found);
+          }
+        }
+        //HTTP/1.1 200 OK
+        auto& response = messages.back();
+        const char* status = static_cast<const char*>(response.data());
+        size_t code = response.size() > 9 && status[9] >= '1' && status[9] <= '5' ? status[9] - '0' : 0;
+        responses[code]->fetch_add(1, std::memory_order_relaxed);
+        if(tracked.start) {
+          auto now = now_us();
+          requests.record(now - tracked.start);
+          if(tracked.layer < layer_times.size())
+            layer_times[tracked.layer]->record(now - tracked.last);
+          if(on_result && info.size() == sizeof(prime_server::http_request_t::info_t)) {
+            prime_server::http_request_t::info_t request_info;
+            std::memcpy(&request_info, info.data(), sizeof(request_info));
+            on_result(tracked.tag, request_info, response);
+          }
+        }
+      }
+      server.send_all(messages, 0);
+    }
+  }
+
+  metrics_t& registry() { return metrics; }
+
+ protected:
+  static std::string info_key(const void* request_info) {
+    return std::string(static_cast<const char*>(request_info), sizeof(prime_server::http_request_t::info_t));
+  }
+
+  struct pending_t {
+    uint64_t start = 0;
+    uint64_t last = 0;
+    size_t layer = 0;
+    std::string tag;
+  };
+  static constexpr size_t kMaxPending = 65536;
+  metrics_t& metrics;
+  std::string service;
+  atomic_histogram_t& requests;
+  std::vector<atomic_histogram_t*> layer_times;
+  std::array<std::atomic<uint64_t>*, 6> responses;
+  std::mutex mutex;
+  std::unordered_map<std::string, pending_t> pending;
+};
+
+#endif
@@ -0,0 +1,87 @@
+// -*- mode: c++ -*-
+#ifndef VALHALLA_TOOLS_RESPONSE_CACHE_H_
+#define VALHALLA_TOOLS_RESPONSE_CACHE_H_
+
+#include <string>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <unordered_map>
+
+/**
+ * A least recently used cache of responses keyed on whatever the service
+ * decides makes two requests the same. Bounded by the bytes of the keys and
+ * responses it holds, and responses too big to be worth keeping are never
+ * kept. Counts hits, misses and evictions. Safe to share between threads.
+ */
+class response_cache_t {
+ public:
+  response_cache_t(size_t max_bytes, size_t max_entry_bytes)
+    : max_bytes(max_bytes), max_entry_bytes(max_entry_bytes), used(0), hit_count(0), miss_count(0),
+      eviction_count(0) { }
+
+  //copy the response for this key into response if we have it
+  bool get(const std::string& key, std::string& response) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(key);
+    if(found == index.end()) {
+      ++miss_count;
+      return false;
+    }
+    //its the most recently used now
+    entries.splice(entries.begin(), entries, found->second);
+    response = found->second->second;
+    ++hit_count;
+    return true;
+  }
+
+  //keep a response, making room by dropping the least recently used
+  void put(const std::string& key, const std::string& response) {
+    size_t bytes = key.size() + response.size();
+    if(bytes > max_entry_bytes || bytes > max_bytes)
+      return;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(key);
+    if(found != index.end()) {
+      used -= found->first.size() + found->second->second.size();
+      entries.erase(found->second);
+      index.erase(found);
+    }
+    while(used + bytes > max_bytes && !entries.empty()) {
+      used -= entries.back().first.size() + entries.back().second.size();
+      index.erase(entries.back().first);
+      entries.pop_back();
+      ++eviction_count;
+    }
+    entries.emplace_front(key, response);
+    index.emplace(key, entries.begin());
+    used += bytes;
+  }
+
+  size_t hits() const { return hit_count; }
+  size_t misses() const { return miss_count; }
+  size_t evictions() const { return eviction_count; }
+  size_t bytes() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return used;
+  }
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+  }
+
+ protected:
+  using entry_t = std::pair<std::string, std::string>;
+  size_t max_bytes;
+  size_t max_entry_bytes;
+  std::mutex mutex;
+  std::list<entry_t> entries;
+  std::unordered_map<std::string, std::list<entry_t>::iterator> index;
+  size_t used;
+  std::atomic<size_t> hit_count;
+  std::atomic<size_t> miss_count;
+  std::atomic<size_t> eviction_count;
+};
+
+#endif
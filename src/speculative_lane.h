@@ -0,0 +1,124 @@
+// -*- mode: c++ -*-
+#ifndef VALHALLA_TOOLS_SPECULATIVE_LANE_H_
+#define VALHALLA_TOOLS_SPECULATIVE_LANE_H_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <utility>
+
+/**
+ * A thread that runs one job at a time on behalf of another thread which
+ * may or may not end up wanting the result, like a relaxed pass of a route
+ * started while the first pass is still searching. The libraries can't be
+ * interrupted part way through a search so a job nobody wants anymore is
+ * abandoned rather than cancelled: it runs to the end, its result is dropped
+ * and until then the lane refuses new jobs so the caller can fall back to
+ * doing the work itself. Whatever the job touches must belong to the lane,
+ * nobody else may use it until the job is done or abandoned and idle again.
+ */
+template <class result_t>
+class speculative_lane_t {
+ public:
+  speculative_lane_t() : state(kIdle), abandoned(false), stopping(false),
+    thread(&speculative_lane_t::run, this) { }
+
+  ~speculative_lane_t() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+  }
+
+  //start a job, false if the lane is still busy with an abandoned one
+  bool start(std::function<result_t ()> next) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(state != kIdle)
+        return false;
+      job = std::move(next);
+      abandoned = false;
+      state = kRunning;
+    }
+    changed.notify_all();
+    return true;
+  }
+
+  //wait for the job to finish and take its result, rethrows what it threw
+  result_t get() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() { return state == kDone; });
+    state = kIdle;
+    if(error) {
+      auto thrown = error;
+      error = nullptr;
+      std::rethrow_exception(thrown);
+    }
+    return std::move(result);
+  }
+
+  //we don't want the result, the lane is idle again once the job finishes
+  void abandon() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(state == kRunning)
+      abandoned = true;
+    else if(state == kDone) {
+      result = result_t();
+      error = nullptr;
+      state = kIdle;
+    }
+  }
+
+  //whether a job could be started right now
+  bool idle() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return state == kIdle;
+  }
+
+ protected:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+      changed.wait(lock, [this]() { return stopping || state == kRunning; });
+      if(state != kRunning)
+        return;
+      auto current = std::move(job);
+      lock.unlock();
+      result_t done;
+      std::exception_ptr thrown;
+      try {
+        done = current();
+      }
+      catch(...) {
+        thrown = std::current_exception();
+      }
+      lock.lock();
+      if(abandoned) {
+        state = kIdle;
+      }
+      else {
+        result = std::move(done);
+        error = thrown;
+        state = kDone;
+      }
+      changed.notify_all();
+    }
+  }
+
+  enum state_t { kIdle, kRunning, kDone };
+  std::mutex mutex;
+  std::condition_variable changed;
+  state_t state;
+  bool abandoned;
+  bool stopping;
+  std::function<result_t ()> job;
+  result_t result;
+  std::exception_ptr error;
+  std::thread thread;
+};
+
+#endif
@@ -0,0 +1,249 @@
+// -*- mode: c++ -*-
+#ifndef VALHALLA_TOOLS_TILE_CACHE_H_
+#define VALHALLA_TOOLS_TILE_CACHE_H_
+
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <boost/optional.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <valhalla/baldr/graphid.h>
+#include <valhalla/baldr/graphtile.h>
+#include <valhalla/baldr/graphreader.h>
+
+/**
+ * A cache of tiles shared by all of the threads of a tool. Tiles never change
+ * once they are loaded and copies of a GraphTile share the same tile memory,
+ * so every thread can hold the same tiles while only one copy of them is
+ * resident. The cache is split into shards, each with its own lock, and
+ * keeps itself under a single memory budget by evicting tiles with the CLOCK
+ * algorithm. Every insert and eviction goes in a journal so the readers can
+ * follow along, the journal only keeps the most recent journal_size changes
+ * and a reader that falls further behind than that starts over.
+ */
+class tile_cache_t {
+ public:
+  tile_cache_t(size_t max_size, size_t shard_count = 64, size_t journal_size = 1 << 18)
+    : shards(std::max(shard_count, static_cast<size_t>(1))),
+      shard_budget(max_size / shards.size()),
+      journal_size(std::max(journal_size, static_cast<size_t>(1))), journal_start(0),
+      loaded(0), handed_out(0), evicted(0) { }
+
+  //a change to the cache
+  struct change_t {
+    valhalla::baldr::GraphId id;
+    bool evicted;
+  };
+
+  //get a copy of the tile if its in the cache
+  boost::optional<valhalla::baldr::GraphTile> find(const valhalla::baldr::GraphId& id) {
+    auto& shard = get_shard(id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(id);
+    if(found == shard.index.cend())
+      return boost::none;
+    auto& entry = shard.entries[found->second];
+    entry.referenced = true;
+    ++handed_out;
+    return entry.tile;
+  }
+
+  //add a tile loaded by one of the threads, if another thread beat us to it
+  //we get their copy back so that only one of them stays in memory
+  valhalla::baldr::GraphTile insert(const valhalla::baldr::GraphId& id, const valhalla::baldr::GraphTile& tile) {
+    auto& shard = get_shard(id);
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto found = shard.index.find(id);
+      if(found != shard.index.cend()) {
+        auto& entry = shard.entries[found->second];
+        entry.referenced = true;
+        return entry.tile;
+      }
+      shard.index.emplace(id, shard.entries.size());
+      shard.entries.emplace_back(entry_t{id, tile, true});
+      shard.size += tile.size();
+      ++loaded;
+      //let the other threads know about it, under the shard lock so that the
+      //changes to a tile are journaled in the order they happened
+      record(id, false);
+      evict(shard);
+    }
+    return tile;
+  }
+
+  //grab the changes made since the given position in the journal, returns
+  //the position to use next time. if some of the changes since then have
+  //already been dropped lagged is set and only the ones still kept are given
+  uint64_t since(uint64_t position, std::vector<change_t>& changes, bool& lagged) const {
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    lagged = position < journal_start;
+    position = std::max(position, journal_start);
+    for(; position < journal_start + journal.size(); ++position)
+      changes.push_back(journal[position - journal_start]);
+    return position;
+  }
+
+
+  //how many tiles were loaded from disk, handed to readers and evicted
+  size_t tiles_loaded() const { return loaded; }
+  size_t tiles_handed_out() const { return handed_out; }
+  size_t tiles_evicted() const { return evicted; }
+
+ protected:
+  struct entry_t {
+    valhalla::baldr::GraphId id;
+    valhalla::baldr::GraphTile tile;
+    bool referenced;
+  };
+
+  struct shard_t {
+    shard_t() : hand(0), size(0) { }
+    std::mutex mutex;
+    std::unordered_map<valhalla::baldr::GraphId, size_t> index;
+    std::vector<entry_t> entries;
+    size_t hand;
+    size_t size;
+  };
+
+  shard_t& get_shard(const valhalla::baldr::GraphId& id) {
+    return shards[std::hash<valhalla::baldr::GraphId>()(id) % shards.size()];
+  }
+
+  //sweep the clock hand around giving recently used tiles a second chance
+  void evict(shard_t& shard) {
+    while(shard.size > shard_budget && !shard.entries.empty()) {
+      if(shard.hand >= shard.entries.size())
+        shard.hand = 0;
+      auto& entry = shard.entries[shard.hand];
+      if(entry.referenced) {
+        entry.referenced = false;
+        ++shard.hand;
+        continue;
+      }
+      //the memory goes away when the last reader holding the tile lets go,
+      //which they do on their next Sync()
+      shard.size -= entry.tile.size();
+      shard.index.erase(entry.id);
+      record(entry.id, true);
+      if(shard.hand != shard.entries.size() - 1) {
+        entry = std::move(shard.entries.back());
+        shard.index[entry.id] = shard.hand;
+      }
+      shard.entries.pop_back();
+      ++evicted;
+    }
+  }
+
+  void record(const valhalla::baldr::GraphId& id, bool evicted) {
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    journal.push_back(change_t{id, evicted});
+    if(journal.size() > journal_size) {
+      journal.pop_front();
+      ++journal_start;
+    }
+  }
+
+  std::vector<shard_t> shards;
+  size_t shard_budget;
+  size_t journal_size;
+  mutable std::mutex journal_mutex;
+  std::deque<change_t> journal;
+  uint64_t journal_start;
+  std::atomic<size_t> loaded;
+  std::atomic<size_t> handed_out;
+  std::atomic<size_t> evicted;
+};
+
+/**
+ * A GraphReader handle onto a tile_cache_t, one per thread. The libraries
+ * look tiles up in the reader's own cache without going through anything we
+ * can override, so before a job Sync() copies in the tiles other threads
+ * have added to the shared cache, as many as fit in the reader's budget, and
+ * drops the ones the shared cache has evicted. After a job Share() hands the
+ * shared cache anything that had to be loaded from disk. Copies of tiles are
+ * cheap so this costs a few pointers per tile rather than the tiles
+ * themselves, and since readers let go of evicted tiles the tiles in memory
+ * stay within the shared budget plus what each reader loaded since its last
+ * Share(). Without a shared cache this is just a GraphReader.
+ */
+class cached_reader_t : public valhalla::baldr::GraphReader {
+ public:
+  cached_reader_t(const boost::property_tree::ptree& pt, tile_cache_t* shared = nullptr)
+    : valhalla::baldr::GraphReader(pt), shared(shared), position(0) { }
+
+  //pick up what the other threads have added to the shared cache and let go
+  //of what it evicted, must not be called while anyone is holding on to
+  //pointers into tiles from this reader
+  void Sync() {
+    if(!shared)
+      return;
+    changes.clear();
+    bool lagged;
+    position = shared->since(position, changes, lagged);
+    //we missed some evictions so we can't tell what to let go of
+    if(lagged)
+      Clear();
+    for(const auto& change : changes) {
+      auto cached = cache_.find(change.id);
+      if(change.evicted) {
+        //only our copy of the shared one, not one we loaded ourselves
+        if(cached != cache_.end() && known.erase(change.id)) {
+          cache_size_ -= cached->second.size();
+          cache_.erase(cached);
+        }
+        continue;
+      }
+      if(cached != cache_.end())
+        continue;
+      //it may have been evicted since
+      auto tile = shared->find(change.id);
+      if(!tile)
+        continue;
+      //the rest would only push us over budget, what we need we'll get back
+      //from the shared cache when we Share() after loading it
+      if(cache_size_ + tile->size() > max_cache_size_)
+        continue;
+      cache_size_ += tile->size();
+      cache_.emplace(change.id, *tile);
+      known.emplace(change.id);
+    }
+  }
+
+  //hand what we loaded to the shared cache, must not be called while anyone
+  //is holding on to pointers into tiles from this reader. returns how many
+  //tiles were loaded from disk since the last call
+  size_t Share() {
+    size_t loaded = 0;
+    for(auto& cached : cache_) {
+      if(!known.emplace(cached.first).second)
+        continue;
+      ++loaded;
+      if(shared)
+        cached.second = shared->insert(cached.first, cached.second);
+    }
+    return loaded;
+  }
+
+  //drops our copies of the tiles, the next Sync() only picks up what was
+  //added from here on rather than refilling us with the whole shared cache
+  void Clear() {
+    valhalla::baldr::GraphReader::Clear();
+    known.clear();
+  }
+
+ protected:
+  tile_cache_t* shared;
+  uint64_t position;
+  std::unordered_set<valhalla::baldr::GraphId> known;
+  std::vector<tile_cache_t::change_t> changes;
+};
+
+#endif
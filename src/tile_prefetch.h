@@ -0,0 +1,252 @@
+// -*- mode: c++ -*-
+#ifndef VALHALLA_TOOLS_TILE_PREFETCH_H_
+#define VALHALLA_TOOLS_TILE_PREFETCH_H_
+
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <list>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_set>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <valhalla/baldr/graphid.h>
+#include <valhalla/baldr/graphtile.h>
+#include <valhalla/baldr/graphreader.h>
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/midgard/pointll.h>
+#include <valhalla/midgard/logging.h>
+
+#include "tile_cache.h"
+#include "affinity.h"
+
+/**
+ * Works out which tiles a corpus of requests is going to want so they can be
+ * off of disk before the first request arrives. A route wants the tiles
+ * along the straight line between each location and the next on every level
+ * above the local one, and local tiles only near its locations since long
+ * routes leave the local level quickly. A box wants every tile under it on
+ * every level. Each tile picked brings its neighbours within buffer tiles
+ * along with it to allow for roads that wander off the straight line.
+ */
+class tile_prefetch_t {
+ public:
+  tile_prefetch_t(const valhalla::baldr::TileHierarchy& hierarchy, uint32_t buffer = 1, float local_km = 25.f)
+    : hierarchy(hierarchy), buffer(buffer), local_meters(local_km * 1000.f) { }
+
+  //the corridors between each location and the next
+  void add_route(const std::vector<valhalla::midgard::PointLL>& locations) {
+    //a single location is a corridor of one point
+    size_t corridors = locations.size() > 1 ? locations.size() - 1 : locations.size();
+    for(size_t i = 0; i < corridors; ++i) {
+      const auto& a = locations[i];
+      const auto& b = i + 1 < locations.size() ? locations[i + 1] : locations[i];
+      for(const auto& level : hierarchy.levels()) {
+        bool local = level.first == hierarchy.levels().rbegin()->first;
+        const auto& tiles = level.second.tiles;
+        //a couple of samples per tile is enough to touch every one the line crosses
+        float step = tiles.TileSize() / 2;
+        size_t samples = std::ceil(std::max(std::abs(b.lat() - a.lat()), std::abs(b.lng() - a.lng())) / step) + 1;
+        for(size_t s = 0; s <= samples; ++s) {
+          float t = static_cast<float>(s) / samples;
+          valhalla::midgard::PointLL p(a.lng() + (b.lng() - a.lng()) * t, a.lat() + (b.lat() - a.lat()) * t);
+          if(local && a.Distance(p) > local_meters && b.Distance(p) > local_meters)
+            continue;
+          add(level.first, tiles, tiles.TileId(p));
+        }
+      }
+    }
+  }
+
+  //every tile on every level under the box
+  void add_box(float min_lng, float min_lat, float max_lng, float max_lat) {
+    for(const auto& level : hierarchy.levels()) {
+      const auto& tiles = level.second.tiles;
+      auto min_id = tiles.TileId(valhalla::midgard::PointLL(min_lng, min_lat));
+      auto max_id = tiles.TileId(valhalla::midgard::PointLL(max_lng, max_lat));
+      if(min_id < 0 || max_id < 0)
+        continue;
+      for(auto row = tiles.Row(min_id); row <= tiles.Row(max_id); ++row)
+        for(auto column = tiles.Col(min_id); column <= tiles.Col(max_id); ++column)
+          add(level.first, tiles, row * tiles.ncolumns() + column, 0);
+    }
+  }
+
+  //a request file, one -j '{...}' or bare json request per line as in
+  //test_requests, or a list of boxes, one min_lng,min_lat,max_lng,max_lat
+  //per line. returns how many lines were used
+  size_t add_file(const std::string& file_name) {
+    std::ifstream file(file_name);
+    if(!file.is_open())
+      throw std::runtime_error("Could not open " + file_name);
+    size_t used = 0;
+    std::string line;
+    std::vector<valhalla::midgard::PointLL> locations;
+    while(std::getline(file, line)) {
+      auto first = line.find_first_not_of(" \t");
+      if(first == std::string::npos || line[first] == '#')
+        continue;
+      try {
+        //a request
+        auto j = line.find("-j");
+        if(j != std::string::npos || line[first] == '{') {
+          auto begin = j == std::string::npos ? first : line.find('\'', j) + 1;
+          auto end = j == std::string::npos ? line.size() : line.rfind('\'');
+          std::stringstream json(line.substr(begin, end - begin));
+          boost::property_tree::ptree request;
+          boost::property_tree::read_json(json, request);
+          locations.clear();
+          for(const auto& location : request.get_child("locations"))
+            locations.emplace_back(location.second.get<float>("lon"), location.second.get<float>("lat"));
+          add_route(locations);
+        }//a box
+        else {
+          std::replace(line.begin(), line.end(), ',', ' ');
+          std::stringstream box(line);
+          float min_lng, min_lat, max_lng, max_lat;
+          if(!(box >> min_lng >> min_lat >> max_lng >> max_lat))
+            continue;
+          add_box(min_lng, min_lat, max_lng, max_lat);
+        }
+        ++used;
+      }
+      catch(const std::exception& e) {
+        LOG_WARN("Skipping prefetch line: " + line);
+      }
+    }
+    return used;
+  }
+
+  //the tiles picked so far
+  std::vector<valhalla::baldr::GraphId> tiles() const {
+    std::vector<valhalla::baldr::GraphId> sorted(picked.cbegin(), picked.cend());
+    std::sort(sorted.begin(), sorted.end());
+    return sorted;
+  }
+
+  //ask the kernel to start reading the tiles' files in the background, this
+  //returns right away and warms the page cache for every process using the
+  //tiles. returns how many of the tiles exist
+  size_t advise() const {
+    size_t found = 0;
+    for(const auto& id : tiles()) {
+      int fd = open(path(id).c_str(), O_RDONLY);
+      if(fd == -1)
+        continue;
+#ifdef POSIX_FADV_WILLNEED
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+      close(fd);
+      ++found;
+    }
+    return found;
+  }
+
+  //read the tiles on a number of threads, kept on the given cpus if any so
+  //the tiles are allocated near them, and put them in the cache. returns
+  //how many were loaded
+  size_t load(tile_cache_t& cache, size_t threads, const std::vector<int>& cpus = {}) const {
+    auto ids = tiles();
+    std::atomic<size_t> next(0), loaded(0);
+    auto work = [&]() {
+      pin_this_thread(cpus);
+      for(size_t i = next++; i < ids.size(); i = next++) {
+        if(!valhalla::baldr::GraphReader::DoesTileExist(hierarchy, ids[i]))
+          continue;
+        valhalla::baldr::GraphTile tile(hierarchy, ids[i]);
+        if(tile.size() == 0)
+          continue;
+        cache.insert(ids[i], tile);
+        ++loaded;
+      }
+    };
+    std::list<std::thread> pool;
+    for(size_t i = 0; i < std::max(threads, static_cast<size_t>(1)); ++i)
+      pool.emplace_back(work);
+    for(auto& thread : pool)
+      thread.join();
+    return loaded;
+  }
+
+ protected:
+  //the tile and its neighbours
+  template <class tiles_t>
+  void add(uint8_t level, const tiles_t& tiles, int32_t id, int32_t reach = -1) {
+    if(id < 0 || id >= tiles.TileCount())
+      return;
+    if(reach < 0)
+      reach = buffer;
+    int32_t row = tiles.Row(id), column = tiles.Col(id);
+    for(int32_t r = std::max(row - reach, 0); r <= std::min(row + reach, tiles.nrows() - 1); ++r)
+      for(int32_t c = std::max(column - reach, 0); c <= std::min(column + reach, tiles.ncolumns() - 1); ++c)
+        picked.emplace(r * tiles.ncolumns() + c, level, 0);
+  }
+
+  std::string path(const valhalla::baldr::GraphId& id) const {
+    return hierarchy.tile_dir() + '/' + valhalla::baldr::GraphTile::FileSuffix(id, hierarchy);
+  }
+
+  valhalla::baldr::TileHierarchy hierarchy;
+  int32_t buffer;
+  float local_meters;
+  std::unordered_set<valhalla::baldr::GraphId> picked;
+};
+
+//the prefetch files a service's config lists under mjolnir.prefetch, either
+//one file or an array of them
+inline std::vector<std::string> prefetch_files(const boost::property_tree::ptree& config) {
+  std::vector<std::string> files;
+  auto prefetch = config.get_child_optional("mjolnir.prefetch");
+  if(!prefetch)
+    return files;
+  if(prefetch->empty() && !prefetch->data().empty())
+    files.push_back(prefetch->data());
+  for(const auto& file : *prefetch)
+    files.push_back(file.second.data());
+  return files;
+}
+
+//warm up for the requests and boxes in the files. the kernel is always told
+//about every tile, given caches the tiles are also loaded into each of them,
+//on threads kept to the matching set of cpus if there are any. returns how
+//many tiles were picked
+inline size_t prefetch_tiles(const boost::property_tree::ptree& config, const std::vector<std::string>& files,
+    const std::vector<tile_cache_t*>& caches = {}, size_t threads = std::thread::hardware_concurrency(),
+    const std::vector<std::vector<int> >& cpus = {}) {
+  if(files.empty())
+    return 0;
+  auto start = std::chrono::steady_clock::now();
+  valhalla::baldr::GraphReader reader(config.get_child("mjolnir"));
+  tile_prefetch_t prefetch(reader.GetTileHierarchy(), config.get<uint32_t>("mjolnir.prefetch_buffer", 1),
+    config.get<float>("mjolnir.prefetch_local_km", 25.f));
+  for(const auto& file : files) {
+    try {
+      LOG_INFO("Prefetching tiles for " + std::to_string(prefetch.add_file(file)) + " lines of " + file);
+    }
+    catch(const std::exception& e) {
+      LOG_WARN(e.what());
+    }
+  }
+  auto tiles = prefetch.tiles().size();
+  auto found = prefetch.advise();
+  for(size_t i = 0; i < caches.size(); ++i) {
+    auto loaded = prefetch.load(*caches[i], threads, cpus.empty() ? std::vector<int>() : cpus[i % cpus.size()]);
+    LOG_INFO("Loaded " + std::to_string(loaded) + " tiles into cache " + std::to_string(i));
+  }
+  auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  LOG_INFO("Prefetched " + std::to_string(found) + " of " + std::to_string(tiles) + " tiles in " +
+           std::to_string(seconds) + " seconds");
+  return tiles;
+}
+
+#endif
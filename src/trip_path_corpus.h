@@ -0,0 +1,118 @@
+// -*- mode: c++ -*-
+#ifndef VALHALLA_TOOLS_TRIP_PATH_CORPUS_H_
+#define VALHALLA_TOOLS_TRIP_PATH_CORPUS_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <stdexcept>
+
+#include <valhalla/proto/trippath.pb.h>
+#include <valhalla/proto/directions_options.pb.h>
+
+/**
+ * A file of the trip paths a routing run produced, so that directions can be
+ * built from them again without any graph. Each record is the serialized
+ * DirectionsOptions the path was built with followed by the serialized
+ * TripPath, each preceded by its length as a little endian uint32.
+ */
+namespace trip_path_corpus {
+
+  struct record_t {
+    std::string options;
+    std::string path;
+  };
+
+  //appends records, any number of threads can share one
+  class writer_t {
+   public:
+    explicit writer_t(const std::string& file_name) : file(fopen(file_name.c_str(), "wb")), records(0) {
+      if(!file)
+        throw std::runtime_error("Could not open " + file_name);
+    }
+    ~writer_t() {
+      if(file)
+        fclose(file);
+    }
+
+    //flush what is buffered and close the file, throws if any of it didn't make it out
+    void close() {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(!file)
+        return;
+      bool flushed = fflush(file) == 0;
+      bool closed = fclose(file) == 0;
+      file = nullptr;
+      if(!flushed || !closed)
+        throw std::runtime_error("Could not finish writing the trip path corpus");
+    }
+
+    void write(const valhalla::odin::DirectionsOptions& options, const valhalla::odin::TripPath& path) {
+      std::string record;
+      std::string serialized;
+      options.SerializeToString(&serialized);
+      append(record, serialized);
+      path.SerializeToString(&serialized);
+      append(record, serialized);
+      std::lock_guard<std::mutex> lock(mutex);
+      if(!file || fwrite(record.data(), 1, record.size(), file) != record.size())
+        throw std::runtime_error("Could not write the trip path corpus");
+      ++records;
+    }
+
+    size_t written() {
+      std::lock_guard<std::mutex> lock(mutex);
+      return records;
+    }
+
+   protected:
+    static void append(std::string& record, const std::string& bytes) {
+      uint32_t size = bytes.size();
+      for(int i = 0; i < 4; ++i)
+        record.push_back(static_cast<char>((size >> (i * 8)) & 0xff));
+      record += bytes;
+    }
+
+    FILE* file;
+    std::mutex mutex;
+    size_t records;
+  };
+
+  //every record in the file, throws if it ends part way through one
+  inline std::vector<record_t> read(const std::string& file_name) {
+    FILE* file = fopen(file_name.c_str(), "rb");
+    if(!file)
+      throw std::runtime_error("Could not open " + file_name);
+    std::vector<record_t> records;
+    auto next = [file](std::string& bytes) {
+      unsigned char size[4];
+      size_t got = fread(size, 1, sizeof(size), file);
+      if(got == 0)
+        return false;
+      if(got != sizeof(size))
+        throw std::runtime_error("Truncated trip path corpus");
+      bytes.resize(size[0] | size[1] << 8 | size[2] << 16 | static_cast<uint32_t>(size[3]) << 24);
+      if(!bytes.empty() && fread(&bytes[0], 1, bytes.size(), file) != bytes.size())
+        throw std::runtime_error("Truncated trip path corpus");
+      return true;
+    };
+    try {
+      record_t record;
+      while(next(record.options)) {
+        if(!next(record.path))
+          throw std::runtime_error("Truncated trip path corpus");
+        records.emplace_back(std::move(record));
+      }
+    }
+    catch(...) {
+      fclose(file);
+      throw;
+    }
+    fclose(file);
+    return records;
+  }
+}
+
+#endif
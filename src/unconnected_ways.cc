@@ -4,6 +4,14 @@
 #include <set>
 #include <tuple>
 #include <cmath>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <unordered_set>
+#include <algorithm>
+#include <stdexcept>
 #include <boost/program_options.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -17,12 +25,61 @@
 #include <valhalla/midgard/logging.h>
 #include <valhalla/midgard/pointll.h>
 #include <valhalla/midgard/aabb2.h>
+#include <valhalla/midgard/util.h>
 
 using namespace valhalla::midgard;
 using namespace valhalla::baldr;
 
 namespace bpo = boost::program_options;
 
+namespace {
+
+// Buffers lines and writes them out in large chunks. Writers on different
+// threads can share a file by sharing a lock, each chunk goes out whole
+struct writer_t {
+  writer_t(FILE* file, std::mutex* lock) : file(file), lock(lock) {
+    if (file)
+      buffer.reserve(kFlushSize * 2);
+  }
+  void tile_done() {
+    if (buffer.size() >= kFlushSize)
+      flush();
+  }
+  void flush() {
+    if (!file || buffer.empty())
+      return;
+    std::unique_lock<std::mutex> guard;
+    if (lock)
+      guard = std::unique_lock<std::mutex>(*lock);
+    if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+      throw std::runtime_error("Could not write the output");
+    buffer.clear();
+  }
+  static constexpr size_t kFlushSize = 4 * 1024 * 1024;
+  FILE* file;
+  std::mutex* lock;
+  std::string buffer;
+};
+
+// An output file and the lock its writers share, stdout if the name is empty
+struct output_t {
+  output_t(const std::string& name, bool wanted) : file(nullptr) {
+    if (!wanted)
+      return;
+    file = name.empty() || name == "-" ? stdout : fopen(name.c_str(), "wb");
+    if (!file)
+      throw std::runtime_error("Could not open " + name);
+  }
+  ~output_t() {
+    if (file && file != stdout)
+      fclose(file);
+  }
+  FILE* file;
+  std::mutex lock;
+};
+
+}
+
 // Main method for testing a single path
 int main(int argc, char *argv[]) {
   bpo::options_description options("unconnected_ways " VERSION "\n"
@@ -34,11 +91,17 @@ int main(int argc, char *argv[]) {
   "\n"
   "\n");
 
-  std::string minll, maxll, config;
+  std::string minll, maxll, config, output, tile_counts, shapes;
+  size_t threads = std::max(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(1));
   options.add_options()("help,h", "Print this help message.")(
       "version,v", "Print the version of this software.")(
       "min,n", boost::program_options::value<std::string>(&minll), "minll: lat,lng")(
       "max,x", boost::program_options::value<std::string>(&maxll), "maxll: lat,lng")
+      ("all,a", "Check every local tile instead of a bounding box.")
+      ("threads,t", bpo::value<size_t>(&threads), "Concurrency to use [default=hardware concurrency].")
+      ("output,o", bpo::value<std::string>(&output), "File to write the sorted unique unreachable way ids to, one per line [default=stdout].")
+      ("tile-counts", bpo::value<std::string>(&tile_counts), "Also write tile_id,unreachable_edges for each tile with any to this file, as the tiles are done.")
+      ("shapes", bpo::value<std::string>(&shapes), "Also write way_id,encoded_polyline6 for each unreachable edge to this file, as the tiles are done.")
       // positional arguments
       ("config,c", bpo::value<std::string>(&config), "Valhalla configuration file");
 
@@ -72,17 +135,23 @@ int main(int argc, char *argv[]) {
   // argument checking and verification
   AABB2<PointLL> bb;
   boost::property_tree::ptree json_ptree;
+  bool all = vm.count("all");
   for (auto arg : std::vector<std::string> { "min", "max", "config" }) {
+    if (all && arg != "config")
+      continue;
     if (vm.count(arg) == 0) {
       std::cerr
           << "The <" << arg  << "> mandatory argument was not provided\n";
       std::cerr << options << "\n";
       return EXIT_FAILURE;
     }
+  }
+  if (!all) {
     Location minloc = Location::FromCsv(minll);
     Location maxloc = Location::FromCsv(maxll);
     bb = AABB2<PointLL>(minloc.latlng_, maxloc.latlng_);
   }
+  threads = std::max(threads, static_cast<size_t>(1));
 
   // Parse the config
   boost::property_tree::ptree pt;
@@ -98,32 +167,120 @@ int main(int argc, char *argv[]) {
     valhalla::midgard::logging::Configure(logging_config);
   }
 
-  // Get graph reader
-  valhalla::baldr::GraphReader reader(pt.get_child("mjolnir.hierarchy"));
-
   // Get list of local tiles needed
+  valhalla::baldr::GraphReader reader(pt.get_child("mjolnir.hierarchy"));
   auto tile_hierarchy = reader.GetTileHierarchy();
   auto local_level = tile_hierarchy.levels().rbegin()->second.level;
   auto tiles = tile_hierarchy.levels().rbegin()->second.tiles;
-  std::vector<int32_t> tilelist = tiles.TileList(bb);
-
-  // Find unconnected way ids within the tiles
-  std::set<uint64_t> wayids;
-  for (auto local_tile : tilelist) {
-    GraphId tile_id(local_tile, local_level, 0);
-    const GraphTile* tile = reader.GetGraphTile(tile_id);
-    const DirectedEdge* de = tile->directededge(0);
-    for (uint32_t n = 0; n < tile->header()->directededgecount(); n++, de++) {
-      if (de->unreachable()) {
-        wayids.insert(tile->edgeinfo(de->edgeinfo_offset())->wayid());
+  std::vector<int32_t> tilelist;
+  if (all) {
+    for (int32_t i = 0; i < tiles.TileCount(); ++i)
+      tilelist.push_back(i);
+  } else {
+    tilelist = tiles.TileList(bb);
+  }
+  LOG_INFO("Checking " + std::to_string(tilelist.size()) + " tiles with " +
+           std::to_string(threads) + " threads");
+
+  // Find unconnected way ids within the tiles. Each thread takes the next
+  // tile and keeps its own list of ways, the per tile output goes out as soon
+  // as there is enough of it
+  output_t ways_output(output, true);
+  output_t counts_output(tile_counts, vm.count("tile-counts"));
+  output_t shapes_output(shapes, vm.count("shapes"));
+  std::vector<std::vector<uint64_t> > thread_wayids(threads);
+  std::atomic<size_t> next(0), edges(0), tiles_checked(0);
+  // The first thing to go wrong on any thread stops them all
+  std::atomic<bool> failed(false);
+  std::mutex error_lock;
+  std::string error;
+  auto work = [&](std::vector<uint64_t>& wayids) {
+    try {
+      valhalla::baldr::GraphReader thread_reader(pt.get_child("mjolnir.hierarchy"));
+      writer_t counts(counts_output.file, &counts_output.lock);
+      writer_t shapes(shapes_output.file, &shapes_output.lock);
+      std::unordered_set<uint32_t> shaped;
+      for (size_t i = next++; i < tilelist.size() && !failed; i = next++) {
+        if (thread_reader.OverCommitted())
+          thread_reader.Clear();
+        GraphId tile_id(tilelist[i], local_level, 0);
+        if (!thread_reader.DoesTileExist(tile_id))
+          continue;
+        const GraphTile* tile = thread_reader.GetGraphTile(tile_id);
+        if (!tile)
+          continue;
+        ++tiles_checked;
+        size_t unreachable = 0;
+        shaped.clear();
+        const DirectedEdge* de = tile->directededge(0);
+        for (uint32_t n = 0; n < tile->header()->directededgecount(); n++, de++) {
+          if (de->unreachable()) {
+            ++unreachable;
+            auto edgeinfo = tile->edgeinfo(de->edgeinfo_offset());
+            wayids.push_back(edgeinfo->wayid());
+            // Both directions share the shape, write it for whichever of them
+            // is unreachable first
+            if (shapes.file && shaped.insert(de->edgeinfo_offset()).second) {
+              shapes.buffer += std::to_string(edgeinfo->wayid());
+              shapes.buffer += ',';
+              shapes.buffer += encode(decode7<std::vector<PointLL> >(edgeinfo->encoded_shape()));
+              shapes.buffer += '\n';
+            }
+          }
+        }
+        edges += unreachable;
+        if (counts.file && unreachable) {
+          counts.buffer += std::to_string(tilelist[i]) + ',' + std::to_string(unreachable) + '\n';
+        }
+        counts.tile_done();
+        shapes.tile_done();
+        // Keep the lists from growing with duplicates on dense tiles
+        if (wayids.size() > (1 << 20)) {
+          std::sort(wayids.begin(), wayids.end());
+          wayids.erase(std::unique(wayids.begin(), wayids.end()), wayids.end());
+        }
       }
+      counts.flush();
+      shapes.flush();
+    } catch (const std::exception& e) {
+      std::lock_guard<std::mutex> guard(error_lock);
+      if (!failed.exchange(true))
+        error = e.what();
     }
+  };
+  std::list<std::thread> pool;
+  for (size_t i = 0; i < threads; ++i)
+    pool.emplace_back(work, std::ref(thread_wayids[i]));
+  for (auto& thread : pool)
+    thread.join();
+  if (failed) {
+    LOG_ERROR(error);
+    return EXIT_FAILURE;
   }
 
-  // Log the list of unreachable ways
-  LOG_INFO("unreachable ways:");
-  for (auto w : wayids) {
-    LOG_INFO(std::to_string(w));
+  // Sort and dedupe all the ways at once
+  std::vector<uint64_t> wayids;
+  for (auto& ids : thread_wayids) {
+    wayids.insert(wayids.end(), ids.cbegin(), ids.cend());
+    std::vector<uint64_t>().swap(ids);
+  }
+  std::sort(wayids.begin(), wayids.end());
+  wayids.erase(std::unique(wayids.begin(), wayids.end()), wayids.end());
+  LOG_INFO("Found " + std::to_string(edges) + " unreachable edges on " +
+           std::to_string(wayids.size()) + " ways in " + std::to_string(tiles_checked) + " tiles");
+
+  // Write out the list of unreachable ways
+  try {
+    writer_t ways(ways_output.file, nullptr);
+    for (auto w : wayids) {
+      ways.buffer += std::to_string(w);
+      ways.buffer += '\n';
+      ways.tile_done();
+    }
+    ways.flush();
+  } catch (const std::exception& e) {
+    LOG_ERROR(e.what());
+    return EXIT_FAILURE;
   }
 
   return EXIT_SUCCESS;
@@ -1,7 +1,14 @@
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <vector>
 #include <queue>
+#include <array>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <functional>
+#include <algorithm>
 #include <boost/program_options.hpp>
 
 #include <valhalla/midgard/util.h>
@@ -11,99 +18,614 @@
 
 #include <valhalla/baldr/double_bucket_queue.h>
 
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
 using namespace valhalla::midgard;
 using namespace valhalla::baldr;
 using namespace valhalla::sif;
 
 namespace bpo = boost::program_options;
 
-uint32_t GetRandom(const uint32_t maxcost) {
-  return (uint32_t)(rand01() * maxcost);
+namespace {
+
+/**
+ * Counts last level cache misses of this thread using perf events. Where
+ * that isn't available (not linux, or perf_event_paranoid doesn't allow it)
+ * the counts are just reported as unavailable.
+ */
+class CacheMissCounter {
+ public:
+  CacheMissCounter() : fd_(-1) {
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+  ~CacheMissCounter() {
+#ifdef __linux__
+    if (fd_ != -1)
+      close(fd_);
+#endif
+  }
+  bool available() const {
+    return fd_ != -1;
+  }
+  void Start() {
+#ifdef __linux__
+    if (fd_ != -1) {
+      ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+  uint64_t Stop() {
+    uint64_t count = 0;
+#ifdef __linux__
+    if (fd_ != -1) {
+      ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd_, &count, sizeof(count)) != sizeof(count))
+        count = 0;
+    }
+#endif
+    return count;
+  }
+
+ private:
+  int fd_;
+};
+
+// All of the queues hold edge label indexes and give back the one with the
+// lowest cost next, the same as the path algorithms use them.
+
+/**
+ * The approximate double bucket queue used by the path algorithms.
+ */
+class BucketQueue {
+ public:
+  BucketQueue(const float maxcost, const float bucketsize,
+              const std::function<float(uint32_t)>& edgecost)
+      : queue_(0, maxcost, bucketsize, edgecost) {
+  }
+  void add(const uint32_t label, const float cost) {
+    queue_.add(label, cost);
+  }
+  uint32_t pop() {
+    return queue_.pop();
+  }
+
+ private:
+  DoubleBucketQueue queue_;
+};
+
+/**
+ * A binary heap, via std::priority_queue.
+ */
+class STLQueue {
+ public:
+  void add(const uint32_t label, const float cost) {
+    queue_.emplace(cost, label);
+  }
+  uint32_t pop() {
+    if (queue_.empty())
+      return kInvalidLabel;
+    uint32_t label = queue_.top().second;
+    queue_.pop();
+    return label;
+  }
+
+ private:
+  using entry_t = std::pair<float, uint32_t>;
+  std::priority_queue<entry_t, std::vector<entry_t>, std::greater<entry_t> > queue_;
+};
+
+/**
+ * A D-ary min heap. A wider heap is shallower and each node's children share
+ * cache lines so sifting down touches less memory than a binary heap.
+ */
+template <size_t D>
+class DaryHeap {
+ public:
+  void add(const uint32_t label, const float cost) {
+    heap_.emplace_back(cost, label);
+    size_t i = heap_.size() - 1;
+    while (i > 0) {
+      size_t parent = (i - 1) / D;
+      if (heap_[parent].first <= heap_[i].first)
+        break;
+      std::swap(heap_[parent], heap_[i]);
+      i = parent;
+    }
+  }
+  uint32_t pop() {
+    if (heap_.empty())
+      return kInvalidLabel;
+    uint32_t label = heap_.front().second;
+    heap_.front() = heap_.back();
+    heap_.pop_back();
+    size_t i = 0;
+    while (true) {
+      size_t first = i * D + 1;
+      if (first >= heap_.size())
+        break;
+      size_t best = first;
+      size_t last = std::min(first + D, heap_.size());
+      for (size_t c = first + 1; c < last; c++) {
+        if (heap_[c].first < heap_[best].first)
+          best = c;
+      }
+      if (heap_[i].first <= heap_[best].first)
+        break;
+      std::swap(heap_[i], heap_[best]);
+      i = best;
+    }
+    return label;
+  }
+
+ private:
+  std::vector<std::pair<float, uint32_t> > heap_;
+};
+
+/**
+ * A radix heap. These only work when nothing cheaper than the last thing
+ * popped is ever added, which holds for a search with a consistent
+ * heuristic. Non-negative floats sort the same as their bits so those are
+ * the keys. Anything added below the last pop is treated as the last pop.
+ */
+class RadixHeap {
+ public:
+  RadixHeap() : last_(0), size_(0) {
+  }
+  void add(const uint32_t label, const float cost) {
+    uint32_t key;
+    memcpy(&key, &cost, sizeof(key));
+    key = std::max(key, last_);
+    buckets_[Bucket(key)].emplace_back(key, label);
+    size_++;
+  }
+  uint32_t pop() {
+    if (size_ == 0)
+      return kInvalidLabel;
+    if (buckets_[0].empty()) {
+      // Find the smallest key in the first non empty bucket and redistribute
+      // that bucket around it
+      size_t i = 1;
+      while (buckets_[i].empty())
+        i++;
+      last_ = std::min_element(buckets_[i].begin(), buckets_[i].end())->first;
+      for (const auto& entry : buckets_[i])
+        buckets_[Bucket(entry.first)].push_back(entry);
+      buckets_[i].clear();
+    }
+    uint32_t label = buckets_[0].back().second;
+    buckets_[0].pop_back();
+    size_--;
+    return label;
+  }
+
+ private:
+  size_t Bucket(const uint32_t key) const {
+    return key == last_ ? 0 : 32 - __builtin_clz(key ^ last_);
+  }
+
+  uint32_t last_;
+  size_t size_;
+  std::array<std::vector<std::pair<uint32_t, uint32_t> >, 33> buckets_;
+};
+
+// What came out of running a workload through one of the queues
+struct Result {
+  uint64_t ops;
+  double ns_per_op;
+  int64_t cache_misses;     // -1 if they couldn't be counted
+  uint64_t out_of_order;    // Pops cheaper than the one before them
+};
+
+/**
+ * The costs that drive a workload. For the search workload each pop adds
+ * branching[i] labels costing the popped cost plus the next delta, so the
+ * costs rise steadily with a bounded spread the way they do in an A*
+ * expansion. For the bulk workload the deltas are used as the costs.
+ */
+struct Workload {
+  std::vector<float> deltas;
+  std::vector<uint32_t> branching;
+  std::vector<float> revisits;    // How far back in the labels to relax, 0-1
+};
+
+// Build a workload. The edge cost deltas are read from a file (one per line,
+// for example dumped from a real search) or otherwise drawn from a gamma
+// distribution clipped to the spread. Branching is around 2, the number of
+// labels a road network expansion typically adds per node. The search
+// workload cycles through at most 4M of each so big runs don't spend their
+// memory on them.
+Workload MakeWorkload(const std::string& name, const uint32_t n,
+                      const float maxcost, const float spread,
+                      const std::vector<float>& recorded) {
+  std::mt19937 generator(n);
+  Workload workload;
+  const uint32_t size = name == "bulk" ? n : std::min(n, 1u << 22);
+  workload.deltas.resize(size);
+  if (name == "bulk") {
+    std::uniform_real_distribution<float> uniform(0.0f, maxcost);
+    for (auto& delta : workload.deltas)
+      delta = uniform(generator);
+  } else if (!recorded.empty()) {
+    std::uniform_int_distribution<size_t> pick(0, recorded.size() - 1);
+    for (auto& delta : workload.deltas)
+      delta = recorded[pick(generator)];
+  } else {
+    std::gamma_distribution<float> gamma(2.0f, spread / 8.0f);
+    for (auto& delta : workload.deltas)
+      delta = std::min(gamma(generator), spread);
+  }
+  std::discrete_distribution<uint32_t> branches({ 10, 20, 35, 25, 10 });
+  workload.branching.resize(size);
+  for (auto& b : workload.branching)
+    b = branches(generator);
+  // Neighbors that already have a label mostly got it recently
+  std::exponential_distribution<float> recent(8.0f);
+  workload.revisits.resize(size);
+  for (auto& r : workload.revisits)
+    r = std::min(recent(generator), 1.0f);
+  return workload;
 }
 
 /**
- * Benchmark of adjacency list. Constructs a large number of random numbers,
- * adds EdgeLabels to the AdjacencyList with those as the sortcost. Then
- * removes them from the list. This compares performance of an STL
- * priority_queue with the custom approximate double bucket sorting used
- * in adjacencylist.cc.
+ * Run a workload through a queue, timing it and counting cache misses. The
+ * labels live in a vector of EdgeLabels and each pop reads its label's sort
+ * cost, which is what the path algorithms do.
  */
-int Benchmark(const uint32_t n, const float maxcost,
-              const float bucketsize) {
-  // Create a set of random costs
-  std::vector<uint32_t> costs(n);
-  for (uint32_t i = 0; i < n; i++) {
-    costs[i] = (uint32_t)GetRandom(maxcost);
-  }
-
-  // Test performance of STL priority queue. Construct labels
-  // and add to the priority queue
-  std::clock_t start = std::clock();
-  std::priority_queue<EdgeLabel> pqueue;
-  for (uint32_t i = 0; i < n; i++) {
-    EdgeLabel el;
-    el.SetSortCost(costs[i]);
-    pqueue.push(std::move(el));
-  }
-
-  uint32_t count = 0;
-  std::vector<uint32_t> ordered_cost1;
-  while (!pqueue.empty()) {
-    EdgeLabel el = pqueue.top();
-    ordered_cost1.push_back(el.sortcost());
-    pqueue.pop();
-    count++;
-  }
-  uint32_t ms = (std::clock() - start) / static_cast<double>(CLOCKS_PER_SEC / 1000);
-  LOG_INFO("Priority Queue: Added and removed " + std::to_string(count) +
-           " edgelabels in " + std::to_string(ms) + " ms");
-
-  // Didn't alter the sort order of priority queue, so reverse the vector
-  std::reverse(ordered_cost1.begin(), ordered_cost1.end());
-
-  // Test performance of double bucket adjacency list. Set the bucket maxcost
-  // such that EmptyOverflow is called once
-  std::vector<EdgeLabel> edgelabels;
-  // Set up lambda to get sort costs
-  const auto edgecost = [&edgelabels](const uint32_t label) {
-    return edgelabels[label].sortcost();
+template <class queue_t>
+Result Run(queue_t& queue, std::vector<EdgeLabel>& labels,
+           const std::string& name, const Workload& workload, const uint32_t n,
+           CacheMissCounter& counter) {
+  Result result{0, 0.0, -1, 0};
+  labels.clear();
+  labels.reserve(n);
+  double checksum = 0.0;
+  float previous = 0.0f;
+  auto popped = [&](const uint32_t idx) {
+    float cost = labels[idx].sortcost();
+    if (cost < previous)
+      result.out_of_order++;
+    previous = cost;
+    checksum += cost;
+    return cost;
   };
-  start = std::clock();
-  DoubleBucketQueue adjlist(0, maxcost / 2, bucketsize, edgecost);
 
-  // Construct EdgeLabels and add to adjacency list
+  if (name == "bulk") {
+    // All of the adds and then all of the pops
+    for (uint32_t i = 0; i < n; i++) {
+      EdgeLabel el;
+      el.SetSortCost(workload.deltas[i]);
+      labels.emplace_back(std::move(el));
+    }
+    counter.Start();
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < n; i++)
+      queue.add(i, workload.deltas[i]);
+    uint32_t idx;
+    while ((idx = queue.pop()) != kInvalidLabel)
+      popped(idx);
+    auto end = std::chrono::steady_clock::now();
+    result.cache_misses = counter.available() ? counter.Stop() : -1;
+    result.ops = 2 * static_cast<uint64_t>(n);
+    result.ns_per_op = std::chrono::duration<double, std::nano>(end - start).count() / result.ops;
+  } else {
+    // Pop the cheapest label and add its neighbors until n labels have been
+    // made and they have all been popped
+    counter.Start();
+    auto start = std::chrono::steady_clock::now();
+    EdgeLabel origin;
+    origin.SetSortCost(0.0f);
+    labels.emplace_back(std::move(origin));
+    queue.add(0, 0.0f);
+    result.ops = 1;
+    size_t d = 0, b = 0;
+    uint32_t idx;
+    while ((idx = queue.pop()) != kInvalidLabel) {
+      result.ops++;
+      float cost = popped(idx);
+      uint32_t branches = workload.branching[b++ % workload.branching.size()];
+      for (uint32_t i = 0; i < branches && labels.size() < n; i++) {
+        EdgeLabel el;
+        float child = cost + workload.deltas[d++ % workload.deltas.size()];
+        el.SetSortCost(child);
+        labels.emplace_back(std::move(el));
+        queue.add(labels.size() - 1, child);
+        result.ops++;
+      }
+      // Never let the search die out before its made n labels
+      if (labels.size() < n && b % 64 == 0) {
+        EdgeLabel el;
+        el.SetSortCost(cost + workload.deltas[d++ % workload.deltas.size()]);
+        labels.emplace_back(std::move(el));
+        queue.add(labels.size() - 1, labels.back().sortcost());
+        result.ops++;
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    result.cache_misses = counter.available() ? counter.Stop() : -1;
+    result.ns_per_op = std::chrono::duration<double, std::nano>(end - start).count() / result.ops;
+  }
+
+  if (checksum < 0.0)
+    LOG_ERROR("Negative costs?");
+  return result;
+}
+
+void LogResult(const std::string& name, const uint32_t n, const std::string& bucketsize,
+               const float maxcost, const std::string& queue, const Result& result) {
+  std::string misses = result.cache_misses < 0 ? "n/a" :
+      std::to_string(static_cast<double>(result.cache_misses) / result.ops);
+  LOG_INFO(name + "," + std::to_string(n) + "," + bucketsize + "," +
+           std::to_string(maxcost) + "," + queue + "," + std::to_string(result.ops) + "," +
+           std::to_string(result.ns_per_op) + "," + misses + "," +
+           std::to_string(result.out_of_order));
+}
+
+// The part of a label the queue and relaxing touch, kept dense
+struct HotLabel {
+  float sortcost;
+  uint32_t predecessor;
+};
+
+// The rest of what an EdgeLabel holds, only needed when it's expanded
+struct ColdLabel {
+  uint64_t edgeid;
+  uint64_t endnode;
+  float cost;
+  float secs;
+  float distance;
+  uint32_t restrictions;
+  uint32_t opp_local_idx;
+  uint8_t mode;
+  uint8_t use;
+  uint8_t flags;
+};
 
-  for (uint32_t i = 0; i < n; i++) {
+/**
+ * Labels the way the path algorithms keep them: a vector of EdgeLabels
+ * that is copied on every pop.
+ */
+class EdgeLabelStore {
+ public:
+  static constexpr const char* kName = "edgelabel";
+  static constexpr size_t kLabelSize = sizeof(EdgeLabel);
+  void reserve(const uint32_t n) {
+    labels_.clear();
+    labels_.reserve(n);
+  }
+  size_t size() const {
+    return labels_.size();
+  }
+  size_t bytes() const {
+    return labels_.capacity() * sizeof(EdgeLabel);
+  }
+  float cost(const uint32_t label) const {
+    return labels_[label].sortcost();
+  }
+  void add(const uint32_t predecessor, const float cost) {
     EdgeLabel el;
-    el.SetSortCost(costs[i]);
-    edgelabels.push_back(std::move(el));
-    adjlist.add(i, costs[i]);
-  }
-
-  // Get edge label indexes from the adj list. Accumulate total cost to make
-  // sure compiler doesn't optimize too much.
-  count = 0;
-  std::vector<uint32_t> ordered_cost2;
-  while (true) {
-    uint32_t idx = adjlist.pop();
-    if (idx == kInvalidLabel) {
-      break;
+    el.SetSortCost(cost);
+    labels_.emplace_back(std::move(el));
+  }
+  // Copy the label like the path algorithms do before expanding it
+  uint64_t expand(const uint32_t label) const {
+    EdgeLabel pred = labels_[label];
+    return pred.predecessor();
+  }
+  // The predecessor is on the same cache line as the sort cost so only
+  // writing the cost costs the same memory traffic
+  void relax(const uint32_t label, const uint32_t predecessor, const float cost) {
+    labels_[label].SetSortCost(cost);
+  }
+
+ private:
+  std::vector<EdgeLabel> labels_;
+};
+
+/**
+ * Labels split into a dense array of sort costs and predecessors, which is
+ * all the queue and relaxing read or write, and an array of the rest,
+ * which is only read once when a label is expanded.
+ */
+class SplitLabelStore {
+ public:
+  static constexpr const char* kName = "hot_cold";
+  static constexpr size_t kLabelSize = sizeof(HotLabel) + sizeof(ColdLabel);
+  void reserve(const uint32_t n) {
+    hot_.clear();
+    cold_.clear();
+    hot_.reserve(n);
+    cold_.reserve(n);
+  }
+  size_t size() const {
+    return hot_.size();
+  }
+  size_t bytes() const {
+    return hot_.capacity() * sizeof(HotLabel) + cold_.capacity() * sizeof(ColdLabel);
+  }
+  float cost(const uint32_t label) const {
+    return hot_[label].sortcost;
+  }
+  void add(const uint32_t predecessor, const float cost) {
+    hot_.push_back({ cost, predecessor });
+    cold_.push_back({ hot_.size(), hot_.size(), cost, cost, 0.0f, 0, 0, 0, 0, 0 });
+  }
+  uint64_t expand(const uint32_t label) const {
+    const ColdLabel& cold = cold_[label];
+    return hot_[label].predecessor + cold.edgeid + cold.endnode + cold.mode;
+  }
+  void relax(const uint32_t label, const uint32_t predecessor, const float cost) {
+    hot_[label] = { cost, predecessor };
+  }
+
+ private:
+  std::vector<HotLabel> hot_;
+  std::vector<ColdLabel> cold_;
+};
+
+/**
+ * Run the search workload against a label store with the double bucket
+ * queue. Each pop expands the label, adds its new neighbors and relaxes
+ * one neighbor that already has a label if the new path to it is cheaper.
+ */
+template <class store_t>
+void RunLabels(store_t& store, const Workload& workload, const uint32_t n,
+               const float maxcost, const float bucketsize, CacheMissCounter& counter) {
+  store.reserve(n);
+  std::vector<bool> done;
+  done.reserve(n);
+  DoubleBucketQueue queue(0, maxcost, bucketsize,
+      [&store](const uint32_t label) { return store.cost(label); });
+
+  counter.Start();
+  auto start = std::chrono::steady_clock::now();
+  uint64_t adds = 1, pops = 0, relaxes = 0;
+  volatile uint64_t checksum = 0;
+  store.add(kInvalidLabel, 0.0f);
+  done.push_back(false);
+  queue.add(0, 0.0f);
+  size_t d = 0, b = 0, r = 0;
+  uint32_t idx;
+  while ((idx = queue.pop()) != kInvalidLabel) {
+    pops++;
+    done[idx] = true;
+    float cost = store.cost(idx);
+    checksum = checksum + store.expand(idx);
+
+    // New neighbors
+    uint32_t branches = workload.branching[b++ % workload.branching.size()];
+    if (b % 64 == 0)
+      branches++;
+    for (uint32_t i = 0; i < branches && store.size() < n; i++) {
+      float child = cost + workload.deltas[d++ % workload.deltas.size()];
+      store.add(idx, child);
+      done.push_back(false);
+      queue.add(store.size() - 1, child);
+      adds++;
+    }
+
+    // A neighbor that already has a label
+    uint32_t back = workload.revisits[r++ % workload.revisits.size()] * (store.size() - 1);
+    uint32_t other = store.size() - 1 - back;
+    float relaxed = cost + workload.deltas[d++ % workload.deltas.size()];
+    float current = store.cost(other);
+    if (!done[other] && relaxed < current) {
+      queue.decrease(other, relaxed, current);
+      store.relax(other, idx, relaxed);
+      relaxes++;
     }
+  }
+  auto end = std::chrono::steady_clock::now();
+  int64_t misses = counter.available() ? counter.Stop() : -1;
+
+  uint64_t ops = adds + pops + relaxes;
+  double seconds = std::chrono::duration<double>(end - start).count();
+  std::string misses_per_op = misses < 0 ? "n/a" :
+      std::to_string(static_cast<double>(misses) / ops);
+  LOG_INFO(std::string(store_t::kName) + "," + std::to_string(n) + "," +
+           std::to_string(bucketsize) + "," + std::to_string(maxcost) + "," +
+           std::to_string(adds) + "," + std::to_string(pops) + "," + std::to_string(relaxes) + "," +
+           std::to_string(ops / seconds) + "," + std::to_string(seconds * 1e9 / ops) + "," +
+           misses_per_op + "," + std::to_string(store_t::kLabelSize) + "," +
+           std::to_string(static_cast<double>(store.bytes()) / store.size()));
+}
 
-    // Copy the edge label - simulates what is done in PathAlgorithm
-    EdgeLabel el = edgelabels[idx];
-    ordered_cost2.push_back(el.sortcost());
-    count++;
+}
+
+/**
+ * Benchmark of the adjacency list. For each workload, count and maxcost the
+ * same costs are run through the double bucket queue at each bucket size and
+ * through a binary heap (the STL priority_queue), a 4-ary heap and a radix
+ * heap. Reports the time per add or pop and the cache misses per add or pop.
+ */
+int Benchmark(const std::vector<std::string>& workloads,
+              const std::vector<uint32_t>& counts,
+              const std::vector<float>& maxcosts,
+              const std::vector<float>& bucketsizes,
+              const float spread, const std::vector<float>& recorded) {
+  CacheMissCounter counter;
+  if (!counter.available())
+    LOG_INFO("Cache misses can't be counted here");
+  LOG_INFO("workload,count,bucketsize,maxcost,queue,ops,ns_per_op,cache_misses_per_op,out_of_order_pops");
+
+  std::vector<EdgeLabel> labels;
+  const auto edgecost = [&labels](const uint32_t label) {
+    return labels[label].sortcost();
+  };
+  for (const auto& name : workloads) {
+    for (auto n : counts) {
+      for (auto maxcost : maxcosts) {
+        auto workload = MakeWorkload(name, n, maxcost, spread, recorded);
+        for (auto bucketsize : bucketsizes) {
+          BucketQueue queue(maxcost, bucketsize, edgecost);
+          LogResult(name, n, std::to_string(bucketsize), maxcost, "double_bucket",
+                    Run(queue, labels, name, workload, n, counter));
+        }
+        {
+          STLQueue queue;
+          LogResult(name, n, "", maxcost, "priority_queue",
+                    Run(queue, labels, name, workload, n, counter));
+        }
+        {
+          DaryHeap<4> queue;
+          LogResult(name, n, "", maxcost, "4-ary_heap",
+                    Run(queue, labels, name, workload, n, counter));
+        }
+        {
+          RadixHeap queue;
+          LogResult(name, n, "", maxcost, "radix_heap",
+                    Run(queue, labels, name, workload, n, counter));
+        }
+      }
+    }
   }
-  ms = (std::clock() - start) / static_cast<double>(CLOCKS_PER_SEC / 1000);
-  LOG_INFO("Bucketed Adj. List: Added and removed " + std::to_string(count) +
-           " edgelabels in " + std::to_string(ms) + " ms");
+  return 0;
+}
 
-  // Verify order
-  for (uint32_t i = 0; i < count; i++) {
-    if (ordered_cost1[i] != ordered_cost2[i]) {
-      LOG_INFO("Costs: " + std::to_string(ordered_cost1[i]) + "," +
-               std::to_string(ordered_cost2[i]));
+/**
+ * Benchmark of how edge labels are stored. Runs the same search through the
+ * current vector of EdgeLabels and through labels split into hot and cold
+ * arrays, reporting the throughput of adds, pops and relaxes and the memory
+ * used per label.
+ */
+int BenchmarkLabels(const std::vector<uint32_t>& counts,
+                    const std::vector<float>& maxcosts,
+                    const std::vector<float>& bucketsizes,
+                    const float spread, const std::vector<float>& recorded) {
+  CacheMissCounter counter;
+  if (!counter.available())
+    LOG_INFO("Cache misses can't be counted here");
+  LOG_INFO("store,count,bucketsize,maxcost,adds,pops,relaxes,ops_per_second,ns_per_op,"
+           "cache_misses_per_op,label_bytes,bytes_per_label");
+
+  for (auto n : counts) {
+    for (auto maxcost : maxcosts) {
+      auto workload = MakeWorkload("search", n, maxcost, spread, recorded);
+      for (auto bucketsize : bucketsizes) {
+        {
+          EdgeLabelStore store;
+          RunLabels(store, workload, n, maxcost, bucketsize, counter);
+        }
+        {
+          SplitLabelStore store;
+          RunLabels(store, workload, n, maxcost, bucketsize, counter);
+        }
+      }
     }
   }
   return 0;
@@ -116,14 +638,37 @@ int main(int argc, char *argv[]) {
   "\n"
   " Usage: adjlistbenchmark [options]\n"
   "\n"
-  "adjlistbenchmark is benchmark comparing performance of an STL priority_queue"
-  "to the approximate double bucket adjacency list class supplied with Valhalla."
+  "adjlistbenchmark is benchmark comparing performance of an STL priority_queue, "
+  "a 4-ary heap and a radix heap to the approximate double bucket adjacency list "
+  "class supplied with Valhalla. Every combination of the workloads, counts, "
+  "maximum costs and bucket sizes is run and reported as a csv line. In labels "
+  "mode it instead compares storing edge labels as a vector of EdgeLabels to "
+  "splitting them into hot and cold arrays."
   "\n"
   "\n");
 
+  std::vector<std::string> workloads = { "search", "bulk" };
+  std::vector<uint32_t> counts = { 100000, 1000000 };
+  std::vector<float> maxcosts = { 10000, 50000 };
+  std::vector<float> bucketsizes = { 1, 5, 20 };
+  float spread = 100.0f;
+  std::string deltas_file, mode = "queues";
   options.add_options()
     ("help,h", "Print this help message.")
     ("version,v", "Print the version of this software.")
+    ("mode", bpo::value<std::string>(&mode),
+     "queues: compare the queues. labels: compare edge label layouts, by default at 1M, 10M and 50M labels.")
+    ("workloads,w", bpo::value<std::vector<std::string> >(&workloads)->multitoken(),
+     "search: interleaved adds and pops with costs that rise like an A* expansion. "
+     "bulk: uniform random costs, all added then all popped.")
+    ("counts,n", bpo::value<std::vector<uint32_t> >(&counts)->multitoken(), "Number of edge labels.")
+    ("maxcosts,m", bpo::value<std::vector<float> >(&maxcosts)->multitoken(),
+     "Cost range of the double bucket queue, and of the costs in the bulk workload.")
+    ("bucketsizes,b", bpo::value<std::vector<float> >(&bucketsizes)->multitoken(),
+     "Bucket sizes of the double bucket queue.")
+    ("spread,s", bpo::value<float>(&spread), "Largest cost increase from one label to the next in the search workload.")
+    ("deltas,d", bpo::value<std::string>(&deltas_file),
+     "File of cost increases, one per line, recorded from a real search to use in the search workload.")
     ;
 
   bpo::variables_map vm;
@@ -147,8 +692,36 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
   }
 
-  // Benchmark with count, maxcost, and bucketsize
-  Benchmark(1000000, 50000, 1);
+  for (const auto& name : workloads) {
+    if (name != "search" && name != "bulk") {
+      std::cerr << "Unknown workload: " << name << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Cost increases from a real search
+  std::vector<float> recorded;
+  if (!deltas_file.empty()) {
+    std::ifstream file(deltas_file);
+    float delta;
+    while (file >> delta) {
+      if (delta >= 0.0f)
+        recorded.push_back(delta);
+    }
+    LOG_INFO("Read " + std::to_string(recorded.size()) + " cost increases from " + deltas_file);
+  }
+
+  if (mode == "labels") {
+    if (!vm.count("counts"))
+      counts = { 1000000, 10000000, 50000000 };
+    BenchmarkLabels(counts, maxcosts, bucketsizes, spread, recorded);
+  }
+  else if (mode == "queues")
+    Benchmark(workloads, counts, maxcosts, bucketsizes, spread, recorded);
+  else {
+    std::cerr << "Unknown mode: " << mode << "\n";
+    return EXIT_FAILURE;
+  }
   LOG_INFO("Done Benchmark!");
 
   return EXIT_SUCCESS;
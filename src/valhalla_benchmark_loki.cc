@@ -1,4 +1,7 @@
 #include "config.h"
+#include "tile_cache.h"
+#include "histogram.h"
+#include "tile_prefetch.h"
 
 #include <valhalla/loki/search.h>
 #include <valhalla/midgard/logging.h>
@@ -8,49 +11,123 @@
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/optional.hpp>
 #include <boost/filesystem/operations.hpp>
-#include <boost/lockfree/queue.hpp>
 #include <fstream>
 #include <string>
 #include <thread>
 #include <future>
 #include <vector>
 #include <list>
-#include <set>
+#include <atomic>
+#include <chrono>
+#include <array>
 #include <tuple>
 #include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
 
 namespace bpo = boost::program_options;
 
 boost::filesystem::path config_file_path;
 size_t threads = std::max(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(1));
 std::vector<std::string> input_files;
-std::atomic<bool> done(false);
+bool shared_cache = false;
+std::string schedule = "file";
+std::vector<std::string> prefetch;
 
 struct job_t{
   float lng, lat;
 };
-boost::lockfree::queue<job_t> jobs(1024);
-struct result_t {
-  std::chrono::milliseconds time;
-  bool pass;
-  job_t job;
-  bool cached;
-  bool operator<(const result_t& other) const {
-    if(cached < other.cached)
-      return true;
-    if(time < other.time)
-      return true;
-    if(pass < other.pass)
-      return true;
-    if(job.lng == other.job.lng)
-      return job.lat < other.job.lat;
-    return job.lng < other.job.lng;
+std::vector<job_t> jobs;
+//jobs are handed out in runs, a thread does all the jobs in a run
+std::vector<size_t> runs;
+std::atomic<size_t> next_run(0);
+
+//the statistics for one kind of result, ie failed searches on cached tiles
+struct stats_t {
+  stats_t() : sum_squares(0), fastest{0, 0}, slowest{0, 0} { }
+  void record(uint64_t usec, const job_t& job) {
+    if(histogram.count() == 0 || usec < histogram.min())
+      fastest = job;
+    if(histogram.count() == 0 || usec > histogram.max())
+      slowest = job;
+    histogram.record(usec);
+    sum_squares += static_cast<double>(usec) * usec;
   }
-  bool operator==(const result_t& other) const {
-    return cached == other.cached && time == other.time && pass == other.pass && job.lng == other.job.lng && job.lat == other.job.lat;
+  void merge(const stats_t& other) {
+    if(other.histogram.count() == 0)
+      return;
+    if(histogram.count() == 0 || other.histogram.min() < histogram.min())
+      fastest = other.fastest;
+    if(histogram.count() == 0 || other.histogram.max() > histogram.max())
+      slowest = other.slowest;
+    histogram.merge(other.histogram);
+    sum_squares += other.sum_squares;
   }
+  histogram_t histogram;
+  double sum_squares;
+  job_t fastest, slowest;
+};
+struct results_t {
+  results_t() : tiles_loaded(0) { }
+  //indexed by [cached][pass]
+  std::array<std::array<stats_t, 2>, 2> stats;
+  size_t tiles_loaded;
 };
-using results_t = std::set<result_t>;
+
+//distance along a hilbert curve filling an n by n grid, n a power of 2
+uint64_t hilbert(uint32_t n, uint32_t x, uint32_t y) {
+  uint64_t d = 0;
+  for(uint32_t s = n / 2; s > 0; s /= 2) {
+    uint32_t rx = (x & s) > 0;
+    uint32_t ry = (y & s) > 0;
+    d += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+    if(ry == 0) {
+      if(rx == 1) {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
+//order the jobs so that the ones in the same local tile are done together
+void schedule_jobs(const boost::property_tree::ptree& config) {
+  runs.clear();
+  if(schedule == "file") {
+    for(size_t i = 0; i <= jobs.size(); ++i)
+      runs.push_back(i);
+    return;
+  }
+
+  //key each job on its tile or where its tile falls on the curve
+  valhalla::baldr::GraphReader reader(config.get_child("mjolnir"));
+  const auto& tiles = reader.GetTileHierarchy().levels().rbegin()->second.tiles;
+  uint32_t n = 1;
+  while(n < static_cast<uint32_t>(std::max(tiles.ncolumns(), tiles.nrows())))
+    n <<= 1;
+  std::vector<std::pair<uint64_t, job_t> > keyed;
+  keyed.reserve(jobs.size());
+  for(const auto& job : jobs) {
+    auto id = tiles.TileId(valhalla::midgard::PointLL(job.lng, job.lat));
+    uint64_t key = std::numeric_limits<uint64_t>::max();
+    if(id >= 0)
+      key = schedule == "tile" ? id : hilbert(n, tiles.Col(id), tiles.Row(id));
+    keyed.emplace_back(key, job);
+  }
+  std::stable_sort(keyed.begin(), keyed.end(),
+    [](const std::pair<uint64_t, job_t>& a, const std::pair<uint64_t, job_t>& b) { return a.first < b.first; });
+
+  //each tile is a run
+  for(size_t i = 0; i < keyed.size(); ++i) {
+    if(i == 0 || keyed[i].first != keyed[i - 1].first)
+      runs.push_back(i);
+    jobs[i] = keyed[i].second;
+  }
+  runs.push_back(jobs.size());
+}
 
 bool ParseArguments(int argc, char *argv[]) {
 
@@ -75,6 +152,18 @@ bool ParseArguments(int argc, char *argv[]) {
       ("threads,t",
         boost::program_options::value<size_t>(&threads),
         "Concurrency to use.")
+      ("shared-cache,s",
+        "Keep one reader per thread on top of a tile cache shared by all threads rather than "
+        "a new reader per location.")
+      ("schedule",
+        boost::program_options::value<std::string>(&schedule),
+        "The order locations are searched in: file, the order they are in the input, tile, grouped by "
+        "local level tile, or hilbert, grouped by tile with nearby tiles close together. Each thread takes "
+        "a whole tile's worth of locations at a time. Most useful with --shared-cache.")
+      ("prefetch",
+        boost::program_options::value<std::vector<std::string> >(&prefetch)->multitoken(),
+        "Request files, or files of min_lng,min_lat,max_lng,max_lat boxes, whose tiles are read before "
+        "searching. With --shared-cache they are loaded into the cache, otherwise only the page cache is warmed.")
       //positional arguments
       ("input_files", boost::program_options::value<std::vector<std::string> >(&input_files)->multitoken());
 
@@ -112,51 +201,61 @@ bool ParseArguments(int argc, char *argv[]) {
     }
   }
 
+  if (vm.count("shared-cache"))
+    shared_cache = true;
+
+  if (schedule != "file" && schedule != "tile" && schedule != "hilbert") {
+    std::cerr << "Unknown schedule: " << schedule << "\n\n";
+    std::cerr << options << "\n";
+    return false;
+  }
+
   //TODO: complain when no input files
 
   return true;
 }
 
-void work(const boost::property_tree::ptree& config, std::promise<results_t>& promise) {
+void work(const boost::property_tree::ptree& config, tile_cache_t* cache, std::promise<results_t>& promise) {
+  //when sharing a cache each thread keeps the same reader the whole time
+  std::unique_ptr<cached_reader_t> thread_reader;
+  if(cache)
+    thread_reader.reset(new cached_reader_t(config.get_child("mjolnir"), cache));
+
+  //the histograms are allocated up front so recording a result never allocates
+  results_t results;
+
   //lambda to do the current job
-  auto search = [&config] (const job_t job) {
+  auto search = [&config, &thread_reader, &results] (const job_t job) {
     //so that we dont benefit from cache coherency we always make a new reader
-    valhalla::baldr::GraphReader reader(config.get_child("mjolnir"));
+    //unless we are measuring what the shared cache buys us
+    std::unique_ptr<cached_reader_t> job_reader;
+    if(!thread_reader)
+      job_reader.reset(new cached_reader_t(config.get_child("mjolnir")));
+    auto& reader = thread_reader ? *thread_reader : *job_reader;
+    reader.Sync();
     auto location = valhalla::baldr::Location({job.lng, job.lat});
-    std::pair<result_t, result_t> result;
-    bool cached = false;
-    for(auto r : {&result.first, &result.second}) {
+    for(bool cached : {false, true}) {
+      bool pass = true;
       auto start = std::chrono::high_resolution_clock::now();
       try {
         //TODO: actually save the result
         auto c = valhalla::loki::Search(location, reader, valhalla::loki::PassThroughEdgeFilter);
-        auto end = std::chrono::high_resolution_clock::now();
-        (*r) = result_t{std::chrono::duration_cast<std::chrono::milliseconds>(end - start), true, job, cached};
       }
       catch(...) {
-        auto end = std::chrono::high_resolution_clock::now();
-        (*r) = result_t{std::chrono::duration_cast<std::chrono::milliseconds>(end - start), false, job, cached};
+        pass = false;
       }
-      cached = true;
+      auto end = std::chrono::high_resolution_clock::now();
+      results.stats[cached][pass].record(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(), job);
     }
-    return result;
+    results.tiles_loaded += reader.Share();
+    if(reader.OverCommitted())
+      reader.Clear();
   };
 
-  //pull work off and do it
-  job_t job;
-  results_t results;
-  while(!done){
-    while(jobs.pop(job)) {
-      auto result = search(job);
-      results.emplace(std::move(result.first));
-      results.emplace(std::move(result.second));
-    }
-  }
-  while(jobs.pop(job)) {
-    auto result = search(job);
-    results.emplace(std::move(result.first));
-    results.emplace(std::move(result.second));
-  }
+  //take runs of jobs until there are none left
+  for(size_t r = next_run++; r + 1 < runs.size(); r = next_run++)
+    for(size_t i = runs[r]; i < runs[r + 1]; ++i)
+      search(jobs[i]);
 
   //return the statistics
   promise.set_value(std::move(results));
@@ -179,36 +278,54 @@ int main(int argc, char** argv) {
     valhalla::midgard::logging::Configure(logging_config);
   }
 
-  //start up the threads
-  std::list<std::thread> pool;
-  std::vector<std::promise<results_t> > pool_results(threads);
-  for(size_t i = 0; i < threads; ++i) {
-    pool.emplace_back(work, std::cref(pt), std::ref(pool_results[i]));
-  }
-
-  //let the main thread rip through the file
+  //read all the locations up front so the threads never wait on the file
   for(const auto& file : input_files) {
     std::ifstream stream(file);
     std::string line;
     while(std::getline(stream, line)) {
       auto location = valhalla::baldr::Location::FromCsv(line);
-      jobs.push(job_t{location.latlng_.lng(), location.latlng_.lat()});
+      jobs.push_back(job_t{location.latlng_.lng(), location.latlng_.lat()});
       line.clear();
     }
   }
-  done = true;
+
+  schedule_jobs(pt);
+  LOG_INFO("Searching " + std::to_string(jobs.size()) + " locations in " + std::to_string(runs.size() - 1) +
+           " runs with the " + schedule + " schedule");
+
+  //warm up before the clock starts
+  std::unique_ptr<tile_cache_t> cache;
+  if(shared_cache)
+    cache.reset(new tile_cache_t(pt.get<size_t>("mjolnir.max_cache_size", 1073741824)));
+  std::vector<tile_cache_t*> caches;
+  if(cache)
+    caches.push_back(cache.get());
+  prefetch_tiles(pt, prefetch, caches, threads);
+
+  //start up the threads
+  auto start = std::chrono::high_resolution_clock::now();
+  std::list<std::thread> pool;
+  std::vector<std::promise<results_t> > pool_results(threads);
+  for(size_t i = 0; i < threads; ++i) {
+    pool.emplace_back(work, std::cref(pt), cache.get(), std::ref(pool_results[i]));
+  }
 
   //let the threads finish up
   for(auto& thread : pool) {
     thread.join();
   }
+  auto end = std::chrono::high_resolution_clock::now();
+  auto seconds = std::chrono::duration_cast<std::chrono::duration<double> >(end - start).count();
 
   //grab all the results
   results_t results;
   for(auto& thread_results : pool_results) {
     try {
       auto result = thread_results.get_future().get();
-      std::move(std::begin(result), std::end(result), std::inserter(results, results.begin()));
+      for(size_t cached = 0; cached < 2; ++cached)
+        for(size_t pass = 0; pass < 2; ++pass)
+          results.stats[cached][pass].merge(result.stats[cached][pass]);
+      results.tiles_loaded += result.tiles_loaded;
     }//rethrow anything that happened in a thread
     catch(std::exception& e) {
       throw e;
@@ -223,66 +340,24 @@ int main(int argc, char** argv) {
       std::make_tuple("Succeeded Searches on Cached Tiles", true, true),
       std::make_tuple("Failed Searches on Cached Tiles", false, true)
     };
+  auto ms = [](double usec) { return std::to_string(usec / 1000.0) + "ms"; };
   for(const auto& stat_type : stat_types) {
-    //grab the averages and the best and worst cases
-    size_t count = 0;
-    std::chrono::duration<double, std::milli> time(0);
-    result_t first, last;
-    for(const auto& result : results) {
-      //are we interested in this result
-      if(std::get<1>(stat_type) == result.pass && std::get<2>(stat_type) == result.cached) {
-        time += result.time;
-        if(count == 0) {
-          first = result;
-          last = result;
-        }
-        else {
-          if(result.time < first.time)
-            first = result;
-          if(result.time > last.time)
-            last = result;
-        }
-        count++;
-      }
-    }
-    double median = time.count() / static_cast<double>(count);
-    //grab the std deviation
-    double sum_squared_difference = 0;
-    for(const auto& result : results) {
-      //are we interested in this result
-      if(std::get<1>(stat_type) == result.pass && std::get<2>(stat_type) == result.cached) {
-        auto ms = std::chrono::duration_cast<std::chrono::duration<double, std::milli> >(result.time).count();
-        auto diff = ms - median;
-        sum_squared_difference += diff * diff;
-      }
-    }
-    auto variance = sum_squared_difference / static_cast<double>(count);
-    auto std_deviation = sqrt(variance);
-    //stats about outliers
-    size_t faster = 0, slower = 0;
-    for(const auto& result : results) {
-      //are we interested in this result
-      if(std::get<1>(stat_type) == result.pass && std::get<2>(stat_type) == result.cached) {
-        auto ms = std::chrono::duration_cast<std::chrono::duration<double, std::milli> >(result.time).count();
-        if(ms < median - std_deviation)
-          faster++;
-        else if(ms > median + std_deviation)
-          slower++;
-      }
-    }
-
+    const auto& stats = results.stats[std::get<2>(stat_type)][std::get<1>(stat_type)];
+    const auto& histogram = stats.histogram;
     LOG_INFO(std::get<0>(stat_type));
     LOG_INFO("--------------------------------");
-    if(count) {
-      LOG_INFO("Total: " + std::to_string(count));
-      LOG_INFO("Fastest: " + std::to_string(first.job.lat) + "," + std::to_string(first.job.lng) + " @ " +
-        std::to_string(std::chrono::duration_cast<std::chrono::duration<int, std::milli> >(first.time).count()) + "ms");
-      LOG_INFO("Slowest: " + std::to_string(last.job.lat) + "," + std::to_string(last.job.lng) + " @ " +
-        std::to_string(std::chrono::duration_cast<std::chrono::duration<int, std::milli> >(last.time).count()) + "ms");
-      LOG_INFO("Median: " + std::to_string(median) + "ms");
-      LOG_INFO("Standard Deviation: " + std::to_string(std_deviation) + "ms");
-      LOG_INFO("Faster Than 1 Standard Deviation: " + std::to_string(faster));
-      LOG_INFO("Slower Than 1 Standard Deviation: " + std::to_string(slower));
+    if(histogram.count()) {
+      auto mean = histogram.mean();
+      auto variance = std::max(stats.sum_squares / histogram.count() - mean * mean, 0.0);
+      LOG_INFO("Total: " + std::to_string(histogram.count()));
+      LOG_INFO("Fastest: " + std::to_string(stats.fastest.lat) + "," + std::to_string(stats.fastest.lng) + " @ " + ms(histogram.min()));
+      LOG_INFO("Slowest: " + std::to_string(stats.slowest.lat) + "," + std::to_string(stats.slowest.lng) + " @ " + ms(histogram.max()));
+      LOG_INFO("Mean: " + ms(mean));
+      LOG_INFO("Standard Deviation: " + ms(std::sqrt(variance)));
+      LOG_INFO("p50: " + ms(histogram.percentile(.5)));
+      LOG_INFO("p95: " + ms(histogram.percentile(.95)));
+      LOG_INFO("p99: " + ms(histogram.percentile(.99)));
+      LOG_INFO("Max: " + ms(histogram.max()));
     }
     else {
       LOG_INFO("No results");
@@ -290,6 +365,23 @@ int main(int argc, char** argv) {
     LOG_INFO("--------------------------------\n\n");
   }
 
+  LOG_INFO("Throughput with the " + schedule + " schedule");
+  LOG_INFO("--------------------------------");
+  LOG_INFO("Wall Time: " + std::to_string(seconds) + "s");
+  LOG_INFO("Locations Per Second: " + std::to_string(jobs.size() / seconds));
+  LOG_INFO("Searches Per Second: " + std::to_string(jobs.size() * 2 / seconds));
+  LOG_INFO("Tiles Loaded By Readers: " + std::to_string(results.tiles_loaded));
+  LOG_INFO("--------------------------------\n\n");
+
+  if(cache) {
+    LOG_INFO("Shared Tile Cache");
+    LOG_INFO("--------------------------------");
+    LOG_INFO("Tiles Loaded: " + std::to_string(cache->tiles_loaded()));
+    LOG_INFO("Tiles Shared Between Threads: " + std::to_string(cache->tiles_handed_out()));
+    LOG_INFO("Tiles Evicted: " + std::to_string(cache->tiles_evicted()));
+    LOG_INFO("--------------------------------\n\n");
+  }
+
   return EXIT_SUCCESS;
 }
 
@@ -0,0 +1,258 @@
+#include "config.h"
+#include "histogram.h"
+#include "trip_path_corpus.h"
+
+#include <valhalla/odin/directionsbuilder.h>
+#include <valhalla/proto/trippath.pb.h>
+#include <valhalla/proto/tripdirections.pb.h>
+#include <valhalla/proto/directions_options.pb.h>
+#include <valhalla/midgard/logging.h>
+
+#include <boost/program_options.hpp>
+#include <cstdlib>
+#include <new>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <list>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+
+namespace bpo = boost::program_options;
+
+//every allocation made while a thread is counting, so we can see what
+//building the directions for a path costs the allocator
+namespace {
+  thread_local bool counting = false;
+  thread_local uint64_t allocations = 0;
+  thread_local uint64_t allocated = 0;
+
+  void* allocate(size_t size) {
+    if(counting) {
+      ++allocations;
+      allocated += size;
+    }
+    return std::malloc(size ? size : 1);
+  }
+}
+
+void* operator new(size_t size) {
+  void* p = allocate(size);
+  if(!p)
+    throw std::bad_alloc();
+  return p;
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+size_t iterations = 1;
+size_t threads = std::max(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(1));
+std::vector<std::string> input_files;
+bool keep_logging = false;
+
+struct results_t {
+  results_t() : builds(0), maneuvers(0), bytes(0), failures(0), building(0) { }
+  void merge(const results_t& other) {
+    latency.merge(other.latency);
+    allocations.merge(other.allocations);
+    builds += other.builds;
+    maneuvers += other.maneuvers;
+    bytes += other.bytes;
+    failures += other.failures;
+    building += other.building;
+  }
+  //microseconds per build
+  histogram_t latency;
+  //allocations per build
+  histogram_t allocations;
+  uint64_t builds, maneuvers, bytes, failures;
+  //microseconds spent in the builds, not parsing
+  uint64_t building;
+};
+
+bool ParseArguments(int argc, char *argv[]) {
+
+  bpo::options_description options(
+    "valhalla_benchmark_odin " VERSION "\n"
+    "\n"
+    " Usage: valhalla_benchmark_odin [options] <trip_path_file> ...\n"
+    "\n"
+    "valhalla_benchmark_odin builds directions for the trip paths valhalla_run_route --dump-trip-paths "
+    "wrote, over and over on a number of threads, so that odin can be measured on its own without a "
+    "graph or any routing. Logging is off while building so the narrative and whatever odin logs "
+    "aren't part of the measurement."
+    "\n"
+    "\n");
+
+  options.add_options()
+      ("help,h", "Print this help message.")
+      ("version,v", "Print the version of this software.")
+      ("iterations,i",
+        boost::program_options::value<size_t>(&iterations),
+        "How many times to build the directions for every path [default=1].")
+      ("threads,t",
+        boost::program_options::value<size_t>(&threads),
+        "Concurrency to use.")
+      ("log",
+        "Leave logging on to std_err while building.")
+      //positional arguments
+      ("input_files", boost::program_options::value<std::vector<std::string> >(&input_files)->multitoken());
+
+  bpo::positional_options_description pos_options;
+  pos_options.add("input_files", 16);
+
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::command_line_parser(argc, argv).options(options).positional(pos_options).run(), vm);
+    bpo::notify(vm);
+
+  } catch (std::exception &e) {
+    std::cerr << "Unable to parse command line options because: " << e.what()
+      << "\n" << "This is a bug, please report it at " PACKAGE_BUGREPORT
+      << "\n";
+    return false;
+  }
+
+  if (vm.count("help")) {
+    std::cout << options << "\n";
+    exit(EXIT_SUCCESS);
+  }
+
+  if (vm.count("version")) {
+    std::cout << "valhalla_benchmark_odin " << VERSION << "\n";
+    exit(EXIT_SUCCESS);
+  }
+
+  if (input_files.empty()) {
+    std::cerr << "The <trip_path_file> argument was not provided, but is mandatory\n\n";
+    std::cerr << options << "\n";
+    return false;
+  }
+
+  if (vm.count("log"))
+    keep_logging = true;
+  threads = std::max(threads, static_cast<size_t>(1));
+
+  return true;
+}
+
+int main(int argc, char** argv) {
+
+  if (!ParseArguments(argc, argv))
+    return EXIT_FAILURE;
+
+  //the logger can only be configured once so the report goes to std_out
+  if(keep_logging)
+    valhalla::midgard::logging::Configure({{"type","std_err"},{"color","true"}});
+  else
+    valhalla::midgard::logging::Configure({{"type",""}});
+
+  //read the whole corpus up front so the threads never wait on the file
+  std::vector<trip_path_corpus::record_t> records;
+  for(const auto& file : input_files) {
+    try {
+      auto read = trip_path_corpus::read(file);
+      std::move(read.begin(), read.end(), std::back_inserter(records));
+    }
+    catch(const std::exception& e) {
+      std::cerr << e.what() << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+  if(records.empty()) {
+    std::cerr << "No trip paths to build directions for\n";
+    return EXIT_FAILURE;
+  }
+  std::vector<valhalla::odin::DirectionsOptions> options(records.size());
+  for(size_t i = 0; i < records.size(); ++i) {
+    if(!options[i].ParseFromString(records[i].options)) {
+      std::cerr << "Trip path " << i << " has unreadable directions options\n";
+      return EXIT_FAILURE;
+    }
+  }
+  std::cout << "Building directions for " << records.size() << " trip paths " << iterations
+            << " times on " << threads << " threads\n";
+
+  //each thread claims the next build until there are none left. the path
+  //is parsed fresh every time because building directions changes it, only
+  //the build itself is timed and counted
+  std::atomic<size_t> next(0);
+  size_t total = records.size() * iterations;
+  std::vector<results_t> thread_results(threads);
+  auto work = [&](results_t& results) {
+    valhalla::odin::TripPath path;
+    for(size_t i = next++; i < total; i = next++) {
+      const auto r = i % records.size();
+      if(!path.ParseFromString(records[r].path)) {
+        ++results.failures;
+        continue;
+      }
+      allocations = allocated = 0;
+      counting = true;
+      auto start = std::chrono::high_resolution_clock::now();
+      try {
+        auto directions = valhalla::odin::DirectionsBuilder().Build(options[r], path);
+        auto end = std::chrono::high_resolution_clock::now();
+        counting = false;
+        results.maneuvers += directions.maneuver_size();
+        auto usec = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        results.latency.record(usec);
+        results.building += usec;
+        results.allocations.record(allocations);
+        results.bytes += allocated;
+        ++results.builds;
+      }
+      catch(...) {
+        counting = false;
+        ++results.failures;
+      }
+    }
+  };
+  auto start = std::chrono::high_resolution_clock::now();
+  std::list<std::thread> pool;
+  for(size_t i = 0; i < threads; ++i)
+    pool.emplace_back(work, std::ref(thread_results[i]));
+  for(auto& thread : pool)
+    thread.join();
+  auto end = std::chrono::high_resolution_clock::now();
+  auto seconds = std::chrono::duration_cast<std::chrono::duration<double> >(end - start).count();
+
+  //how it went
+  results_t results;
+  for(const auto& result : thread_results)
+    results.merge(result);
+  auto ms = [](double usec) { return std::to_string(usec / 1000.0) + "ms"; };
+  std::cout << "--------------------------------\n";
+  std::cout << "Builds: " << results.builds << "\n";
+  std::cout << "Failures: " << results.failures << "\n";
+  std::cout << "Wall Time: " << seconds << "s\n";
+  std::cout << "Builds Per Second: " << results.builds / seconds << "\n";
+  std::cout << "Maneuvers Per Second: " << results.maneuvers / seconds << "\n";
+  if(results.building)
+    std::cout << "Maneuvers Per Thread Second Building: " << results.maneuvers * 1e6 / results.building << "\n";
+  if(results.builds) {
+    std::cout << "Maneuvers Per Path: " << static_cast<double>(results.maneuvers) / results.builds << "\n";
+    std::cout << "Allocations Per Path: " << results.allocations.mean() << " (p50 "
+              << results.allocations.percentile(.5) << ", p99 " << results.allocations.percentile(.99)
+              << ", max " << results.allocations.max() << ")\n";
+    std::cout << "Bytes Allocated Per Path: " << static_cast<double>(results.bytes) / results.builds << "\n";
+    std::cout << "Mean: " << ms(results.latency.mean()) << "\n";
+    std::cout << "p50: " << ms(results.latency.percentile(.5)) << "\n";
+    std::cout << "p90: " << ms(results.latency.percentile(.9)) << "\n";
+    std::cout << "p99: " << ms(results.latency.percentile(.99)) << "\n";
+    std::cout << "Max: " << ms(results.latency.max()) << "\n";
+  }
+  std::cout << "--------------------------------\n";
+
+  return results.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,410 @@
+#include "config.h"
+#include "histogram.h"
+
+#include <valhalla/midgard/logging.h>
+
+#include <boost/program_options.hpp>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <list>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+namespace bpo = boost::program_options;
+
+std::string url = "http://localhost:8002/route";
+double qps = 10;
+double duration = 60;
+size_t connections = 64;
+double interval = 10;
+double timeout = 30;
+std::vector<std::string> input_files;
+
+//the target
+std::string host, port, path;
+
+//the http requests to send, in order, over and over
+std::vector<std::string> requests;
+
+//what happened to one request
+struct sample_t {
+  uint64_t done;      //microseconds since the start
+  uint64_t latency;   //microseconds from when it should have been sent
+  uint64_t service;   //microseconds from when it was sent
+  int code;           //http status or one of the errors below
+};
+constexpr int kConnectError = -1;
+constexpr int kIoError = -2;
+
+bool ParseArguments(int argc, char *argv[]) {
+
+  bpo::options_description options(
+    "service_benchmark " VERSION "\n"
+    "\n"
+    " Usage: service_benchmark [options] <request_file> ...\n"
+    "\n"
+    "service_benchmark sends route requests to a running valhalla_route_service at "
+    "a fixed rate. The request files are the ones in test_requests, the json after "
+    "-j on each line is sent as a route request. Requests are sent on schedule no "
+    "matter how long earlier ones take and their latency is measured from when "
+    "they should have been sent, so stalls in the service aren't hidden by the "
+    "benchmark waiting on them."
+    "\n"
+    "\n");
+
+  options.add_options()
+      ("help,h", "Print this help message.")
+      ("version,v", "Print the version of this software.")
+      ("url,u",
+        boost::program_options::value<std::string>(&url),
+        "Where to send the requests, defaults to http://localhost:8002/route.")
+      ("qps,q",
+        boost::program_options::value<double>(&qps),
+        "Requests per second to send.")
+      ("duration,d",
+        boost::program_options::value<double>(&duration),
+        "Seconds to send requests for.")
+      ("connections,c",
+        boost::program_options::value<size_t>(&connections),
+        "Number of connections, each can have one request outstanding. Use enough that they "
+        "aren't all busy at the target rate or requests fall behind schedule.")
+      ("interval,i",
+        boost::program_options::value<double>(&interval),
+        "Seconds between lines of the report over time.")
+      ("timeout,t",
+        boost::program_options::value<double>(&timeout),
+        "Seconds to wait for a response.")
+      //positional arguments
+      ("input_files", boost::program_options::value<std::vector<std::string> >(&input_files)->multitoken());
+
+  bpo::positional_options_description pos_options;
+  pos_options.add("input_files", -1);
+
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::command_line_parser(argc, argv).options(options).positional(pos_options).run(), vm);
+    bpo::notify(vm);
+
+  } catch (std::exception &e) {
+    std::cerr << "Unable to parse command line options because: " << e.what()
+      << "\n" << "This is a bug, please report it at " PACKAGE_BUGREPORT
+      << "\n";
+    return false;
+  }
+
+  if (vm.count("help")) {
+    std::cout << options << "\n";
+    return false;
+  }
+
+  if (vm.count("version")) {
+    std::cout << "service_benchmark " << VERSION << "\n";
+    return false;
+  }
+
+  //argument checking and verification
+  if (input_files.empty()) {
+    std::cerr << "The <input_files> argument was not provided, but is mandatory\n\n";
+    std::cerr << options << "\n";
+    return false;
+  }
+  if (qps <= 0 || duration <= 0 || interval <= 0 || timeout <= 0 || connections == 0) {
+    std::cerr << "qps, duration, interval, timeout and connections must be positive\n\n";
+    std::cerr << options << "\n";
+    return false;
+  }
+
+  //split up the url
+  auto scheme = url.find("://");
+  if (scheme == std::string::npos || url.compare(0, scheme, "http") != 0) {
+    std::cerr << "Only http urls are supported: " << url << "\n";
+    return false;
+  }
+  auto authority = url.substr(scheme + 3);
+  auto slash = authority.find('/');
+  path = slash == std::string::npos ? "/route" : authority.substr(slash);
+  authority = authority.substr(0, slash);
+  auto colon = authority.find(':');
+  host = authority.substr(0, colon);
+  port = colon == std::string::npos ? "80" : authority.substr(colon + 1);
+
+  return true;
+}
+
+//percent encode everything but the unreserved characters
+std::string url_encode(const std::string& text) {
+  static const char hex[] = "0123456789ABCDEF";
+  std::string encoded;
+  encoded.reserve(text.size() * 3);
+  for(unsigned char c : text) {
+    if(isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+      encoded.push_back(c);
+    else {
+      encoded.push_back('%');
+      encoded.push_back(hex[c >> 4]);
+      encoded.push_back(hex[c & 15]);
+    }
+  }
+  return encoded;
+}
+
+//turn the json after each -j into a get request
+void load_requests() {
+  for(const auto& file_name : input_files) {
+    std::ifstream file(file_name);
+    if(!file)
+      throw std::runtime_error("Couldn't open " + file_name);
+    std::string line;
+    while(std::getline(file, line)) {
+      auto j = line.find("-j '");
+      if(j == std::string::npos)
+        continue;
+      auto end = line.find('\'', j + 4);
+      if(end == std::string::npos)
+        continue;
+      auto json = line.substr(j + 4, end - j - 4);
+      requests.emplace_back("GET " + path + "?json=" + url_encode(json) + " HTTP/1.1\r\n"
+        "Host: " + host + "\r\n"
+        "Connection: keep-alive\r\n\r\n");
+    }
+  }
+}
+
+//a keep alive connection to the service that sends one request at a time
+class connection_t {
+ public:
+  connection_t() : fd(-1), timed_out(false) { }
+  ~connection_t() { close(); }
+
+  //send the request and wait for the whole response, the status code or an error
+  int request(const std::string& request) {
+    if(fd == -1 && !open())
+      return kConnectError;
+    //a kept alive connection the server has since closed gets one retry,
+    //one that timed out doesn't
+    for(int attempt = 0; attempt < 2; ++attempt) {
+      timed_out = false;
+      int code = exchange(request);
+      if(code != kIoError || timed_out) {
+        if(timed_out)
+          close();
+        return code;
+      }
+      close();
+      if(attempt == 0 && !open())
+        return kConnectError;
+    }
+    return kIoError;
+  }
+
+ protected:
+  bool open() {
+    addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+      return false;
+    for(auto address = addresses; address; address = address->ai_next) {
+      fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+      if(fd == -1)
+        continue;
+      if(connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+        break;
+      ::close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if(fd == -1)
+      return false;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    timeval tv;
+    tv.tv_sec = static_cast<time_t>(timeout);
+    tv.tv_usec = static_cast<suseconds_t>((timeout - tv.tv_sec) * 1e6);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    buffer.clear();
+    return true;
+  }
+
+  void close() {
+    if(fd != -1)
+      ::close(fd);
+    fd = -1;
+  }
+
+  int exchange(const std::string& request) {
+    for(size_t sent = 0; sent < request.size(); ) {
+      auto n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+      if(n <= 0)
+        return kIoError;
+      sent += n;
+    }
+    //the headers
+    size_t header_end;
+    while((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+      if(!fill())
+        return kIoError;
+    }
+    if(buffer.compare(0, 5, "HTTP/") != 0 || buffer.find(' ') == std::string::npos)
+      return kIoError;
+    int code = std::atoi(buffer.c_str() + buffer.find(' ') + 1);
+    std::string headers = buffer.substr(0, header_end);
+    std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+    bool closing = headers.find("connection: close") != std::string::npos;
+    auto length_header = headers.find("content-length:");
+    //the body
+    if(length_header != std::string::npos) {
+      size_t length = std::stoul(headers.substr(length_header + 15));
+      while(buffer.size() < header_end + 4 + length) {
+        if(!fill())
+          return kIoError;
+      }
+      buffer.erase(0, header_end + 4 + length);
+    }
+    else {
+      //no length means it ends when the connection does
+      while(fill());
+      buffer.clear();
+      closing = true;
+    }
+    if(closing)
+      close();
+    return code;
+  }
+
+  bool fill() {
+    char chunk[16384];
+    auto n = recv(fd, chunk, sizeof(chunk), 0);
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      timed_out = true;
+    if(n <= 0)
+      return false;
+    buffer.append(chunk, n);
+    return true;
+  }
+
+  int fd;
+  bool timed_out;
+  std::string buffer;
+};
+
+//sends requests on schedule until they are all sent
+void work(std::chrono::steady_clock::time_point start, size_t total, std::atomic<size_t>& next,
+    std::vector<sample_t>& samples) {
+  connection_t connection;
+  const double period = 1e6 / qps;
+  size_t i;
+  while((i = next++) < total) {
+    //wait till its time to send this one, if we're behind send it now
+    auto scheduled = start + std::chrono::microseconds(static_cast<uint64_t>(i * period));
+    std::this_thread::sleep_until(scheduled);
+    auto sent = std::chrono::steady_clock::now();
+    int code = connection.request(requests[i % requests.size()]);
+    auto done = std::chrono::steady_clock::now();
+    samples.push_back(sample_t{
+      static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(done - start).count()),
+      static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(done - scheduled).count()),
+      static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(done - sent).count()),
+      code});
+  }
+}
+
+std::string percentiles(const histogram_t& histogram) {
+  return "p50: " + std::to_string(histogram.percentile(.5) / 1000.0) +
+    "ms p90: " + std::to_string(histogram.percentile(.9) / 1000.0) +
+    "ms p99: " + std::to_string(histogram.percentile(.99) / 1000.0) +
+    "ms p99.9: " + std::to_string(histogram.percentile(.999) / 1000.0) +
+    "ms max: " + std::to_string(histogram.max() / 1000.0) + "ms";
+}
+
+std::string seconds(double s) {
+  char formatted[32];
+  snprintf(formatted, sizeof(formatted), "%.1fs", s);
+  return formatted;
+}
+
+std::string code_name(int code) {
+  if(code == kConnectError)
+    return "connect error";
+  if(code == kIoError)
+    return "io error or timeout";
+  return std::to_string(code);
+}
+
+int main(int argc, char** argv) {
+
+  if(!ParseArguments(argc, argv))
+    return EXIT_FAILURE;
+
+  load_requests();
+  if(requests.empty()) {
+    LOG_ERROR("No requests found in the input files");
+    return EXIT_FAILURE;
+  }
+  size_t total = static_cast<size_t>(qps * duration);
+  LOG_INFO("Sending " + std::to_string(total) + " requests at " + std::to_string(qps) + "/s over " +
+    std::to_string(connections) + " connections from " + std::to_string(requests.size()) + " distinct requests");
+
+  //start a little in the future so the first requests are on time
+  std::vector<std::vector<sample_t> > samples(connections);
+  std::atomic<size_t> next(0);
+  auto start = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+  std::list<std::thread> threads;
+  for(auto& s : samples) {
+    s.reserve(total / connections + 1);
+    threads.emplace_back(work, start, total, std::ref(next), std::ref(s));
+  }
+  for(auto& t : threads)
+    t.join();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  //over time, by when the responses came back
+  uint64_t interval_us = static_cast<uint64_t>(interval * 1e6);
+  std::map<uint64_t, std::pair<histogram_t, size_t> > intervals;
+  histogram_t latency, service;
+  std::map<int, size_t> codes;
+  for(const auto& thread_samples : samples) {
+    for(const auto& sample : thread_samples) {
+      auto& slot = intervals[sample.done / interval_us];
+      if(sample.code >= 200 && sample.code < 300) {
+        latency.record(sample.latency);
+        service.record(sample.service);
+        slot.first.record(sample.latency);
+      }
+      else
+        ++slot.second;
+      ++codes[sample.code];
+    }
+  }
+  for(const auto& slot : intervals) {
+    size_t completed = slot.second.first.count() + slot.second.second;
+    LOG_INFO(seconds(slot.first * interval) + ": " + std::to_string(completed / interval) +
+      "/s errors: " + std::to_string(slot.second.second) + " " + percentiles(slot.second.first));
+  }
+
+  //overall
+  LOG_INFO("Achieved " + std::to_string(total / elapsed) + " requests/s of " + std::to_string(qps) + " targeted");
+  LOG_INFO("Latency from schedule " + percentiles(latency));
+  LOG_INFO("Latency from send " + percentiles(service));
+  for(const auto& code : codes)
+    LOG_INFO(code_name(code.first) + ": " + std::to_string(code.second));
+
+  return EXIT_SUCCESS;
+}
@@ -1,18 +1,84 @@
 #include <fstream>
 #include <list>
 #include <cstdlib>
+#include <cmath>
 #include <vector>
 #include <utility>
+#include <algorithm>
 #include <thread>
 #include <chrono>
 
 #include <valhalla/midgard/logging.h>
 #include <valhalla/skadi/sample.h>
 
-void get_samples(const valhalla::skadi::sample& sample, const std::list<std::pair<double, double> >& postings, size_t id) {
-  LOG_INFO("Thread" + std::to_string(id) + " sampling " + std::to_string(postings.size()) + " postings");
-  sample.get_all(postings);
-  LOG_INFO("Thread" + std::to_string(id) + " finished");
+#include "histogram.h"
+
+//the postings cut into batches up front, each batch sorted by the tile its
+//postings fall in so the sampler works through one tile's data at a time,
+//along with where each one was in the file so the elevations go back in order
+struct batches_t {
+  std::vector<std::vector<std::pair<double, double> > > coords;
+  std::vector<std::vector<size_t> > positions;
+};
+
+//what one thread did
+struct thread_stats_t {
+  size_t postings = 0;
+  size_t batches = 0;
+  double seconds = 0;
+  histogram_t latency; //microseconds per batch
+};
+
+//hgt tiles are 1 degree squares, key them so they sort row by row
+uint32_t tile_key(const std::pair<double, double>& coord) {
+  return static_cast<uint32_t>(std::floor(coord.second) + 90) * 360 +
+    static_cast<uint32_t>(std::floor(coord.first) + 180);
+}
+
+batches_t make_batches(const std::vector<std::pair<double, double> >& postings, size_t batch_size) {
+  batches_t batches;
+  std::vector<std::pair<uint32_t, size_t> > order;
+  for(size_t i = 0; i < postings.size(); i += batch_size) {
+    size_t last = std::min(i + batch_size, postings.size());
+    order.clear();
+    for(size_t j = i; j < last; ++j)
+      order.emplace_back(tile_key(postings[j]), j);
+    std::sort(order.begin(), order.end());
+    batches.coords.emplace_back();
+    batches.positions.emplace_back();
+    for(const auto& o : order) {
+      batches.coords.back().push_back(postings[o.second]);
+      batches.positions.back().push_back(o.second);
+    }
+  }
+  return batches;
+}
+
+//sample the batches in [begin, end), only the sampling itself is timed
+void get_samples(const valhalla::skadi::sample& sample, const batches_t& batches, size_t begin, size_t end,
+    std::vector<double>& elevations, thread_stats_t& stats) {
+  auto thread_start = std::chrono::steady_clock::now();
+  for(size_t i = begin; i < end; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    auto heights = sample.get_all(batches.coords[i]);
+    stats.latency.record(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count());
+    const auto& positions = batches.positions[i];
+    for(size_t j = 0; j < positions.size(); ++j)
+      elevations[positions[j]] = heights[j];
+    stats.postings += positions.size();
+    ++stats.batches;
+  }
+  stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - thread_start).count();
+}
+
+void log_stats(const std::string& name, const thread_stats_t& stats) {
+  LOG_INFO(name + " " + std::to_string(stats.postings) + " postings in " + std::to_string(stats.batches) +
+    " batches, " + std::to_string(stats.seconds > 0 ? stats.postings / stats.seconds : 0) + " postings per second");
+  LOG_INFO(name + " batch latency (us) p50: " + std::to_string(stats.latency.percentile(.5)) +
+    " p90: " + std::to_string(stats.latency.percentile(.9)) +
+    " p99: " + std::to_string(stats.latency.percentile(.99)) +
+    " max: " + std::to_string(stats.latency.max()));
 }
 
 int main(int argc, char** argv) {
@@ -27,35 +93,48 @@ int main(int argc, char** argv) {
     thread_count = std::stoul(argv[3]);
   else
     thread_count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  size_t batch_size = 1024;
+  if(argc > 4)
+    batch_size = std::max<size_t>(std::stoul(argv[4]), 1);
 
   LOG_INFO("Loading elevation data");
   valhalla::skadi::sample sample(argv[1]);
 
   LOG_INFO("Loading coordinate postings");
-  std::vector<std::list<std::pair<double, double> > > postings(thread_count);
-  auto posting = postings.end() - 1;
-  size_t posting_count = 0;
+  std::vector<std::pair<double, double> > postings;
   std::ifstream file(argv[2]);
-  do {
-    ++posting;
-    if(posting == postings.end())
-      posting = postings.begin();
-    posting->emplace_back();
-    ++posting_count;
-  } while(file >> posting->back().first >> posting->back().second);
-  posting->pop_back();
-  --posting_count;
-
-  //run the threads
-  auto start = std::chrono::system_clock::now();
+  double lng, lat;
+  while(file >> lng >> lat)
+    postings.emplace_back(lng, lat);
+  auto batches = make_batches(postings, batch_size);
+  std::vector<double> elevations(postings.size());
+
+  //each thread gets its own contiguous span of the batches
+  thread_count = std::max<size_t>(std::min(thread_count, batches.coords.size()), 1);
+  std::vector<thread_stats_t> stats(thread_count);
+  auto start = std::chrono::steady_clock::now();
   std::list<std::thread> threads;
-  size_t id = 0;
-  for(const auto& p : postings)
-    threads.emplace_back(get_samples, std::cref(sample), std::cref(p), id++);
+  size_t span = (batches.coords.size() + thread_count - 1) / thread_count;
+  for(size_t id = 0; id < thread_count; ++id) {
+    size_t begin = std::min(id * span, batches.coords.size());
+    size_t end = std::min(begin + span, batches.coords.size());
+    threads.emplace_back(get_samples, std::cref(sample), std::cref(batches), begin, end,
+      std::ref(elevations), std::ref(stats[id]));
+  }
   for(auto& t : threads)
     t.join();
-  std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
-  LOG_INFO(std::to_string(posting_count / elapsed.count()) + " postings per second");
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  //per thread and overall
+  thread_stats_t total;
+  for(size_t id = 0; id < thread_count; ++id) {
+    log_stats("Thread" + std::to_string(id), stats[id]);
+    total.postings += stats[id].postings;
+    total.batches += stats[id].batches;
+    total.latency.merge(stats[id].latency);
+  }
+  total.seconds = elapsed.count();
+  log_stats("All threads", total);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,135 @@
+#include <boost/program_options.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <valhalla/baldr/graphreader.h>
+#include <valhalla/baldr/connectivity_map.h>
+#include <valhalla/midgard/logging.h>
+
+#include <cstdio>
+#include <iostream>
+#include <vector>
+#include <unordered_set>
+
+#include "config.h"
+#include "connectivity_file.h"
+
+using namespace valhalla::midgard;
+using namespace valhalla::baldr;
+
+namespace bpo = boost::program_options;
+
+//program entry point
+int main(int argc, char *argv[]) {
+  bpo::options_description options("valhalla_build_connectivity " VERSION "\n"
+  "\n"
+  " Usage: valhalla_build_connectivity [options] <config>\n"
+  "\n"
+  "valhalla_build_connectivity works out which tiles are connected on every level of the hierarchy "
+  "and writes it to a file that valhalla_run_route --connectivity maps instead of working it out itself. "
+  "\n"
+  "\n");
+
+  std::string config, output;
+  options.add_options()
+      ("help,h", "Print this help message.")
+      ("version,v", "Print the version of this software.")
+      ("output,o", bpo::value<std::string>(&output), "Where to write the file [default=<tile_dir>/connectivity.bin].")
+      // positional arguments
+      ("config", bpo::value<std::string>(&config), "Valhalla configuration file [required]");
+
+  bpo::positional_options_description pos_options;
+  pos_options.add("config", 1);
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::command_line_parser(argc, argv).options(options).positional(pos_options).run(), vm);
+    bpo::notify(vm);
+  }
+  catch (std::exception &e) {
+    std::cerr << "Unable to parse command line options because: " << e.what()
+              << "\n" << "This is a bug, please report it at " PACKAGE_BUGREPORT
+              << "\n";
+    return EXIT_FAILURE;
+  }
+
+  if (vm.count("help") || !vm.count("config")) {
+    std::cout << options << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  if (vm.count("version")) {
+    std::cout << "valhalla_build_connectivity " << VERSION << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  //parse the config
+  boost::property_tree::ptree pt;
+  boost::property_tree::read_json(config.c_str(), pt);
+
+  //configure logging
+  valhalla::midgard::logging::Configure({{"type","std_err"},{"color","true"}});
+
+  //work out the colors once, this is the slow part we are saving everyone else
+  valhalla::baldr::GraphReader reader(pt.get_child("mjolnir"));
+  const auto& hierarchy = reader.GetTileHierarchy();
+  if(output.empty())
+    output = hierarchy.tile_dir() + '/' + connectivity_file::kDefaultName;
+  //note which tiles these are so that nobody uses the file once they change
+  auto tiles = connectivity_file::tile_set(hierarchy.tile_dir());
+  LOG_INFO("Building the connectivity map");
+  connectivity_map_t connectivity_map(hierarchy);
+
+  //lay out the levels, each level's colors start right after the last one's
+  connectivity_file::header_t header;
+  std::copy(connectivity_file::kMagic, connectivity_file::kMagic + sizeof(header.magic), header.magic);
+  header.version = connectivity_file::kVersion;
+  header.level_count = hierarchy.levels().size();
+  header.tile_count = tiles.first;
+  header.tiles_modified = tiles.second;
+  std::vector<connectivity_file::level_t> levels;
+  uint64_t offset = sizeof(header) + header.level_count * sizeof(connectivity_file::level_t);
+  for(const auto& level : hierarchy.levels()) {
+    const auto& tiles = level.second.tiles;
+    auto bounds = tiles.TileBounds(0);
+    auto stamp = connectivity_file::level_stamp(hierarchy.tile_dir(), level.second.level);
+    levels.push_back({level.second.level, static_cast<uint32_t>(tiles.ncolumns()), static_cast<uint32_t>(tiles.nrows()),
+                      tiles.TileSize(), bounds.minx(), bounds.miny(), offset, stamp.first, stamp.second});
+    offset += static_cast<uint64_t>(tiles.TileCount()) * sizeof(uint32_t);
+  }
+
+  //write it next to where it will go and move it into place when its done so
+  //nobody ever maps half a file
+  auto temporary = output + ".tmp";
+  FILE* file = fopen(temporary.c_str(), "wb");
+  if(!file) {
+    LOG_ERROR("Could not open " + temporary);
+    return EXIT_FAILURE;
+  }
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+    fwrite(levels.data(), sizeof(connectivity_file::level_t), levels.size(), file) == levels.size();
+  std::vector<uint32_t> colors;
+  for(const auto& level : levels) {
+    colors.assign(level.ncolumns * level.nrows, 0);
+    std::unordered_set<uint32_t> distinct;
+    size_t present = 0;
+    for(uint32_t tile_id = 0; tile_id < colors.size(); ++tile_id) {
+      colors[tile_id] = connectivity_map.get_color(GraphId(tile_id, level.level, 0));
+      if(colors[tile_id]) {
+        distinct.insert(colors[tile_id]);
+        ++present;
+      }
+    }
+    written = written && fwrite(colors.data(), sizeof(uint32_t), colors.size(), file) == colors.size();
+    LOG_INFO("Level " + std::to_string(level.level) + ": " + std::to_string(present) + " tiles in " +
+             std::to_string(distinct.size()) + " connected regions");
+  }
+  written = fclose(file) == 0 && written;
+  if(!written || rename(temporary.c_str(), output.c_str()) != 0) {
+    LOG_ERROR("Could not write " + output);
+    remove(temporary.c_str());
+    return EXIT_FAILURE;
+  }
+  LOG_INFO("Wrote " + output);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,335 @@
+#include "config.h"
+
+#include <valhalla/midgard/logging.h>
+
+#include <boost/program_options.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/format.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <list>
+#include <limits>
+#include <algorithm>
+
+namespace bpo = boost::program_options;
+
+namespace {
+
+//a read only view of a whole file, via mmap so the kernel can hand us pages
+//that are already cached instead of copying them
+struct mapped_file_t {
+  mapped_file_t(const std::string& name) : data(nullptr), size(0) {
+    int fd = open(name.c_str(), O_RDONLY);
+    if(fd == -1)
+      return;
+    struct stat s;
+    if(fstat(fd, &s) == 0 && s.st_size > 0) {
+      void* mapped = mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(mapped != MAP_FAILED) {
+        data = static_cast<const char*>(mapped);
+        size = s.st_size;
+      }
+    }
+    close(fd);
+  }
+  ~mapped_file_t() {
+    if(data)
+      munmap(const_cast<char*>(data), size);
+  }
+  mapped_file_t(const mapped_file_t&) = delete;
+  mapped_file_t& operator=(const mapped_file_t&) = delete;
+  bool operator==(const mapped_file_t& other) const {
+    return size == other.size && (size == 0 || std::memcmp(data, other.data, size) == 0);
+  }
+  std::vector<std::string> lines() const {
+    std::vector<std::string> lines;
+    const char* begin = data;
+    const char* end = data + size;
+    while(begin < end) {
+      const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+      if(!newline)
+        newline = end;
+      lines.emplace_back(begin, newline);
+      begin = newline + 1;
+    }
+    return lines;
+  }
+  const char* data;
+  size_t size;
+};
+
+//what changed about one route's narrative
+struct route_diff_t {
+  std::string name;
+  bool changed = false;
+  bool maneuvers = false;
+  bool lengths = false;
+  bool time = false;
+  bool length = false;
+  size_t removed = 0;
+  size_t added = 0;
+  std::string hunks;
+};
+
+//the narrative looks like "3: Turn left onto Main Street. | 1.2 mi"
+bool is_maneuver(const std::string& line) {
+  auto colon = line.find(": ");
+  return colon != std::string::npos && colon > 0 &&
+    std::all_of(line.cbegin(), line.cbegin() + colon, [](char c) { return std::isdigit(static_cast<unsigned char>(c)); }) &&
+    line.rfind(" | ") != std::string::npos;
+}
+
+//the instruction without its length
+std::string instruction(const std::string& line) {
+  return line.substr(0, line.rfind(" | "));
+}
+
+std::string range(size_t a, size_t b) {
+  return a == b ? std::to_string(a) : std::to_string(a) + "," + std::to_string(b);
+}
+
+//just the length of the maneuver
+std::string maneuver_length(const std::string& line) {
+  return line.substr(line.rfind(" | ") + 3);
+}
+
+//the instructions and lengths of the maneuvers, in order
+void split_maneuvers(const std::vector<std::string>& lines, std::vector<std::string>& instructions,
+                     std::vector<std::string>& lengths) {
+  for(const auto& l : lines) {
+    if(is_maneuver(l)) {
+      instructions.push_back(instruction(l));
+      lengths.push_back(maneuver_length(l));
+    }
+  }
+}
+
+//the line that starts with the given prefix, if any
+std::string find_line(const std::vector<std::string>& lines, const std::string& prefix) {
+  for(const auto& line : lines)
+    if(line.compare(0, prefix.size(), prefix) == 0)
+      return line;
+  return "";
+}
+
+//a line level diff in the same format as plain old diff, only ever done for
+//routes whose narratives actually differ
+void diff(const std::vector<std::string>& a, const std::vector<std::string>& b, route_diff_t& result) {
+  //skip what is the same at both ends, usually most of it
+  size_t prefix = 0;
+  while(prefix < a.size() && prefix < b.size() && a[prefix] == b[prefix])
+    ++prefix;
+  size_t suffix = 0;
+  while(suffix < a.size() - prefix && suffix < b.size() - prefix &&
+        a[a.size() - 1 - suffix] == b[b.size() - 1 - suffix])
+    ++suffix;
+  size_t n = a.size() - prefix - suffix, m = b.size() - prefix - suffix;
+
+  //longest common subsequence of what is left
+  std::vector<std::vector<uint32_t> > lcs(n + 1, std::vector<uint32_t>(m + 1, 0));
+  for(size_t i = n; i-- > 0;)
+    for(size_t j = m; j-- > 0;)
+      lcs[i][j] = a[prefix + i] == b[prefix + j] ? lcs[i + 1][j + 1] + 1 : std::max(lcs[i + 1][j], lcs[i][j + 1]);
+
+  //walk it to write out the hunks
+  size_t i = 0, j = 0;
+  while(i < n || j < m) {
+    if(i < n && j < m && a[prefix + i] == b[prefix + j]) {
+      ++i; ++j;
+      continue;
+    }
+    size_t i0 = i, j0 = j;
+    while((i < n || j < m) && !(i < n && j < m && a[prefix + i] == b[prefix + j])) {
+      if(j == m || (i < n && lcs[i + 1][j] >= lcs[i][j + 1]))
+        ++i;
+      else
+        ++j;
+    }
+    size_t ai = prefix + i0, bj = prefix + j0;
+    if(i > i0 && j > j0)
+      result.hunks += range(ai + 1, prefix + i) + "c" + range(bj + 1, prefix + j) + "\n";
+    else if(i > i0)
+      result.hunks += range(ai + 1, prefix + i) + "d" + std::to_string(bj) + "\n";
+    else
+      result.hunks += std::to_string(ai) + "a" + range(bj + 1, prefix + j) + "\n";
+    for(size_t k = i0; k < i; ++k)
+      result.hunks += "< " + a[prefix + k] + "\n";
+    if(i > i0 && j > j0)
+      result.hunks += "---\n";
+    for(size_t k = j0; k < j; ++k)
+      result.hunks += "> " + b[prefix + k] + "\n";
+    result.removed += i - i0;
+    result.added += j - j0;
+  }
+}
+
+void compare(const std::string& old_dir, const std::string& new_dir, route_diff_t& result) {
+  mapped_file_t a(old_dir + "/" + result.name), b(new_dir + "/" + result.name);
+  if(a == b)
+    return;
+
+  auto old_lines = a.lines(), new_lines = b.lines();
+  result.changed = true;
+  std::vector<std::string> old_instructions, new_instructions, old_lengths, new_lengths;
+  split_maneuvers(old_lines, old_instructions, old_lengths);
+  split_maneuvers(new_lines, new_instructions, new_lengths);
+  result.maneuvers = old_instructions != new_instructions;
+  result.lengths = !result.maneuvers && old_lengths != new_lengths;
+  result.time = find_line(old_lines, "Total time:") != find_line(new_lines, "Total time:");
+  result.length = find_line(old_lines, "Total length:") != find_line(new_lines, "Total length:");
+  diff(old_lines, new_lines, result);
+}
+
+//the route number for sorting, results are named 1.txt, 2.txt...
+size_t number(const std::string& name) {
+  try { return std::stoul(name); }
+  catch(...) { return std::numeric_limits<size_t>::max(); }
+}
+
+}
+
+int main(int argc, char** argv) {
+  bpo::options_description options(
+    "valhalla_diff_results " VERSION "\n"
+    "\n"
+    " Usage: valhalla_diff_results [options] <previous_results_dir> <current_results_dir>\n"
+    "\n"
+    "valhalla_diff_results compares the narratives of two valhalla_run_route result directories "
+    "and writes a single report of what changed. Routes whose narratives are byte for byte the same "
+    "are skipped without being parsed."
+    "\n"
+    "\n");
+
+  std::string old_dir, new_dir, report;
+  size_t threads = std::max(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(1));
+  options.add_options()
+    ("help,h", "Print this help message.")
+    ("version,v", "Print the version of this software.")
+    ("output,o", bpo::value<std::string>(&report), "Report file [default=<previous>_<current>_diff.txt].")
+    ("threads,t", bpo::value<size_t>(&threads), "Concurrency to use.")
+    ("old", bpo::value<std::string>(&old_dir))
+    ("new", bpo::value<std::string>(&new_dir));
+
+  bpo::positional_options_description pos_options;
+  pos_options.add("old", 1);
+  pos_options.add("new", 1);
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::command_line_parser(argc, argv).options(options).positional(pos_options).run(), vm);
+    bpo::notify(vm);
+  }
+  catch (std::exception &e) {
+    std::cerr << "Unable to parse command line options because: " << e.what()
+              << "\n" << "This is a bug, please report it at " PACKAGE_BUGREPORT
+              << "\n";
+    return EXIT_FAILURE;
+  }
+
+  if (vm.count("help")) {
+    std::cout << options << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  if (vm.count("version")) {
+    std::cout << "valhalla_diff_results " << VERSION << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  for (const auto& dir : { old_dir, new_dir }) {
+    if (!boost::filesystem::is_directory(dir)) {
+      std::cerr << "Both result directories must exist\n\n" << options << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+  while (old_dir.size() > 1 && old_dir.back() == '/') old_dir.pop_back();
+  while (new_dir.size() > 1 && new_dir.back() == '/') new_dir.pop_back();
+  if (report.empty())
+    report = old_dir + "_" + boost::filesystem::path(new_dir).filename().string() + "_diff.txt";
+
+  //find the narratives in both
+  std::vector<route_diff_t> routes;
+  std::vector<std::string> missing, extra;
+  for (boost::filesystem::directory_iterator i(old_dir), end; i != end; ++i) {
+    if (i->path().extension() != ".txt")
+      continue;
+    auto name = i->path().filename().string();
+    if (boost::filesystem::exists(new_dir + "/" + name)) {
+      routes.emplace_back();
+      routes.back().name = name;
+    }
+    else
+      missing.push_back(name);
+  }
+  for (boost::filesystem::directory_iterator i(new_dir), end; i != end; ++i) {
+    if (i->path().extension() == ".txt" && !boost::filesystem::exists(old_dir + "/" + i->path().filename().string()))
+      extra.push_back(i->path().filename().string());
+  }
+  std::sort(routes.begin(), routes.end(), [](const route_diff_t& a, const route_diff_t& b) {
+    return number(a.name) == number(b.name) ? a.name < b.name : number(a.name) < number(b.name);
+  });
+  LOG_INFO("Comparing " + std::to_string(routes.size()) + " narratives with a concurrency of " + std::to_string(threads));
+
+  //compare them all
+  std::atomic<size_t> next(0);
+  std::list<std::thread> pool;
+  for (size_t t = 0; t < std::max(threads, static_cast<size_t>(1)); ++t) {
+    pool.emplace_back([&]() {
+      for (size_t i = next++; i < routes.size(); i = next++)
+        compare(old_dir, new_dir, routes[i]);
+    });
+  }
+  for (auto& thread : pool)
+    thread.join();
+
+  //tally up
+  size_t changed = 0, maneuvers = 0, lengths = 0, times = 0, total_lengths = 0, removed = 0, added = 0;
+  for (const auto& route : routes) {
+    changed += route.changed;
+    maneuvers += route.maneuvers;
+    lengths += route.changed && route.lengths;
+    times += route.time;
+    total_lengths += route.length;
+    removed += route.removed;
+    added += route.added;
+  }
+
+  //write the report, summary first then each changed route
+  std::ofstream out(report);
+  out << "Previous: " << old_dir << "\n" << "Current: " << new_dir << "\n\n"
+      << boost::format("%-40s %d\n") % "Routes compared" % routes.size()
+      << boost::format("%-40s %d\n") % "Routes unchanged" % (routes.size() - changed)
+      << boost::format("%-40s %d\n") % "Routes changed" % changed
+      << boost::format("%-40s %d\n") % "  with changed maneuvers" % maneuvers
+      << boost::format("%-40s %d\n") % "  with only changed maneuver lengths" % lengths
+      << boost::format("%-40s %d\n") % "  with changed total time" % times
+      << boost::format("%-40s %d\n") % "  with changed total length" % total_lengths
+      << boost::format("%-40s %d\n") % "Narrative lines removed" % removed
+      << boost::format("%-40s %d\n") % "Narrative lines added" % added
+      << boost::format("%-40s %d\n") % "Only in previous" % missing.size()
+      << boost::format("%-40s %d\n") % "Only in current" % extra.size();
+  for (const auto& name : missing)
+    out << "Only in " << old_dir << ": " << name << "\n";
+  for (const auto& name : extra)
+    out << "Only in " << new_dir << ": " << name << "\n";
+  for (const auto& route : routes) {
+    if (!route.changed)
+      continue;
+    out << "\n##########################################\n"
+        << "### " << route.name << "\n"
+        << "##########################################\n"
+        << route.hunks;
+  }
+  LOG_INFO(std::to_string(changed) + " of " + std::to_string(routes.size()) + " narratives changed, see " + report);
+
+  return EXIT_SUCCESS;
+}
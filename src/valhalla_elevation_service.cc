@@ -8,6 +8,13 @@
 #include <memory>
 #include <stdexcept>
 #include <sstream>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -20,6 +27,210 @@ using namespace prime_server;
 
 #include <valhalla/skadi/service.h>
 
+#include "response_cache.h"
+#include "affinity.h"
+#include "metrics.h"
+
+namespace {
+
+  //the json in a request, from the json parameter or the body
+  bool request_json(const http_request_t& request, boost::property_tree::ptree& json) {
+    try {
+      auto param = request.query.find("json");
+      std::stringstream stream(param != request.query.cend() && !param->second.empty() ?
+        param->second.front() : request.body);
+      boost::property_tree::read_json(stream, json);
+      return true;
+    }
+    catch(...) {
+      return false;
+    }
+  }
+
+  //the same shape sampled the same way gets the same key. shapes are keyed to
+  //the precision an encoded polyline would keep and the sampling parameters,
+  //the resample interval and whether to give the range, are keyed as is. the
+  //id is left out so that the same profile asked for by different clients is
+  //only sampled once
+  bool cache_key(const http_request_t& request, const boost::property_tree::ptree& json, std::string& key) {
+    try {
+      std::stringstream shape;
+      auto points = json.get_child_optional("shape");
+      if(points) {
+        for(const auto& point : *points) {
+          shape << std::lround(point.second.get<double>("lat") * 1e6) << ','
+                << std::lround(point.second.get<double>("lon") * 1e6) << ';';
+        }
+      }
+      auto rest = json;
+      rest.erase("shape");
+      rest.erase("id");
+      std::stringstream sampling;
+      boost::property_tree::write_json(sampling, rest, false);
+      key = request.path + '\n' + shape.str() + '\n' + sampling.str();
+      return true;
+    }
+    catch(...) {
+      return false;
+    }
+  }
+
+  //the id as it goes in a json response, empty if there isn't one
+  std::string id_json(const boost::property_tree::ptree& json) {
+    auto id = json.get_optional<std::string>("id");
+    if(!id)
+      return "";
+    std::string quoted = "\"";
+    for(unsigned char c : *id) {
+      if(c == '"' || c == '\\') {
+        quoted += '\\';
+        quoted += c;
+      }
+      else if(c < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        quoted += escaped;
+      }
+      else
+        quoted += c;
+    }
+    return quoted + '"';
+  }
+
+  //the headers and body of a successful response, without the status line or
+  //anything about the connection so it can be answered to any request. the
+  //headers come first, one per line, then an empty line then the body
+  bool cacheable_response(const char* data, size_t size, std::string& cached) {
+    const char ok[] = "HTTP/1.1 200";
+    if(size < sizeof(ok) - 1 || std::memcmp(data, ok, sizeof(ok) - 1) != 0)
+      return false;
+    std::string response(data, size);
+    auto end = response.find("\r\n\r\n");
+    if(end == std::string::npos)
+      return false;
+    cached.clear();
+    size_t line = response.find("\r\n") + 2;
+    while(line < end + 2) {
+      auto next = response.find("\r\n", line);
+      auto header = response.substr(line, next - line);
+      auto colon = header.find(':');
+      auto name = header.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      if(colon != std::string::npos && name != "content-length" && name != "connection")
+        cached += header + '\n';
+      line = next + 2;
+    }
+    cached += '\n';
+    cached.append(response, end + 4, std::string::npos);
+    return true;
+  }
+
+  //a fresh response for this request from what was cached, with its own id
+  std::string cached_response(const std::string& cached, const std::string& id, http_request_t::info_t& info) {
+    headers_t headers;
+    size_t line = 0;
+    for(auto next = cached.find('\n'); next != line; line = next + 1, next = cached.find('\n', line)) {
+      auto colon = cached.find(':', line);
+      auto value = std::min(cached.find_first_not_of(' ', colon + 1), next);
+      headers.emplace(cached.substr(line, colon - line), cached.substr(value, next - value));
+    }
+    auto body = cached.substr(line + 1);
+    if(!id.empty() && !body.empty() && body.front() == '{')
+      body.insert(1, "\"id\":" + id + (body.size() > 2 && body[1] != '}' ? "," : ""));
+    http_response_t response(200, "OK", body, headers);
+    response.from_info(info);
+    return response.to_string();
+  }
+
+  //sits in front of the skadi workers, answering the metrics path and what it
+  //can from the cache and passing the rest on. skadi sends its results to the
+  //fill endpoint instead of straight to the server so that they can be timed
+  //and cached on the way back through. cacheable requests go to skadi without
+  //their id so that what comes back can be answered to anyone, the id of the
+  //request being answered is put back in each time
+  class front_worker_t {
+   public:
+    front_worker_t(const boost::property_tree::ptree& config, metrics_t& metrics)
+      : front(metrics, "elevation"),
+        caching(config.get<bool>("skadi.service.cache.enabled", false)),
+        cache(config.get<size_t>("skadi.service.cache.max_bytes", 256 * 1024 * 1024),
+              config.get<size_t>("skadi.service.cache.max_entry_bytes", 1024 * 1024)),
+        log_every(config.get<size_t>("skadi.service.cache.log_every", 10000)),
+        hits(metrics.counter("valhalla_cache_hits_total", "Requests answered from the cache", "service=\"elevation\"")),
+        misses(metrics.counter("valhalla_cache_misses_total", "Cacheable requests sampled by skadi", "service=\"elevation\"")) { }
+
+    worker_t::result_t work(const std::list<zmq::message_t>& job, void* request_info) {
+      auto request = http_request_t::from_string(static_cast<const char*>(job.front().data()), job.front().size());
+      worker_t::result_t result{false};
+      if(front.metrics_response(request, result, request_info))
+        return result;
+      std::string key;
+      boost::property_tree::ptree json;
+      bool cacheable = caching && request_json(request, json) && cache_key(request, json, key);
+      if(!cacheable) {
+        front.track(request_info);
+        return worker_t::result_t{true, {std::string(static_cast<const char*>(job.front().data()), job.front().size())}};
+      }
+      auto id = id_json(json);
+      std::string cached;
+      if(cache.get(key, cached)) {
+        hits.fetch_add(1, std::memory_order_relaxed);
+        log_counts();
+        front.track(request_info);
+        return worker_t::result_t{false, {cached_response(cached, id, *static_cast<http_request_t::info_t*>(request_info))}};
+      }
+      misses.fetch_add(1, std::memory_order_relaxed);
+      log_counts();
+      //remember the id and what to file the answer under when it comes back
+      front.track(request_info, id + '\n' + key);
+      json.erase("id");
+      std::stringstream stream;
+      boost::property_tree::write_json(stream, json, false);
+      auto param = request.query.find("json");
+      if(param != request.query.end() && !param->second.empty())
+        param->second.front() = stream.str();
+      else
+        request.body = stream.str();
+      return worker_t::result_t{true, {request.to_string()}};
+    }
+
+    //pass skadi's results on to the server, caching the successful ones and
+    //giving them the id of the request they answer
+    void fill(zmq::context_t& context, const std::string& fill_endpoint, const std::string& loopback) {
+      front.relay(context, fill_endpoint, loopback,
+        [this](const std::string& tag, http_request_t::info_t& info, zmq::message_t& response) {
+          auto newline = tag.find('\n');
+          if(newline == std::string::npos)
+            return;
+          std::string cached;
+          if(!cacheable_response(static_cast<const char*>(response.data()), response.size(), cached))
+            return;
+          cache.put(tag.substr(newline + 1), cached);
+          auto answer = cached_response(cached, tag.substr(0, newline), info);
+          response.rebuild(answer.data(), answer.size());
+        });
+    }
+
+   protected:
+    void log_counts() {
+      size_t seen = cache.hits() + cache.misses();
+      if(log_every && seen % log_every == 0) {
+        LOG_INFO("Elevation cache hits: " + std::to_string(cache.hits()) + " misses: " + std::to_string(cache.misses()) +
+          " evictions: " + std::to_string(cache.evictions()) + " entries: " + std::to_string(cache.size()) +
+          " bytes: " + std::to_string(cache.bytes()));
+      }
+    }
+
+    front_stage_t front;
+    bool caching;
+    response_cache_t cache;
+    size_t log_every;
+    std::atomic<uint64_t>& hits;
+    std::atomic<uint64_t>& misses;
+  };
+
+}
+
 int main(int argc, char** argv) {
 
   if(argc < 2) {
@@ -48,24 +259,50 @@ int main(int argc, char** argv) {
       LOG_WARN("Listening on a domain socket limits the server to local requests");
   }
 
-  //number of workers to use at each stage
-  auto worker_concurrency = std::thread::hardware_concurrency();
+  //number of workers to use at each stage, unless the stage's config says otherwise
+  size_t worker_concurrency = std::thread::hardware_concurrency();
   if(argc > 2)
     worker_concurrency = std::stoul(argv[2]);
+  layer_t skadi_layer(config, "skadi", worker_concurrency);
+
+  //optional response cache and metrics in front of skadi
+  bool caching = config.get<bool>("skadi.service.cache.enabled", false);
+  bool metering = config.get<bool>("httpd.service.metrics", false);
+  bool fronted = caching || metering;
+  std::string server_proxy = fronted ? skadi_proxy + "_front" : skadi_proxy;
+  std::string fill = loopback + "_front_fill";
+  auto skadi_config = config;
+  if(fronted)
+    skadi_config.put("httpd.service.loopback", fill);
 
   //setup the cluster within this process
   zmq::context_t context;
   std::thread server_thread = std::thread(std::bind(&http_server_t::serve,
-    http_server_t(context, listen, skadi_proxy + "_in", loopback, true)));
+    http_server_t(context, listen, server_proxy + "_in", loopback, true)));
+
+  //front layer
+  metrics_t metrics;
+  std::unique_ptr<front_worker_t> front_worker;
+  if(fronted) {
+    front_worker.reset(new front_worker_t(config, metrics));
+    std::thread fill_thread(std::bind(&front_worker_t::fill, front_worker.get(), std::ref(context), fill, loopback));
+    fill_thread.detach();
+    std::thread front_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, server_proxy + "_in", server_proxy + "_out")));
+    front_proxy_thread.detach();
+    auto front_workers = config.get<size_t>("httpd.service.front_workers",
+      config.get<size_t>("skadi.service.cache.workers", 1));
+    for(size_t i = 0; i < front_workers; ++i) {
+      std::thread front_worker_thread(std::bind(&worker_t::work,
+        worker_t(context, server_proxy + "_out", skadi_proxy + "_in", fill,
+        std::bind(&front_worker_t::work, front_worker.get(), std::placeholders::_1, std::placeholders::_2))));
+      front_worker_thread.detach();
+    }
+  }
 
   //skadi layer
   std::thread skadi_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, skadi_proxy + "_in", skadi_proxy + "_out")));
   skadi_proxy_thread.detach();
-  std::list<std::thread> skadi_worker_threads;
-  for(size_t i = 0; i < worker_concurrency; ++i) {
-    skadi_worker_threads.emplace_back(valhalla::skadi::run_service, config);
-    skadi_worker_threads.back().detach();
-  }
+  skadi_layer.start([&skadi_config](size_t) { valhalla::skadi::run_service(skadi_config); });
 
   //wait forever (or for interrupt)
   server_thread.join();
@@ -6,9 +6,17 @@
 #include <valhalla/midgard/logging.h>
 #include <valhalla/midgard/util.h>
 
-#include <unordered_map>
 #include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <list>
+#include <map>
+#include <cstdio>
 
 #include "config.h"
 
@@ -23,22 +31,32 @@ std::string row_separator = "\n";
 std::string config;
 bool ferries;
 bool unnamed;
+size_t threads = std::max(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(1));
+bool ordered;
+std::string shards;
 
 namespace {
 
 //a place we can mark what edges we've seen, even for the planet we should need < 100mb
+//the bits are atomic so that when threads race to set one exactly one of them wins
 struct bitset_t {
-  bitset_t(size_t size) {bits.resize(size);}
-  void set(const uint64_t id) {
-    if (id > static_cast<uint64_t>(bits.size() - 1) * 64) throw std::runtime_error("id out of bounds");
-    bits[id / 64] |= static_cast<uint64_t>(1) << (id % static_cast<uint64_t>(64));
+  bitset_t(size_t size) : count(size / 64 + 1), bits(new std::atomic<uint64_t>[count]) {
+    for(size_t i = 0; i < count; ++i)
+      bits[i] = 0;
+  }
+  //returns true if this call is the one that set it
+  bool set(const uint64_t id) {
+    if (id >= static_cast<uint64_t>(count) * 64) throw std::runtime_error("id out of bounds");
+    auto mask = static_cast<uint64_t>(1) << (id % static_cast<uint64_t>(64));
+    return !(bits[id / 64].fetch_or(mask) & mask);
   }
   bool get(const uint64_t id) const {
-    if (id > static_cast<uint64_t>(bits.size() - 1) * 64) throw std::runtime_error("id out of bounds");
-    return bits[id / 64] & (static_cast<uint64_t>(1) << (id % static_cast<uint64_t>(64)));
+    if (id >= static_cast<uint64_t>(count) * 64) throw std::runtime_error("id out of bounds");
+    return bits[id / 64].load() & (static_cast<uint64_t>(1) << (id % static_cast<uint64_t>(64)));
   }
 protected:
-  std::vector<uint64_t> bits;
+  size_t count;
+  std::unique_ptr<std::atomic<uint64_t>[]> bits;
 };
 
 //often we need both the edge id and the directed edge, so lets have something to represent that
@@ -50,6 +68,26 @@ struct edge_t {
   operator bool() const { return i.Is_Valid() && e; }
 };
 
+//the global number of edges before each tile, indexed by tile id. this allows an edge to have a
+//sequential global id and makes storing it very small. a flat array of every tile on the level is
+//only a few mb even for the planet and finding an edge's id is then just an add
+using tile_offsets_t = std::vector<uint64_t>;
+
+//the sequential global id of an edge
+uint64_t index(const tile_offsets_t& tile_offsets, const GraphId& id) {
+  return tile_offsets[id.tileid()] + id.id();
+}
+
+//take an edge and its opposing edge. two threads can reach the same stretch of road from either
+//end at the same time so they race for the lower of the pair's bits, whoever sets it gets both
+bool claim(const tile_offsets_t& tile_offsets, bitset_t& edge_set, const edge_t& edge, const edge_t& other) {
+  auto a = index(tile_offsets, edge), b = index(tile_offsets, other);
+  if(!edge_set.set(std::min(a, b)))
+    return false;
+  edge_set.set(std::max(a, b));
+  return true;
+}
+
 edge_t opposing(GraphReader& reader, const GraphTile* tile, const DirectedEdge* edge) {
   if(edge->leaves_tile())
     tile = reader.GetGraphTile(edge->endnode());
@@ -59,7 +97,7 @@ edge_t opposing(GraphReader& reader, const GraphTile* tile, const DirectedEdge*
   return {id, tile->directededge(id)};
 }
 
-edge_t next(const std::unordered_map<uint32_t, uint64_t>& tile_set, const bitset_t& edge_set, GraphReader& reader,
+edge_t next(const tile_offsets_t& tile_offsets, bitset_t& edge_set, GraphReader& reader,
             const GraphTile*& tile, const edge_t& edge, const std::vector<std::string>& names) {
   //get the right tile
   if(tile->id() != edge.e->endnode().Tile_Base())
@@ -74,7 +112,7 @@ edge_t next(const std::unordered_map<uint32_t, uint64_t>& tile_set, const bitset
     GraphId id = tile->id();
     id.fields.id = node->edge_index() + i;
     //already used
-    if(edge_set.get(tile_set.find(tile->id().tileid())->second + id.id()))
+    if(edge_set.get(index(tile_offsets, id)))
       continue;
     edge_t candidate{id, tile->directededge(id)};
     //dont need these
@@ -86,24 +124,62 @@ edge_t next(const std::unordered_map<uint32_t, uint64_t>& tile_set, const bitset
       continue;
     //names have to match
     auto candidate_names = tile->edgeinfo(candidate.e->edgeinfo_offset())->GetNames();
-    if(names.size() == candidate_names.size() && std::equal(names.cbegin(), names.cend(), candidate_names.cbegin()))
+    if(names.size() != candidate_names.size() || !std::equal(names.cbegin(), names.cend(), candidate_names.cbegin()))
+      continue;
+    //another thread might be on this road too, its only ours if we win it
+    if(claim(tile_offsets, edge_set, candidate, opposing(reader, tile, candidate)))
       return candidate;
   }
 
   return {};
 }
 
-void extend(GraphReader& reader, const GraphTile*& tile, const edge_t& edge, std::list<PointLL>& shape) {
+//how many edges are in a tile, only reads the header off of disk rather than the whole tile
+bool tile_edge_count(const TileHierarchy& hierarchy, const GraphId& tile_id, uint32_t& count) {
+  std::ifstream file(hierarchy.tile_dir() + '/' + GraphTile::FileSuffix(tile_id, hierarchy), std::ios::binary);
+  GraphTileHeader header;
+  if(!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+    return false;
+  count = header.directededgecount();
+  return true;
+}
+
+//rows go into one big buffer that is only written out between tiles and only once its big
+//enough, so instead of a write per row there are a handful per thousand tiles
+struct writer_t {
+  writer_t(FILE* file, std::mutex* lock) : file(file), lock(lock) { buffer.reserve(kFlushSize * 2); }
+  void tile_done() {
+    if(buffer.size() >= kFlushSize)
+      flush();
+  }
+  void flush() {
+    if(buffer.empty())
+      return;
+    std::unique_lock<std::mutex> guard;
+    if(lock)
+      guard = std::unique_lock<std::mutex>(*lock);
+    if(fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+      throw std::runtime_error("Could not write the output");
+    buffer.clear();
+  }
+  static constexpr size_t kFlushSize = 8 * 1024 * 1024;
+  FILE* file;
+  std::mutex* lock;
+  std::string buffer;
+};
+
+void extend(GraphReader& reader, const GraphTile*& tile, const edge_t& edge, std::vector<PointLL>& shape) {
   //get the shape
   if(edge.i.Tile_Base() != tile->id())
     tile = reader.GetGraphTile(edge.i);
-  //get the shape
+  //get the shape, one contiguous allocation rather than one per point
   auto info = tile->edgeinfo(edge.e->edgeinfo_offset());
-  auto more = valhalla::midgard::decode7<std::list<PointLL> >(info->encoded_shape());
+  auto more = valhalla::midgard::decode7<std::vector<PointLL> >(info->encoded_shape());
   //this shape runs the other way
-  if(!edge.e->forward())
-    more.reverse();
-  shape.splice(shape.end(), more);
+  if(edge.e->forward())
+    shape.insert(shape.end(), more.cbegin(), more.cend());
+  else
+    shape.insert(shape.end(), more.crbegin(), more.crend());
 }
 
 }
@@ -122,9 +198,13 @@ int main(int argc, char *argv[]) {
       ("help,h", "Print this help message.")
       ("version,v", "Print the version of this software.")
       ("column,c", bpo::value<std::string>(&column_separator), "What separator to use between columns [default=\\0].")
-      ("row,r", bpo::value<std::string>(&column_separator), "What separator to use between row [default=\\n].")
+      ("row,r", bpo::value<std::string>(&row_separator), "What separator to use between row [default=\\n].")
       ("ferries,f", "Export ferries as well [default=false]")
       ("unnamed,u", "Export unnamed edges as well [default=false]")
+      ("threads,t", bpo::value<size_t>(&threads), "Concurrency to use [default=all cores].")
+      ("ordered,o", "Write out the blocks of tiles to stdout in the same order no matter which thread finished them first, "
+                    "can't be used with --shards [default=false]")
+      ("shards,s", bpo::value<std::string>(&shards), "Instead of stdout each thread writes to its own file named with this prefix and the thread number")
       // positional arguments
       ("config", bpo::value<std::string>(&config), "Valhalla configuration file [required]");
 
@@ -153,8 +233,14 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
   }
 
-  bool ferries = vm.count("ferries");
-  bool unnamed = vm.count("unnamed");
+  ferries = vm.count("ferries");
+  unnamed = vm.count("unnamed");
+  ordered = vm.count("ordered");
+  if(ordered && !shards.empty()) {
+    std::cerr << "--ordered only applies to stdout and can't be used with --shards\n";
+    return EXIT_FAILURE;
+  }
+  threads = std::max(threads, static_cast<size_t>(1));
 
   //parse the config
   boost::property_tree::ptree pt;
@@ -168,121 +254,215 @@ int main(int argc, char *argv[]) {
   auto level = reader.GetTileHierarchy().levels().rbegin()->second;
 
   //keep the global number of edges encountered at the point we encounter each tile
-  //this allows an edge to have a sequential global id and makes storing it very small
   LOG_INFO("Enumerating edges...");
-  std::unordered_map<uint32_t, uint64_t> tile_set(level.tiles.ncolumns() * level.tiles.nrows());
+  tile_offsets_t tile_offsets(level.tiles.TileCount());
+  std::vector<uint32_t> tiles;
   uint64_t edge_count = 0;
   for(uint32_t i = 0; i < level.tiles.TileCount(); ++i) {
+    tile_offsets[i] = edge_count;
     GraphId tile_id{i, level.level, 0};
-    if(reader.DoesTileExist(tile_id)) {
-      //TODO: just read the header, parsing the whole thing isnt worth it at this point
-      tile_set.emplace(i, edge_count);
-      const auto* tile = reader.GetGraphTile(tile_id);
-      edge_count += tile->header()->directededgecount();
-      reader.Clear();
+    uint32_t count;
+    if(tile_edge_count(reader.GetTileHierarchy(), tile_id, count)) {
+      tiles.push_back(i);
+      edge_count += count;
     }
   }
 
   //this is how we know what i've touched and what we havent
   bitset_t edge_set(edge_count);
 
-  //TODO: we could parallelize this and it might be quite a bit faster but if we really want to maximize
-  //continuous edges we need to avoid the lady and the tramp scenario where two threads are consuming the same
-  //stretch of road at the same time
-
-  //for each tile
-  LOG_INFO("Exporting " + std::to_string(edge_count) + " edges");
-  int progress = -1;
-  uint64_t set = 0;
-  for(const auto& id_count_pair : tile_set) {
-    //for each edge in the tile
-    reader.Clear();
-    GraphId tile_id{id_count_pair.first, level.level, 0};
-    const auto* tile = reader.GetGraphTile(tile_id);
-    for(uint32_t i = 0; i < tile->header()->directededgecount(); ++i) {
-      //we've seen this one already
-      if(edge_set.get(id_count_pair.second + i))
-        continue;
-
-      //make sure we dont ever look at this again
-      edge_t edge{{id_count_pair.first, level.level, i}, tile->directededge(i)};
-      edge_set.set(id_count_pair.second + i);
-      ++set;
-
-      //these wont have opposing edges that we care about
-      if(edge.e->trans_up() || edge.e->use() == Use::kTransitConnection ||
-         edge.e->trans_down() || edge.e->IsTransitLine()) //these 2 should never happen
-        continue;
-
-      //get the opposing edge as well
-      edge_t opposing_edge = opposing(reader, tile, edge);
-      edge_set.set(tile_set.find(opposing_edge.i.tileid())->second + opposing_edge.i.id());
-      ++set;
-
-      //shortcuts arent real and maybe we dont want ferries
-      if(edge.e->shortcut() || (!ferries && edge.e->use() == Use::kFerry))
-        continue;
-
-      //no name no thanks
-      auto edge_info = tile->edgeinfo(edge.e->edgeinfo_offset());
-      auto names = edge_info->GetNames();
-      if(names.size() == 0 && !unnamed)
-        continue;
-
-      //TODO: at this point we need to traverse the graph from this edge to build a subgraph of like-named
-      //connected edges. what we would like is that from that subgraph we extract linestrings which are of
-      //the maximum length. this makes people's lives easier downstream. finding such segments is NP-Hard
-      //and indeed even verifying a solution is NP-Complete. there are some tricks though.. you can do this
-      //in linear time if your subgraph is a DAG. this can't be guaranteed in the overall graph, but we can
-      //create the subgraphs in such a way that they are DAGs. this can produce suboptimal results however
-      //and depends on the initial edge. so for now we'll just greedily export edges
-
-      //keep some state about this section of road
-      std::list<edge_t> edges {edge};
-
-      //go forward
-      const auto* t = tile;
-      while((edge = next(tile_set, edge_set, reader, t, edge, names))) {
-        //mark them to never be used again
-        edge_set.set(tile_set.find(edge.i.tileid())->second + edge.i.id());
-        edge_t other = opposing(reader, t, edge);
-        edge_set.set(tile_set.find(other.i.tileid())->second + other.i.id());
-        set += 2;
-        //keep this
-        edges.push_back(edge);
+  //threads take square blocks of tiles at a time so that they mostly stay out of each others way
+  //and whatever roads they follow out of a tile are likely to be in tiles they have loaded already
+  const int32_t block_size = 4;
+  std::map<int32_t, std::vector<uint32_t> > block_map;
+  int32_t block_columns = (level.tiles.ncolumns() + block_size - 1) / block_size;
+  for(auto tile_id : tiles) {
+    auto key = (level.tiles.Row(tile_id) / block_size) * block_columns + level.tiles.Col(tile_id) / block_size;
+    block_map[key].push_back(tile_id);
+  }
+  std::vector<std::vector<uint32_t> > blocks;
+  for(auto& block : block_map)
+    blocks.emplace_back(std::move(block.second));
+
+  //where the blocks go once they are done
+  std::mutex output_lock;
+  std::condition_variable output_ready;
+  std::vector<std::string> outputs(blocks.size());
+  std::vector<bool> finished(blocks.size(), false);
+
+  //for each block of tiles
+  LOG_INFO("Exporting " + std::to_string(edge_count) + " edges in " + std::to_string(blocks.size()) +
+           " blocks of tiles with " + std::to_string(threads) + " threads");
+  std::atomic<int> progress(-1);
+  std::atomic<uint64_t> set(0);
+  std::atomic<size_t> next_block(0);
+  //the first error on any thread stops the rest and is reported from here rather than escaping the thread
+  std::atomic<bool> failed(false);
+  std::string error;
+  auto export_blocks = [&](size_t thread) {
+    GraphReader reader(pt.get_child("mjolnir"));
+    FILE* file = stdout;
+    if(!shards.empty()) {
+      auto name = shards + "." + std::to_string(thread);
+      if(!(file = fopen(name.c_str(), "wb")))
+        throw std::runtime_error("Could not open " + name);
+    }
+    //shards are only written by us, stdout is shared unless its ordered in which case only
+    //the main thread writes to it
+    writer_t writer(file, shards.empty() ? &output_lock : nullptr);
+    bool by_block = ordered;
+    //reused for every stretch of road so that once theyve grown we stop allocating
+    std::vector<edge_t> edges, backward;
+    std::vector<PointLL> shape;
+    for(size_t b = next_block++; b < blocks.size() && !failed; b = next_block++) {
+      std::string block_rows;
+      std::string& rows = by_block ? block_rows : writer.buffer;
+      for(auto tile_index : blocks[b]) {
+        //for each edge in the tile
+        if(reader.OverCommitted())
+          reader.Clear();
+        GraphId tile_id{tile_index, level.level, 0};
+        const auto* tile = reader.GetGraphTile(tile_id);
+        for(uint32_t i = 0; i < tile->header()->directededgecount(); ++i) {
+          //we've seen this one already
+          if(edge_set.get(tile_offsets[tile_index] + i))
+            continue;
+
+          //these wont have opposing edges that we care about
+          edge_t edge{{tile_index, level.level, i}, tile->directededge(i)};
+          if(edge.e->trans_up() || edge.e->use() == Use::kTransitConnection ||
+             edge.e->trans_down() || edge.e->IsTransitLine()) { //these 2 should never happen
+            if(edge_set.set(tile_offsets[tile_index] + i))
+              ++set;
+            continue;
+          }
+
+          //make sure we dont ever look at this or the opposing edge again
+          edge_t opposing_edge = opposing(reader, tile, edge);
+          if(!claim(tile_offsets, edge_set, edge, opposing_edge))
+            continue;
+          set += 2;
+
+          //shortcuts arent real and maybe we dont want ferries
+          if(edge.e->shortcut() || (!ferries && edge.e->use() == Use::kFerry))
+            continue;
+
+          //no name no thanks
+          auto edge_info = tile->edgeinfo(edge.e->edgeinfo_offset());
+          auto names = edge_info->GetNames();
+          if(names.size() == 0 && !unnamed)
+            continue;
+
+          //TODO: at this point we need to traverse the graph from this edge to build a subgraph of like-named
+          //connected edges. what we would like is that from that subgraph we extract linestrings which are of
+          //the maximum length. this makes people's lives easier downstream. finding such segments is NP-Hard
+          //and indeed even verifying a solution is NP-Complete. there are some tricks though.. you can do this
+          //in linear time if your subgraph is a DAG. this can't be guaranteed in the overall graph, but we can
+          //create the subgraphs in such a way that they are DAGs. this can produce suboptimal results however
+          //and depends on the initial edge. so for now we'll just greedily export edges
+
+          //keep some state about this section of road
+          edges.assign(1, edge);
+          backward.clear();
+
+          //go forward, next marks the ones it gives us to never be used again
+          const auto* t = tile;
+          while((edge = next(tile_offsets, edge_set, reader, t, edge, names))) {
+            set += 2;
+            //keep this
+            edges.push_back(edge);
+          }
+
+          //go backward
+          edge = opposing_edge;
+          while((edge = next(tile_offsets, edge_set, reader, t, edge, names))) {
+            set += 2;
+            //keep this, these come before the rest in reverse order
+            backward.push_back(opposing(reader, t, edge));
+          }
+
+          //get the shape
+          shape.clear();
+          for(auto e = backward.crbegin(); e != backward.crend(); ++e)
+            extend(reader, t, *e, shape);
+          for(const auto& e : edges)
+            extend(reader, t, e, shape);
+
+          //output it
+          rows += encode(shape);
+          rows += column_separator;
+          for(const auto& name : names) {
+            rows += name;
+            if(&name != &names.back())
+              rows += column_separator;
+          }
+          rows += row_separator;
+        }
+
+        //between tiles is where we can write
+        if(!by_block)
+          writer.tile_done();
+
+        //check progress
+        int procent = (100.f * set) / edge_count;
+        int last = progress;
+        if(procent > last && progress.compare_exchange_strong(last, procent))
+          LOG_INFO(std::to_string(procent) + "%");
       }
 
-      //go backward
-      edge = opposing_edge;
-      while((edge = next(tile_set, edge_set, reader, t, edge, names))) {
-        //mark them to never be used again
-        edge_set.set(tile_set.find(edge.i.tileid())->second + edge.i.id());
-        edge_t other = opposing(reader, t, edge);
-        edge_set.set(tile_set.find(other.i.tileid())->second + other.i.id());
-        set += 2;
-        //keep this
-        edges.push_front(other);
+      //hand off the block if its going out in order
+      if(by_block) {
+        std::lock_guard<std::mutex> lock(output_lock);
+        outputs[b] = std::move(block_rows);
+        finished[b] = true;
+        output_ready.notify_one();
       }
-
-      //get the shape
-      std::list<PointLL> shape;
-      for(const auto& e : edges)
-        extend(reader, t, e, shape);
-
-      //output it
-      auto encoded = encode(shape);
-      std::cout << encoded << column_separator;
-      for(const auto& name : names)
-        std::cout << name << (&name == &names.back() ? "" : column_separator);
-      std::cout << row_separator;
-      std::cout.flush();
-
     }
-
-    //check progress
-    int procent = (100.f * set) / edge_count;
-    if(procent > progress)
-      LOG_INFO(std::to_string(progress = procent) + "%");
+    writer.flush();
+    if(file != stdout)
+      fclose(file);
+  };
+  auto work = [&](size_t thread) {
+    try {
+      export_blocks(thread);
+    }
+    catch(const std::exception& e) {
+      //under the lock so the main thread cant miss it while waiting on a block
+      std::lock_guard<std::mutex> lock(output_lock);
+      if(!failed.exchange(true))
+        error = e.what();
+      output_ready.notify_all();
+    }
+  };
+  std::list<std::thread> pool;
+  for(size_t i = 0; i < threads; ++i)
+    pool.emplace_back(work, i);
+
+  //write the blocks out in order as they come in
+  if(ordered) {
+    for(size_t b = 0; b < blocks.size(); ++b) {
+      std::string rows;
+      {
+        std::unique_lock<std::mutex> lock(output_lock);
+        output_ready.wait(lock, [&finished, &failed, b]() { return finished[b] || failed; });
+        if(failed)
+          break;
+        rows.swap(outputs[b]);
+      }
+      if(fwrite(rows.data(), 1, rows.size(), stdout) != rows.size()) {
+        std::lock_guard<std::mutex> lock(output_lock);
+        if(!failed.exchange(true))
+          error = "Could not write the output";
+        break;
+      }
+    }
+  }
+  for(auto& thread : pool)
+    thread.join();
+  fflush(stdout);
+  if(failed) {
+    LOG_ERROR(error);
+    return EXIT_FAILURE;
   }
   LOG_INFO("Done");
 
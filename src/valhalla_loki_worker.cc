@@ -5,6 +5,8 @@
 
 #include <valhalla/loki/service.h>
 
+#include "tile_prefetch.h"
+
 int main(int argc, char** argv) {
 
   if(argc < 2) {
@@ -17,6 +19,9 @@ int main(int argc, char** argv) {
   boost::property_tree::ptree config;
   boost::property_tree::read_json(config_file, config);
 
+  //get the tiles the config asks for into the page cache before taking requests
+  prefetch_tiles(config, prefetch_files(config));
+
   //run the service worker
   valhalla::loki::run_service(config);
 
@@ -5,6 +5,7 @@
 #include <set>
 #include <iostream>
 #include <unordered_set>
+#include <unordered_map>
 #include <memory>
 #include <stdexcept>
 #include <sstream>
@@ -23,6 +24,297 @@ using namespace prime_server;
 #include "valhalla/odin/service.h"
 #include "valhalla/tyr/service.h"
 
+#include <valhalla/baldr/pathlocation.h>
+#include <valhalla/loki/search.h>
+#include <valhalla/sif/costfactory.h>
+#include <valhalla/thor/astar.h>
+#include <valhalla/thor/bidirectional_astar.h>
+#include <valhalla/thor/multimodal.h>
+#include <valhalla/thor/trippathbuilder.h>
+#include <valhalla/odin/directionsbuilder.h>
+#include <valhalla/odin/util.h>
+#include <valhalla/proto/trippath.pb.h>
+#include <valhalla/proto/tripdirections.pb.h>
+#include <valhalla/proto/directions_options.pb.h>
+
+#include "tile_cache.h"
+#include "tile_prefetch.h"
+#include "costing_cache.h"
+#include "affinity.h"
+#include "metrics.h"
+
+using namespace valhalla::baldr;
+using namespace valhalla::sif;
+using namespace valhalla::thor;
+using namespace valhalla::odin;
+
+namespace {
+
+  const headers_t::value_type CORS{"Access-Control-Allow-Origin", "*"};
+
+  //the json request is either in the json parameter or the body, anything
+  //else on the query string goes along with it
+  boost::property_tree::ptree to_ptree(const http_request_t& request) {
+    boost::property_tree::ptree pt;
+    auto json = request.query.find("json");
+    if(json != request.query.cend() && !json->second.empty()) {
+      std::stringstream stream(json->second.front());
+      boost::property_tree::read_json(stream, pt);
+    }
+    else if(request.method == method_t::POST && !request.body.empty()) {
+      std::stringstream stream(request.body);
+      boost::property_tree::read_json(stream, pt);
+    }
+    for(const auto& kv : request.query) {
+      if(kv.first != "json" && !kv.second.empty())
+        pt.put(kv.first, kv.second.front());
+    }
+    return pt;
+  }
+
+  //how long the fused workers spend in each stage's work
+  struct stage_metrics_t {
+    stage_metrics_t(metrics_t& metrics)
+      : loki(metrics.histogram("valhalla_stage_seconds", "Time a fused worker spends in each stage", "stage=\"loki\"")),
+        thor(metrics.histogram("valhalla_stage_seconds", "Time a fused worker spends in each stage", "stage=\"thor\"")),
+        odin(metrics.histogram("valhalla_stage_seconds", "Time a fused worker spends in each stage", "stage=\"odin\"")),
+        downstream(metrics.histogram("valhalla_downstream_seconds",
+          "Time from handing a request to the next layer to its response, queueing included", "layer=\"tyr\"")) { }
+    atomic_histogram_t& loki;
+    atomic_histogram_t& thor;
+    atomic_histogram_t& odin;
+    atomic_histogram_t& downstream;
+  };
+
+  //does the work of the loki, thor and odin workers for a route in one thread.
+  //the locations, trip paths and directions never leave this worker, the only
+  //hop left is to tyr which gets the request and directions just as odin would
+  //have sent them. it holds requests to the same service limits loki does and
+  //joins legs at through locations like thor so the answers are the same as
+  //the staged service's. with metrics on it is also the front of the service
+  class fused_worker_t {
+   public:
+    fused_worker_t(const boost::property_tree::ptree& config, costing_cache_t& costing, tile_cache_t& tiles,
+        front_stage_t* front = nullptr, stage_metrics_t* stages = nullptr)
+      : reader(config.get_child("mjolnir"), &tiles), costing(costing), front(front), stages(stages) {
+      //the per costing limits, the same ones the loki workers read
+      for(const auto& kv : config.get_child("service_limits")) {
+        auto locations = kv.second.get_optional<size_t>("max_locations");
+        auto distance = kv.second.get_optional<float>("max_distance");
+        if(locations && distance) {
+          max_locations.emplace(kv.first, *locations);
+          max_distance.emplace(kv.first, *distance);
+        }
+      }
+    }
+
+    worker_t::result_t work(const std::list<zmq::message_t>& job, void* request_info) {
+      auto& info = *static_cast<http_request_t::info_t*>(request_info);
+      try {
+        auto request = http_request_t::from_string(static_cast<const char*>(job.front().data()), job.front().size());
+        worker_t::result_t metrics{false};
+        if(front && front->metrics_response(request, metrics, request_info))
+          return metrics;
+        if(front)
+          front->track(request_info);
+        if(request.path != "/route")
+          return error(501, "Not Implemented", "Only /route is served by fused workers, run staged workers for " + request.path, info);
+        auto request_pt = to_ptree(request);
+        auto result = route(request_pt);
+        //the rest of the time till its response is tyr's
+        if(front)
+          front->track(request_info, std::to_string(now_us()));
+        //let the other workers have what we loaded
+        reader.Share();
+        if(reader.OverCommitted())
+          reader.Clear();
+        return result;
+      }
+      catch(const std::exception& e) {
+        astar.Clear();
+        bd.Clear();
+        mm.Clear();
+        return error(400, "Bad Request", e.what(), info);
+      }
+    }
+
+   protected:
+    worker_t::result_t error(unsigned code, const std::string& message, const std::string& body, http_request_t::info_t& info) {
+      http_response_t response(code, message, body, headers_t{CORS});
+      response.from_info(info);
+      return worker_t::result_t{false, {response.to_string()}};
+    }
+
+    worker_t::result_t route(boost::property_tree::ptree& request) {
+      //parse the locations
+      std::vector<Location> locations;
+      try {
+        for(const auto& location : request.get_child("locations"))
+          locations.push_back(Location::FromPtree(location.second));
+      }
+      catch(...) {
+        throw std::runtime_error("Insufficiently specified required parameter 'locations'");
+      }
+      if(locations.size() < 2)
+        throw std::runtime_error("Insufficiently specified required parameter 'locations'");
+      auto date_time = request.get_child_optional("date_time");
+      if(date_time) {
+        auto type = date_time->get<int>("type");
+        auto value = date_time->get_optional<std::string>("value");
+        if(type == 0)
+          locations.front().date_time_ = "current";
+        else if(type == 1)
+          locations.front().date_time_ = value;
+        else if(type == 2)
+          locations.back().date_time_ = value;
+      }
+
+      //get the costing
+      auto routetype = request.get_optional<std::string>("costing");
+      if(!routetype)
+        throw std::runtime_error("No edge/node costing provided");
+      std::shared_ptr<DynamicCost> mode_costing[4];
+      TravelMode mode;
+      if(*routetype == "multimodal") {
+        mode_costing[0] = costing.get(request, "auto");
+        mode_costing[1] = costing.get(request, "pedestrian");
+        mode_costing[2] = costing.get(request, "bicycle");
+        mode_costing[3] = costing.get(request, "transit");
+        mode = TravelMode::kPedestrian;
+      }
+      else {
+        auto cost = costing.get(request, *routetype);
+        mode = cost->travelmode();
+        mode_costing[static_cast<uint32_t>(mode)] = cost;
+      }
+      auto cost = mode_costing[static_cast<uint32_t>(mode)];
+      check_limits(*routetype, locations);
+      DirectionsOptions directions_options;
+      auto options = request.get_child_optional("directions_options");
+      if(options)
+        directions_options = GetDirectionsOptions(*options);
+
+      //correlate them
+      uint64_t start = now_us();
+      reader.Sync();
+      std::vector<PathLocation> correlated;
+      for(const auto& location : locations) {
+        try {
+          correlated.push_back(valhalla::loki::Search(location, reader, cost->GetEdgeFilter(), cost->GetNodeFilter()));
+        }
+        catch(const std::exception& e) {
+          throw std::runtime_error("Cannot find a route location: " + std::string(e.what()));
+        }
+      }
+
+      //the request then the directions for each leg, as odin sends them to tyr
+      worker_t::result_t result{true};
+      std::stringstream stream;
+      boost::property_tree::write_json(stream, request, false);
+      result.messages.emplace_back(stream.str());
+      uint64_t loki_us = now_us() - start, thor_us = 0, odin_us = 0;
+      //a leg runs from a break to the next break, passing through any through
+      //locations in between. the last location always ends a leg
+      for(size_t origin = 0; origin + 1 < correlated.size();) {
+        start = now_us();
+        std::vector<PathLocation> through;
+        std::vector<PathInfo> path;
+        size_t destination = origin;
+        do {
+          ++destination;
+          auto piece = best_path(*routetype, correlated[destination - 1], correlated[destination], mode_costing, mode);
+          //the pieces meet on the through location's edge, keep it once and
+          //carry the elapsed time on from where the last piece ended
+          uint32_t elapsed = path.empty() ? 0 : path.back().elapsed_time;
+          if(!path.empty() && path.back().edgeid == piece.front().edgeid)
+            path.pop_back();
+          for(auto& info : piece)
+            info.elapsed_time += elapsed;
+          path.insert(path.end(), piece.begin(), piece.end());
+          if(destination + 1 < correlated.size() && correlated[destination].stoptype_ == Location::StopType::THROUGH)
+            through.push_back(correlated[destination]);
+          else
+            break;
+        } while(true);
+        TripPath trip_path = TripPathBuilder::Build(reader, path, correlated[origin], correlated[destination], through);
+        origin = destination;
+        uint64_t end = now_us();
+        thor_us += end - start;
+        TripDirections trip_directions = DirectionsBuilder().Build(directions_options, trip_path);
+        result.messages.emplace_back(trip_directions.SerializeAsString());
+        odin_us += now_us() - end;
+      }
+      if(stages) {
+        stages->loki.record(loki_us);
+        stages->thor.record(thor_us);
+        stages->odin.record(odin_us);
+      }
+      return result;
+    }
+
+    //the checks loki makes before it lets a route through
+    void check_limits(const std::string& routetype, const std::vector<Location>& locations) const {
+      auto max_count = max_locations.find(routetype);
+      auto max_meters = max_distance.find(routetype);
+      if(max_count == max_locations.cend() || max_meters == max_distance.cend())
+        throw std::runtime_error("No costing method found for '" + routetype + "'");
+      if(locations.size() > max_count->second)
+        throw std::runtime_error("Exceeded max locations of " + std::to_string(max_count->second) + ".");
+      float distance = 0.f;
+      for(size_t i = 1; i < locations.size(); ++i) {
+        distance += locations[i - 1].latlng_.Distance(locations[i].latlng_);
+        if(distance > max_meters->second)
+          throw std::runtime_error("Path distance exceeds the max distance limit.");
+      }
+    }
+
+    //the same passes thor makes, relaxing the hierarchy limits if the first fails
+    std::vector<PathInfo> best_path(const std::string& routetype, PathLocation& origin, PathLocation& destination,
+        const std::shared_ptr<DynamicCost>* mode_costing, TravelMode mode) {
+      PathAlgorithm* algorithm = &bd;
+      if(routetype == "multimodal")
+        algorithm = &mm;
+      else if(routetype != "pedestrian") {
+        //trivial routes on the same edge use a*
+        for(const auto& edge1 : origin.edges) {
+          for(const auto& edge2 : destination.edges) {
+            if(edge1.id == edge2.id)
+              algorithm = &astar;
+          }
+        }
+      }
+      bool using_astar = algorithm == &astar;
+      auto path = algorithm->GetBestPath(origin, destination, reader, mode_costing, mode);
+      auto cost = mode_costing[static_cast<uint32_t>(mode)];
+      if(path.empty() && cost->AllowMultiPass()) {
+        algorithm->Clear();
+        cost->RelaxHierarchyLimits(using_astar ? 16.0f : 8.0f, using_astar ? 4.0f : 2.0f);
+        path = algorithm->GetBestPath(origin, destination, reader, mode_costing, mode);
+      }
+      if(path.empty() && using_astar) {
+        algorithm->Clear();
+        cost->DisableHighwayTransitions();
+        path = algorithm->GetBestPath(origin, destination, reader, mode_costing, mode);
+      }
+      algorithm->Clear();
+      if(path.empty())
+        throw std::runtime_error("No path could be found for input");
+      return path;
+    }
+
+    cached_reader_t reader;
+    costing_cache_t& costing;
+    std::unordered_map<std::string, size_t> max_locations;
+    std::unordered_map<std::string, float> max_distance;
+    front_stage_t* front;
+    stage_metrics_t* stages;
+    AStarPathAlgorithm astar;
+    BidirectionalAStar bd;
+    MultiModalPathAlgorithm mm;
+  };
+
+}
+
 int main(int argc, char** argv) {
 
   if(argc < 2) {
@@ -65,51 +357,159 @@ int main(int argc, char** argv) {
     valhalla::midgard::logging::Configure(logging_config);
   }
 
-  //number of workers to use at each stage
-  auto worker_concurrency = std::thread::hardware_concurrency();
+  //number of workers to use at each stage, unless the stage's config says otherwise
+  size_t worker_concurrency = std::thread::hardware_concurrency();
   if(argc > 2)
     worker_concurrency = std::stoul(argv[2]);
 
+  //staged runs each of loki, thor, odin and tyr as its own layer, fused runs
+  //the first three in one worker on the loki proxy and only serves routes
+  std::string mode = config.get<std::string>("httpd.service.mode", "staged");
+  if(mode != "staged" && mode != "fused") {
+    LOG_ERROR("httpd.service.mode must be staged or fused");
+    return EXIT_FAILURE;
+  }
+
+  //in numa mode the thor (or fused) workers are spread over the nodes and
+  //each keeps to its node so the tiles it loads stay local to it
+  std::vector<std::vector<int> > nodes;
+  if(config.get<bool>("httpd.service.numa", false)) {
+    nodes = numa_nodes();
+    if(nodes.empty())
+      LOG_WARN("Only one numa node found, ignoring httpd.service.numa");
+  }
+  layer_t loki_layer(config, "loki", worker_concurrency);
+  layer_t thor_layer(config, "thor", worker_concurrency, nodes);
+  layer_t odin_layer(config, "odin", worker_concurrency);
+  layer_t tyr_layer(config, "tyr", worker_concurrency);
+
+  //the fused workers share, per numa node, a tile cache. any tiles the config
+  //asks for are loaded into them, by threads on the node, before we serve.
+  //staged workers have readers of their own so only the page cache is warmed
+  std::vector<std::unique_ptr<tile_cache_t> > tile_caches;
+  std::vector<tile_cache_t*> prefetch_caches;
+  if(mode == "fused") {
+    size_t cache_size = config.get<size_t>("mjolnir.max_cache_size", 1073741824);
+    for(size_t i = 0; i < std::max<size_t>(nodes.size(), 1); ++i) {
+      tile_caches.emplace_back(new tile_cache_t(cache_size));
+      prefetch_caches.push_back(tile_caches.back().get());
+    }
+  }
+  prefetch_tiles(config, prefetch_files(config), prefetch_caches,
+    std::max(worker_concurrency, static_cast<size_t>(1)), nodes);
+
+  //with metrics on our own front workers (or the fused workers) see every
+  //request first, and all the layers send their results back through the
+  //front so they can be timed. staged layers also hand each other requests
+  //through a tap, so each layer is told the next one is at its tap
+  bool metering = config.get<bool>("httpd.service.metrics", false);
+  bool fronted = metering && mode == "staged";
+  std::string fill = loopback + "_front_fill";
+  auto layer_config = config;
+  if(metering)
+    layer_config.put("httpd.service.loopback", fill);
+  auto loki_config = layer_config, thor_config = layer_config, odin_config = layer_config;
+  if(fronted) {
+    loki_config.put("thor.service.proxy", thor_proxy + "_tap");
+    thor_config.put("odin.service.proxy", odin_proxy + "_tap");
+    odin_config.put("tyr.service.proxy", tyr_proxy + "_tap");
+  }
+  metrics_t metrics;
+  front_stage_t front(metrics, "route");
+  if(fronted)
+    front.layers({"loki", "thor", "odin", "tyr"});
+  std::unique_ptr<stage_metrics_t> stages(mode == "fused" ? new stage_metrics_t(metrics) : nullptr);
+
   //setup the cluster within this process
   zmq::context_t context;
+  std::string server_proxy = fronted ? loki_proxy + "_front" : loki_proxy;
   std::thread server_thread = std::thread(std::bind(&http_server_t::serve,
-    http_server_t(context, listen, loki_proxy + "_in", loopback, true)));
-
-  //loki layer
-  std::thread loki_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, loki_proxy + "_in", loki_proxy + "_out")));
-  loki_proxy_thread.detach();
-  std::list<std::thread> loki_worker_threads;
-  for(size_t i = 0; i < worker_concurrency; ++i) {
-    loki_worker_threads.emplace_back(valhalla::loki::run_service, config);
-    loki_worker_threads.back().detach();
+    http_server_t(context, listen, server_proxy + "_in", loopback, true)));
+  if(metering) {
+    std::thread fill_thread(std::bind(&front_stage_t::relay, &front, std::ref(context), fill, loopback,
+      [&stages](const std::string& handoff, http_request_t::info_t&, zmq::message_t&) {
+        if(stages && !handoff.empty())
+          stages->downstream.record(now_us() - std::stoull(handoff));
+      }));
+    fill_thread.detach();
   }
 
-  //thor layer
-  std::thread thor_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, thor_proxy + "_in", thor_proxy + "_out")));
-  thor_proxy_thread.detach();
-  std::list<std::thread> thor_worker_threads;
-  for(size_t i = 0; i < worker_concurrency; ++i) {
-    thor_worker_threads.emplace_back(valhalla::thor::run_service, config);
-    thor_worker_threads.back().detach();
+  //front layer, only there to answer with and take the metrics
+  if(fronted) {
+    std::thread front_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, server_proxy + "_in", server_proxy + "_out")));
+    front_proxy_thread.detach();
+    auto front_workers = config.get<size_t>("httpd.service.front_workers", 1);
+    for(size_t i = 0; i < front_workers; ++i) {
+      std::thread front_worker_thread(std::bind(&worker_t::work,
+        worker_t(context, server_proxy + "_out", loki_proxy + "_in", fill,
+        [&front](const std::list<zmq::message_t>& job, void* request_info) {
+          auto request = http_request_t::from_string(static_cast<const char*>(job.front().data()), job.front().size());
+          worker_t::result_t result{true};
+          if(front.metrics_response(request, result, request_info))
+            return result;
+          front.track(request_info);
+          result.messages.emplace_back(static_cast<const char*>(job.front().data()), job.front().size());
+          return result;
+        })));
+      front_worker_thread.detach();
+    }
+
+    //the taps, noting when each request leaves a layer for the next
+    for(const auto& next : {thor_proxy, odin_proxy, tyr_proxy}) {
+      std::thread tap_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, next + "_tap_in", next + "_tap_out")));
+      tap_proxy_thread.detach();
+      for(size_t i = 0; i < front_workers; ++i) {
+        std::thread tap_thread(std::bind(&worker_t::work,
+          worker_t(context, next + "_tap_out", next + "_in", fill,
+          [&front](const std::list<zmq::message_t>& job, void* request_info) {
+            front.passed(request_info);
+            worker_t::result_t result{true};
+            for(const auto& message : job)
+              result.messages.emplace_back(static_cast<const char*>(message.data()), message.size());
+            return result;
+          })));
+        tap_thread.detach();
+      }
+    }
   }
 
-  //odin layer
-  std::thread odin_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, odin_proxy + "_in", odin_proxy + "_out")));
-  odin_proxy_thread.detach();
-  std::list<std::thread> odin_worker_threads;
-  for(size_t i = 0; i < worker_concurrency; ++i) {
-    odin_worker_threads.emplace_back(valhalla::odin::run_service, config);
-    odin_worker_threads.back().detach();
+  //fused layer, sized and placed like thor since that's where its time goes.
+  //the workers share costing profiles and their node's tile cache
+  std::unique_ptr<costing_cache_t> costing_cache;
+  if(mode == "fused") {
+    std::thread fused_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, loki_proxy + "_in", loki_proxy + "_out")));
+    fused_proxy_thread.detach();
+    costing_cache.reset(new costing_cache_t(config));
+    thor_layer.start([&](size_t i) {
+      fused_worker_t fused(config, *costing_cache, *tile_caches[thor_layer.node(i) % tile_caches.size()],
+        metering ? &front : nullptr, metering ? stages.get() : nullptr);
+      worker_t worker(context, loki_proxy + "_out", tyr_proxy + "_in", metering ? fill : loopback,
+        std::bind(&fused_worker_t::work, &fused, std::placeholders::_1, std::placeholders::_2));
+      worker.work();
+    });
+  }
+
+  if(mode == "staged") {
+    //loki layer
+    std::thread loki_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, loki_proxy + "_in", loki_proxy + "_out")));
+    loki_proxy_thread.detach();
+    loki_layer.start([&loki_config](size_t) { valhalla::loki::run_service(loki_config); });
+
+    //thor layer
+    std::thread thor_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, thor_proxy + "_in", thor_proxy + "_out")));
+    thor_proxy_thread.detach();
+    thor_layer.start([&thor_config](size_t) { valhalla::thor::run_service(thor_config); });
+
+    //odin layer
+    std::thread odin_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, odin_proxy + "_in", odin_proxy + "_out")));
+    odin_proxy_thread.detach();
+    odin_layer.start([&odin_config](size_t) { valhalla::odin::run_service(odin_config); });
   }
 
   //tyr layer
   std::thread tyr_proxy_thread(std::bind(&proxy_t::forward, proxy_t(context, tyr_proxy + "_in", tyr_proxy + "_out")));
   tyr_proxy_thread.detach();
-  std::list<std::thread> tyr_worker_threads;
-  for(size_t i = 0; i < worker_concurrency; ++i) {
-    tyr_worker_threads.emplace_back(valhalla::tyr::run_service, config);
-    tyr_worker_threads.back().detach();
-  }
+  tyr_layer.start([&layer_config](size_t) { valhalla::tyr::run_service(layer_config); });
 
   //TODO: add multipoint accumulator
 
@@ -4,6 +4,12 @@
 #include <queue>
 #include <tuple>
 #include <cmath>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <list>
+#include <algorithm>
 #include <boost/program_options.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -11,6 +17,9 @@
 #include <boost/format.hpp>
 
 #include "config.h"
+#include "costing_cache.h"
+#include "tile_cache.h"
+#include "histogram.h"
 
 #include <valhalla/baldr/graphreader.h>
 #include <valhalla/baldr/pathlocation.h>
@@ -38,28 +47,151 @@ using namespace valhalla::thor;
 
 namespace bpo = boost::program_options;
 
-// Returns the costing method (created from the dynamic cost factory).
-// Get the costing options. Get the base options from the config and the
-// options for the specified costing method. Merge in any request costing
-// options that override those in the config.
-valhalla::sif::cost_ptr_t get_costing(CostFactory<DynamicCost> factory,
-                                      boost::property_tree::ptree& config,
-                                      boost::property_tree::ptree& request,
-                                      const std::string& costing) {
- std::string method_options = "costing_options." + costing;
- auto config_costing = config.get_child_optional(method_options);
- if (!config_costing)
-   throw std::runtime_error("No costing method found for '" + costing + "'");
- auto request_costing = request.get_child_optional(method_options);
- if (request_costing) {
-   // If the request has any options for this costing type, merge the 2
-   // costing options - override any config options that are in the request.
-   // and add any request options not in the config.
-   for (const auto& r : *request_costing) {
-     config_costing->put_child(r.first, r.second);
-   }
- }
- return factory.Create(costing, *config_costing);
+// Get the costing methods for each mode, for multimodal there is one for each
+// mode otherwise there is only the one for the route type's mode
+TravelMode GetModeCosting(costing_cache_t& costing_cache,
+                          const boost::property_tree::ptree& json_ptree,
+                          const std::string& routetype,
+                          std::shared_ptr<DynamicCost> mode_costing[4]) {
+  if (routetype == "multimodal") {
+    // Create array of costing methods per mode and set initial mode to
+    // pedestrian
+    mode_costing[0] = costing_cache.get(json_ptree, "auto");
+    mode_costing[1] = costing_cache.get(json_ptree, "pedestrian");
+    mode_costing[2] = costing_cache.get(json_ptree, "bicycle");
+    mode_costing[3] = costing_cache.get(json_ptree, "transit");
+    return TravelMode::kPedestrian;
+  }
+  // Assign costing method, override any config options that are in the
+  // json request
+  std::shared_ptr<DynamicCost> cost = costing_cache.get(json_ptree, routetype);
+  TravelMode mode = cost->travelmode();
+  mode_costing[static_cast<uint32_t>(mode)] = cost;
+  return mode;
+}
+
+// Compute an isochrone for every origin in the batch file, one per line in
+// the same format as the -o option. Each thread keeps its own Isochrone and
+// reader for the whole batch, the readers all share one tile cache. As each
+// origin finishes its GeoJSON is written to the output as a single line
+// prefixed with the origin's line number in the batch file and a tab. Origins
+// that can't be found get a line too, with an error object instead.
+int RunBatch(const boost::property_tree::ptree& config, const std::string& batch_file,
+             const std::string& output_file, const size_t threads,
+             const boost::property_tree::ptree& json_ptree, const std::string& routetype,
+             const bool reverse, const std::vector<float>& contour_times,
+             const unsigned int max_minutes) {
+  // Read all the origins up front, along with the line they came from
+  std::vector<std::string> origins;
+  std::vector<size_t> line_numbers;
+  std::ifstream batch(batch_file);
+  std::string line;
+  for (size_t line_number = 1; std::getline(batch, line); ++line_number) {
+    if (!line.empty() && line.front() != '#') {
+      origins.emplace_back(std::move(line));
+      line_numbers.push_back(line_number);
+    }
+  }
+  std::ofstream output(output_file);
+  if (!output) {
+    LOG_ERROR("Could not open " + output_file);
+    return EXIT_FAILURE;
+  }
+  LOG_INFO("Computing " + std::to_string(origins.size()) + " isochrones from " +
+           batch_file + " with a concurrency of " + std::to_string(threads));
+
+  tile_cache_t cache(config.get<size_t>("mjolnir.max_cache_size", 1073741824));
+  costing_cache_t costing_cache(config);
+  std::mutex output_lock;
+  std::atomic<size_t> next(0), failed(0);
+  // Microseconds, so the quick ones don't round down to nothing
+  std::vector<histogram_t> compute_times(threads), contour_latency(threads), serialize_times(threads);
+  auto work = [&](size_t thread) {
+    cached_reader_t reader(config.get_child("mjolnir"), &cache);
+    Isochrone isochrone;
+    for (size_t i = next++; i < origins.size(); i = next++) {
+      auto line_number = std::to_string(line_numbers[i]);
+      reader.Sync();
+      std::shared_ptr<DynamicCost> mode_costing[4];
+      TravelMode mode = GetModeCosting(costing_cache, json_ptree, routetype, mode_costing);
+      std::shared_ptr<DynamicCost> cost = mode_costing[static_cast<uint32_t>(mode)];
+      std::vector<PathLocation> path_location;
+      try {
+        path_location.push_back(Search(Location::FromCsv(origins[i]), reader, cost->GetEdgeFilter(),
+                                       cost->GetNodeFilter()));
+      } catch (...) {
+        LOG_ERROR("Origin on line " + line_number + " could not be found");
+        ++failed;
+        std::lock_guard<std::mutex> lock(output_lock);
+        output << line_number << "\t{\"error\":\"Origin could not be found\"}\n";
+        continue;
+      }
+      if (routetype == "multimodal") {
+        path_location.front().date_time_ = "current";
+      }
+
+      // Compute the isotile
+      auto t1 = std::chrono::high_resolution_clock::now();
+      auto isotile = (routetype == "multimodal") ?
+          isochrone.ComputeMultiModal(path_location, max_minutes, reader, mode_costing, mode) :
+          (reverse) ?
+            isochrone.ComputeReverse(path_location, max_minutes, reader, mode_costing, mode) :
+            isochrone.Compute(path_location, max_minutes, reader, mode_costing, mode);
+      auto t2 = std::chrono::high_resolution_clock::now();
+
+      // Then the contours
+      auto contours = isotile->GenerateContours(contour_times);
+      auto t3 = std::chrono::high_resolution_clock::now();
+
+      // And the GeoJSON
+      auto geojson = json::to_geojson<PointLL>(contours);
+      std::stringstream feature;
+      feature << line_number << '\t' << *geojson << '\n';
+      auto t4 = std::chrono::high_resolution_clock::now();
+      isochrone.Clear();
+
+      auto compute_us = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+      auto contour_us = std::chrono::duration_cast<std::chrono::microseconds>(t3 - t2).count();
+      compute_times[thread].record(compute_us);
+      contour_latency[thread].record(contour_us);
+      serialize_times[thread].record(std::chrono::duration_cast<std::chrono::microseconds>(t4 - t3).count());
+      LOG_INFO("Origin on line " + line_number + " compute isotile took " + std::to_string(compute_us / 1000.0) +
+               " ms contour generation took " + std::to_string(contour_us / 1000.0) + " ms");
+      {
+        std::lock_guard<std::mutex> lock(output_lock);
+        output << feature.rdbuf();
+      }
+
+      reader.Share();
+      if (reader.OverCommitted())
+        reader.Clear();
+    }
+  };
+  std::list<std::thread> pool;
+  for (size_t i = 0; i < threads; i++)
+    pool.emplace_back(work, i);
+  for (auto& thread : pool)
+    thread.join();
+
+  // How long the stages took
+  for (size_t i = 1; i < threads; i++) {
+    compute_times.front().merge(compute_times[i]);
+    contour_latency.front().merge(contour_latency[i]);
+    serialize_times.front().merge(serialize_times[i]);
+  }
+  for (const auto& stage : { std::make_pair("Compute isotile", &compute_times.front()),
+                             std::make_pair("Contour generation", &contour_latency.front()),
+                             std::make_pair("GeoJSON serialization", &serialize_times.front()) }) {
+    const auto& h = *stage.second;
+    auto ms = [](double usec) { return std::to_string(usec / 1000.0); };
+    LOG_INFO(std::string(stage.first) + " ms: mean " + ms(h.mean()) + " p50 " +
+             ms(h.percentile(.5)) + " p95 " + ms(h.percentile(.95)) +
+             " p99 " + ms(h.percentile(.99)) + " max " + ms(h.max()));
+  }
+  LOG_INFO("Computed " + std::to_string(origins.size() - failed) + " isochrones, " +
+           std::to_string(failed) + " origins could not be found, tiles loaded " +
+           std::to_string(cache.tiles_loaded()));
+  return EXIT_SUCCESS;
 }
 
 // Main method for testing a single path
@@ -77,7 +209,8 @@ int main(int argc, char *argv[]) {
   bool reverse = false;
   size_t n_contours = 4;
   unsigned int max_minutes = 60;
-  std::string origin, routetype, json, config;
+  std::string origin, routetype, json, config, batch, batch_output;
+  size_t threads = std::max(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(1));
   options.add_options()("help,h", "Print this help message.")(
       "version,v", "Print the version of this software.")(
       "origin,o",boost::program_options::value<std::string>(&origin),
@@ -91,6 +224,12 @@ int main(int argc, char *argv[]) {
       ("reverse,r", bpo::value<bool>(&reverse), "Reverse direction.")
       ("ncontours,n", bpo::value<size_t>(&n_contours), "Number of contours.")
       ("minutes,m", bpo::value<unsigned int>(&max_minutes), "Maximum minutes.")
+      ("batch,b", bpo::value<std::string>(&batch), "File of origins, one per line in the same format as "
+       "-o, to compute isochrones for in one process. Any -j options other than the locations apply to all of them.")
+      ("batch-output,f", bpo::value<std::string>(&batch_output), "File to write the batch's isochrones to, one GeoJSON per line "
+       "prefixed with the origin's line number in the batch file and a tab, or an error object for origins that can't be found.")
+      ("threads", bpo::value<size_t>(&threads), "Concurrency to use for the origins of a batch [default=hardware concurrency]. "
+       "A single origin is always computed on one thread.")
       ("config", bpo::value<std::string>(&config), "Valhalla configuration file");
 
   bpo::positional_options_description pos_options;
@@ -125,7 +264,26 @@ int main(int argc, char *argv[]) {
 
   // argument checking and verification
   boost::property_tree::ptree json_ptree;
-  if (vm.count("json") == 0) {
+  if (vm.count("batch")) {
+    for (auto arg : std::vector<std::string> { "batch-output", "config" }) {
+      if (vm.count(arg) == 0) {
+        std::cerr << "The <" << arg << "> argument was not provided, but is mandatory in batch mode\n\n";
+        std::cerr << options << "\n";
+        return EXIT_FAILURE;
+      }
+    }
+    if (vm.count("json")) {
+      std::stringstream stream;
+      stream << json;
+      boost::property_tree::read_json(stream, json_ptree);
+      routetype = json_ptree.get<std::string>("costing", routetype);
+    }
+    if (routetype.empty()) {
+      std::cerr << "The <type> argument or a costing in the json is mandatory in batch mode\n\n";
+      return EXIT_FAILURE;
+    }
+  }
+  else if (vm.count("json") == 0) {
     for (auto arg : std::vector<std::string> { "origin", "type", "config" }) {
       if (vm.count(arg) == 0) {
         std::cerr
@@ -176,44 +334,32 @@ int main(int argc, char *argv[]) {
     valhalla::midgard::logging::Configure(logging_config);
   }
 
-  // Get something we can use to fetch tiles
-  valhalla::baldr::GraphReader reader(pt.get_child("mjolnir"));
-
-  // Construct costing
-  CostFactory<DynamicCost> factory;
-  factory.Register("auto", CreateAutoCost);
-  factory.Register("auto_shorter", CreateAutoShorterCost);
-  factory.Register("bus", CreateBusCost);
-  factory.Register("bicycle", CreateBicycleCost);
-  factory.Register("pedestrian", CreatePedestrianCost);
-  factory.Register("truck", CreateTruckCost);
-  factory.Register("transit", CreateTransitCost);
-
   // Figure out the route type
   for (auto & c : routetype)
     c = std::tolower(c);
   LOG_INFO("routetype: " + routetype);
 
+  // The contours to generate
+  std::vector<float> contour_times;
+  for (size_t i = 1; i <= n_contours; i++) {
+    contour_times.push_back((max_minutes * i) / n_contours);
+  }
+
+  // Do a whole batch of them
+  if (vm.count("batch")) {
+    return RunBatch(pt, batch, batch_output, std::max(threads, static_cast<size_t>(1)), json_ptree,
+                    routetype, reverse, contour_times, max_minutes);
+  }
+
+  // Get something we can use to fetch tiles
+  valhalla::baldr::GraphReader reader(pt.get_child("mjolnir"));
+
+  // Construct costing, the config's options are left as they are
+  costing_cache_t costing_cache(pt);
+
   // Get the costing method - pass the JSON configuration
-  TripPath trip_path;
-  TravelMode mode;
   std::shared_ptr<DynamicCost> mode_costing[4];
-  if (routetype == "multimodal") {
-    // Create array of costing methods per mode and set initial mode to
-    // pedestrian
-    mode_costing[0] = get_costing(factory, pt, json_ptree, "auto");
-    mode_costing[1] = get_costing(factory, pt, json_ptree, "pedestrian");
-    mode_costing[2] = get_costing(factory, pt, json_ptree, "bicycle");
-    mode_costing[3] = get_costing(factory, pt, json_ptree, "transit");
-    mode = TravelMode::kPedestrian;
-  } else {
-    // Assign costing method, override any config options that are in the
-    // json request
-    std::shared_ptr<DynamicCost> cost = get_costing(factory, pt,
-                              json_ptree, routetype);
-    mode = cost->travelmode();
-    mode_costing[static_cast<uint32_t>(mode)] = cost;
-  }
+  TravelMode mode = GetModeCosting(costing_cache, json_ptree, routetype, mode_costing);
 
   // Find locations
   std::shared_ptr<DynamicCost> cost = mode_costing[static_cast<uint32_t>(mode)];
@@ -246,40 +392,15 @@ int main(int argc, char *argv[]) {
   uint32_t msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
   LOG_INFO("Compute isotile took " + std::to_string(msecs) + " ms");
 
-  // Evaluate the min, max rows and columns that are set
-  int nv = 0;
-  int32_t min_row = isotile->nrows();
-  int32_t max_row = 0;
-  int32_t min_col = isotile->ncolumns();
-  int32_t max_col = 0;
-  const auto& iso_data = isotile->data();
-  for (int32_t row = 0; row < isotile->nrows(); row++) {
-    for (int32_t col = 0; col < isotile->ncolumns(); col++) {
-      int id = isotile->TileId(col, row);
-      if (iso_data[id] < max_minutes + 5) {
-        min_row = std::min(row, min_row);
-        max_row = std::max(row, max_row);
-        min_col = std::min(col, min_col);
-        max_col = std::max(col, max_col);
-        nv++;
-      }
-    }
-  }
-  LOG_INFO("Marked " + std::to_string(nv) + " cells in the isotile" + " size= " + std::to_string(iso_data.size()));
-  LOG_INFO("Rows = " + std::to_string(isotile->nrows()) + " min = " + std::to_string(min_row) + " max = " + std::to_string(max_row));
-  LOG_INFO("Cols = " + std::to_string(isotile->ncolumns()) + " min = " + std::to_string(min_col) + " max = " + std::to_string(max_col));
-
-  std::vector<float> contour_times;
-  for (size_t i = 1; i <= n_contours; i++) {
-    contour_times.push_back((max_minutes * i) / n_contours);
-  }
+  // One pass over the isotile gives the contours for all of the times
+  auto t3 = std::chrono::high_resolution_clock::now();
   auto contours = isotile->GenerateContours(contour_times);
   auto geojson = json::to_geojson<PointLL>(contours);
 
-  auto t3 = std::chrono::high_resolution_clock::now();
-  msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t3 - t2).count();
+  auto t4 = std::chrono::high_resolution_clock::now();
+  msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t4 - t3).count();
   LOG_INFO("Contour Generation took " + std::to_string(msecs) + " ms");
-  msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t3 - t1).count();
+  msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t4 - t1).count();
   LOG_INFO("Isochrone took " + std::to_string(msecs) + " ms");
 
   std::cout << std::endl << *geojson;
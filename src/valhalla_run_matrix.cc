@@ -2,14 +2,22 @@
 #include <string>
 #include <vector>
 #include <cmath>
+#include <thread>
+#include <atomic>
+#include <list>
+#include <algorithm>
 #include <boost/program_options.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/optional.hpp>
 #include <boost/format.hpp>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 
 #include "config.h"
+#include "costing_cache.h"
+#include "tile_cache.h"
 
 #include <valhalla/baldr/graphreader.h>
 #include <valhalla/baldr/pathlocation.h>
@@ -41,30 +49,6 @@ std::string GetFormattedTime(uint32_t secs) {
   return std::to_string(hours) + ":" + std::to_string(minutes) + ":" + std::to_string(seconds);
 }
 
-// Returns the costing method (created from the dynamic cost factory).
-// Get the costing options. Get the base options from the config and the
-// options for the specified costing method. Merge in any request costing
-// options that override those in the config.
-valhalla::sif::cost_ptr_t get_costing(CostFactory<DynamicCost> factory,
-                                      boost::property_tree::ptree& config,
-                                      boost::property_tree::ptree& request,
-                                      const std::string& costing) {
- std::string method_options = "costing_options." + costing;
- auto config_costing = config.get_child_optional(method_options);
- if (!config_costing)
-   throw std::runtime_error("No costing method found for '" + costing + "'");
- auto request_costing = request.get_child_optional(method_options);
- if (request_costing) {
-   // If the request has any options for this costing type, merge the 2
-   // costing options - override any config options that are in the request.
-   // and add any request options not in the config.
-   for (const auto& r : *request_costing) {
-     config_costing->put_child(r.first, r.second);
-   }
- }
- return factory.Create(costing, *config_costing);
-}
-
 float random_unit_float() {
   // Create a random integer between -1000 - +1000,
   // then scale to be between -1 and 1
@@ -78,28 +62,211 @@ PointLL JitterLatLng(const PointLL& latlng, const float delta) {
            latlng.lat() + random_unit_float() * delta };
 }
 
-void LogFindings(const uint32_t n, const std::vector<TimeDistance>& res) {
+// Get the costing methods for each mode, for multimodal there is one for each
+// mode otherwise there is only the one for the route type's mode
+TravelMode GetModeCosting(costing_cache_t& costing_cache,
+                          const boost::property_tree::ptree& json_ptree,
+                          const std::string& routetype,
+                          std::shared_ptr<DynamicCost> mode_costing[4]) {
+  if (routetype == "multimodal") {
+    // Create array of costing methods per mode and set initial mode to
+    // pedestrian
+    mode_costing[0] = costing_cache.get(json_ptree, "auto");
+    mode_costing[1] = costing_cache.get(json_ptree, "pedestrian");
+    mode_costing[2] = costing_cache.get(json_ptree, "bicycle");
+    mode_costing[3] = costing_cache.get(json_ptree, "transit");
+    return TravelMode::kPedestrian;
+  }
+  // Assign costing method
+  std::shared_ptr<DynamicCost> cost = costing_cache.get(json_ptree, routetype);
+  TravelMode mode = cost->travelmode();
+  mode_costing[static_cast<uint32_t>(mode)] = cost;
+  return mode;
+}
+
+// Compute the matrix on several threads. CostMatrix expands forward from
+// every source and in reverse from every target, so whichever side is split
+// up gets searched once but every chunk has to redo the searches of the
+// other side. That makes the total work the split side plus the other side
+// once per chunk, so the larger side is split and into only one chunk per
+// thread. Each thread runs its own CostMatrix over its chunk, with its own
+// reader and costing on top of one shared tile cache. With few locations on
+// the side that is not split this is close to threads times faster, as the
+// two sides get closer in size more of the extra searches eat into that. The
+// results end up in the same row major order as a single CostMatrix would
+// give.
+std::vector<TimeDistance> ParallelSourceToTarget(
+    const std::vector<PathLocation>& sources,
+    const std::vector<PathLocation>& targets,
+    const boost::property_tree::ptree& config, tile_cache_t& cache,
+    costing_cache_t& costing_cache, const boost::property_tree::ptree& json_ptree,
+    const std::string& routetype, const uint32_t threads) {
+  // One chunk per thread, more would only repeat more searches
+  bool split_sources = sources.size() >= targets.size();
+  size_t count = split_sources ? sources.size() : targets.size();
+  size_t chunk = std::max((count + threads - 1) / threads, static_cast<size_t>(1));
+  std::vector<TimeDistance> res(sources.size() * targets.size());
+  std::atomic<size_t> next(0);
+
+  auto work = [&]() {
+    cached_reader_t reader(config.get_child("mjolnir"), &cache);
+    std::shared_ptr<DynamicCost> mode_costing[4];
+    TravelMode mode = GetModeCosting(costing_cache, json_ptree, routetype, mode_costing);
+    for (size_t begin = next.fetch_add(chunk); begin < count; begin = next.fetch_add(chunk)) {
+      size_t end = std::min(begin + chunk, count);
+      reader.Sync();
+      CostMatrix matrix;
+      if (split_sources) {
+        std::vector<PathLocation> part(sources.begin() + begin, sources.begin() + end);
+        auto tds = matrix.SourceToTarget(part, targets, reader, mode_costing, mode);
+        // Whole rows so they go in as they are
+        std::copy(tds.begin(), tds.end(), res.begin() + begin * targets.size());
+      } else {
+        std::vector<PathLocation> part(targets.begin() + begin, targets.begin() + end);
+        auto tds = matrix.SourceToTarget(sources, part, reader, mode_costing, mode);
+        // A slice of columns out of every row
+        for (size_t row = 0; row < sources.size(); row++)
+          std::copy(tds.begin() + row * part.size(), tds.begin() + (row + 1) * part.size(),
+                    res.begin() + row * targets.size() + begin);
+      }
+      reader.Share();
+      if (reader.OverCommitted())
+        reader.Clear();
+    }
+  };
+
+  std::list<std::thread> pool;
+  for (uint32_t i = 0; i < threads; i++)
+    pool.emplace_back(work);
+  for (auto& thread : pool)
+    thread.join();
+  return res;
+}
+
+// Log how many of the source to target pairs were found, without going
+// through every cell
+void LogFindings(const std::vector<TimeDistance>& res) {
   uint32_t found = 0;
-  uint32_t idx = 0;
-  uint32_t source, target;
   for (auto& r : res) {
-    source = idx / n;
-    target = idx % n;
-    if (r.time < 9999999.0f) {
-      LOG_TRACE("Source = " + std::to_string(source) + " to target " +
-               std::to_string(target) + " time= " + std::to_string(r.time) +
-               " distance = " + std::to_string(r.dist));
-
+    if (r.time < 9999999.0f)
       found++;
-    } else {
-      LOG_INFO("Source = " + std::to_string(source) + " to target " +
-                std::to_string(target) + " not found");
-    }
-    idx++;
   }
   LOG_INFO("Found: " + std::to_string(found) + " of " + std::to_string(res.size()));
 }
 
+// Write the matrix as csv, one source,target,time,distance line per cell.
+// The lines are formatted into one buffer that is only written out when it
+// gets big rather than per cell
+bool WriteCsv(FILE* file, const uint32_t ncols, const std::vector<TimeDistance>& res) {
+  std::string buffer;
+  buffer.reserve(1 << 20);
+  buffer += "source,target,time,distance\n";
+  char line[64];
+  for (size_t idx = 0; idx < res.size(); idx++) {
+    int n = snprintf(line, sizeof(line), "%u,%u,%u,%.3f\n",
+                     static_cast<uint32_t>(idx / ncols), static_cast<uint32_t>(idx % ncols),
+                     static_cast<uint32_t>(res[idx].time), static_cast<float>(res[idx].dist));
+    buffer.append(line, n);
+    if (buffer.size() > (1 << 20) - sizeof(line)) {
+      if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+        return false;
+      buffer.clear();
+    }
+  }
+  return fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+}
+
+// Write the matrix in binary so that it can be read (or memory mapped) with
+// no parsing. A 16 byte header of the magic "VMTX", then the version, the
+// number of rows (sources) and the number of columns (targets) as uint32s.
+// After that come rows * cols float times in seconds followed by
+// rows * cols float distances, both in row major order. Everything is in
+// the byte order of the machine that wrote it.
+bool WriteBinary(FILE* file, const uint32_t nrows, const uint32_t ncols,
+                 const std::vector<TimeDistance>& res) {
+  uint32_t header[4] = { 0, 1, nrows, ncols };
+  std::memcpy(header, "VMTX", 4);
+  if (fwrite(header, sizeof(header), 1, file) != 1)
+    return false;
+  std::vector<float> values(res.size());
+  for (size_t i = 0; i < res.size(); i++)
+    values[i] = static_cast<float>(res[i].time);
+  if (fwrite(values.data(), sizeof(float), values.size(), file) != values.size())
+    return false;
+  for (size_t i = 0; i < res.size(); i++)
+    values[i] = static_cast<float>(res[i].dist);
+  return fwrite(values.data(), sizeof(float), values.size(), file) == values.size();
+}
+
+// One run of the optimizer
+struct tour_t {
+  uint32_t seed;
+  std::vector<uint32_t> tour;
+  float cost;
+  uint32_t ms;   // From the start of all the runs until this one was done
+};
+
+// The cost of going through the locations in tour order
+float TourCost(const uint32_t nlocs, const std::vector<float>& costs,
+               const std::vector<uint32_t>& tour) {
+  float cost = 0.0f;
+  for (size_t i = 1; i < tour.size(); i++)
+    cost += costs[tour[i - 1] * nlocs + tour[i]];
+  return cost;
+}
+
+// Run the optimizer from several seeds spread over the threads and keep the
+// best tour. The costs are converted from the matrix once and shared by all
+// of the runs. Logs the cost and time of each run and how the best tour
+// improved over time.
+std::vector<uint32_t> OptimizeTour(const uint32_t nlocs,
+                                   const std::vector<TimeDistance>& res,
+                                   const uint32_t runs, const uint32_t threads) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+  std::vector<float> costs;
+  costs.reserve(res.size());
+  for (auto& td : res) {
+    costs.push_back(static_cast<float>(td.time));
+  }
+
+  std::vector<tour_t> tours(runs);
+  std::atomic<uint32_t> next(0);
+  auto work = [&]() {
+    for (uint32_t i = next++; i < runs; i = next++) {
+      Optimizer opt;
+      // A single run keeps the optimizer's own seed
+      tours[i].seed = i + 1;
+      if (runs > 1)
+        opt.Seed(tours[i].seed);
+      tours[i].tour = opt.Solve(nlocs, costs);
+      tours[i].cost = TourCost(nlocs, costs, tours[i].tour);
+      auto t1 = std::chrono::high_resolution_clock::now();
+      tours[i].ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count();
+    }
+  };
+  std::list<std::thread> pool;
+  for (uint32_t i = 0; i < std::min(threads, runs); i++)
+    pool.emplace_back(work);
+  for (auto& thread : pool)
+    thread.join();
+
+  // Best tour so far as the runs finished
+  std::sort(tours.begin(), tours.end(), [](const tour_t& a, const tour_t& b) {
+    return a.ms < b.ms; });
+  size_t best = 0;
+  for (size_t i = 0; i < tours.size(); i++) {
+    if (tours[i].cost < tours[best].cost)
+      best = i;
+    LOG_INFO("Optimizer seed " + std::to_string(tours[i].seed) + " tour cost " +
+             std::to_string(tours[i].cost) + " done at " + std::to_string(tours[i].ms) +
+             " ms, best so far " + std::to_string(tours[best].cost));
+  }
+  LOG_INFO("Best tour cost " + std::to_string(tours[best].cost) + " from seed " +
+           std::to_string(tours[best].seed) + " of " + std::to_string(runs) + " runs on " +
+           std::to_string(std::min(threads, runs)) + " threads");
+  return tours[best].tour;
+}
+
 // Main method for testing time and distance matrix methods
 int main(int argc, char *argv[]) {
   bpo::options_description options("timedistance_test " VERSION "\n"
@@ -115,6 +282,10 @@ int main(int argc, char *argv[]) {
   std::string routetype, json, config;
   std::string matrixtype = "one_to_many";
   uint32_t iterations = 1;
+  uint32_t threads = 1;
+  uint32_t optimizer_runs = 1;
+  std::string output = "log";
+  std::string output_file;
 
   options.add_options()("help,h", "Print this help message.")(
       "version,v", "Print the version of this software.")(
@@ -126,6 +297,13 @@ int main(int argc, char *argv[]) {
       boost::program_options::value<std::string>(&json),
       "JSON Example: '{\"locations\":[{\"lat\":40.748174,\"lon\":-73.984984,\"type\":\"break\",\"heading\":200,\"name\":\"Empire State Building\",\"street\":\"350 5th Avenue\",\"city\":\"New York\",\"state\":\"NY\",\"postal_code\":\"10118-0110\",\"country\":\"US\"},{\"lat\":40.749231,\"lon\":-73.968703,\"type\":\"break\",\"name\":\"United Nations Headquarters\",\"street\":\"405 East 42nd Street\",\"city\":\"New York\",\"state\":\"NY\",\"postal_code\":\"10017-3507\",\"country\":\"US\"}],\"costing\":\"auto\",\"directions_options\":{\"units\":\"miles\"}}'")
       ("multi-run", bpo::value<uint32_t>(&iterations), "Generate the route N additional times before exiting.")
+      ("threads", bpo::value<uint32_t>(&threads), "Compute the matrix with this many threads, each working on a share of whichever of the sources or targets there are more of. The other side is searched again by every thread.")
+      ("speedup", "With more than one thread also compute the matrix on a single thread and report the speedup.")
+      ("optimizer-runs", bpo::value<uint32_t>(&optimizer_runs), "For many_to_many run the tour optimizer this "
+       "many times with different seeds, spread over the threads, and keep the best tour.")
+      ("output,o", bpo::value<std::string>(&output), "Output: log|csv|bin. log logs every cell, csv writes "
+       "source,target,time,distance lines and bin writes a header followed by packed float times and distances.")
+      ("output-file,f", bpo::value<std::string>(&output_file), "File to write the csv or bin output to.")
       // positional arguments
       ("config", bpo::value<std::string>(&config), "Valhalla configuration file");
 
@@ -153,6 +331,15 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
   }
 
+  if (output != "log" && output != "csv" && output != "bin") {
+    std::cerr << "Unknown output: " << output << "\n";
+    return EXIT_FAILURE;
+  }
+  if (output != "log" && output_file.empty()) {
+    std::cerr << "The " << output << " output needs an --output-file\n";
+    return EXIT_FAILURE;
+  }
+
   // We require JSON input of locations (unlike pathtest). The first location
   // is the origin.
   std::stringstream stream;
@@ -193,14 +380,8 @@ int main(int argc, char *argv[]) {
   // Get something we can use to fetch tiles
   valhalla::baldr::GraphReader reader(pt.get_child("mjolnir"));
 
-  // Construct costing
-  CostFactory<DynamicCost> factory;
-  factory.Register("auto", CreateAutoCost);
-  factory.Register("auto_shorter", CreateAutoShorterCost);
-  factory.Register("bus", CreateBusCost);
-  factory.Register("bicycle", CreateBicycleCost);
-  factory.Register("pedestrian", CreatePedestrianCost);
-  factory.Register("transit", CreateTransitCost);
+  // Construct costing, the config's options are left as they are
+  costing_cache_t costing_cache(pt);
 
   // Figure out the route type
   for (auto & c : routetype)
@@ -208,23 +389,8 @@ int main(int argc, char *argv[]) {
   LOG_INFO("routetype: " + routetype);
 
   // Get the costing method - pass the JSON configuration
-  TravelMode mode;
   std::shared_ptr<DynamicCost> mode_costing[4];
-  if (routetype == "multimodal") {
-    // Create array of costing methods per mode and set initial mode to
-    // pedestrian
-    mode_costing[0] = get_costing(factory, pt, json_ptree, "auto");
-    mode_costing[1] = get_costing(factory, pt, json_ptree, "pedestrian");
-    mode_costing[2] = get_costing(factory, pt, json_ptree, "bicycle");
-    mode_costing[3] = get_costing(factory, pt, json_ptree, "transit");
-    mode = TravelMode::kPedestrian;
-  } else {
-    // Assign costing method
-    std::shared_ptr<DynamicCost> cost = get_costing(factory, pt,
-                                  json_ptree, routetype);
-    mode = cost->travelmode();
-    mode_costing[static_cast<uint32_t>(mode)] = cost;
-  }
+  TravelMode mode = GetModeCosting(costing_cache, json_ptree, routetype, mode_costing);
 
   // lambda for getting path location (Loki search)
   std::shared_ptr<DynamicCost> cost = mode_costing[static_cast<uint32_t>(mode)];
@@ -265,55 +431,111 @@ int main(int argc, char *argv[]) {
   uint32_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count();
   LOG_INFO("Location Processing took " + std::to_string(ms) + " ms");
 
-  // Compute the cost matrix
-  t0 = std::chrono::high_resolution_clock::now();
+  // The sources and targets for the matrix type
+  std::vector<PathLocation> sources, targets;
+  if (matrixtype == "one_to_many") {
+    sources = {path_locations.front()};
+    targets = path_locations;
+  } else if (matrixtype == "many_to_many") {
+    sources = path_locations;
+    targets = path_locations;
+  } else {
+    sources = path_locations;
+    targets = {path_locations.back()};
+  }
 
+  // Compute the cost matrix on a single thread
   std::vector<TimeDistance> res;
-  for (uint32_t n = 0; n < iterations; n++) {
-    res.clear();
-    CostMatrix matrix;
-    if (matrixtype == "one_to_many") {
-      res = matrix.SourceToTarget({path_locations.front()}, path_locations,
-                                  reader, mode_costing, mode);
-    } else if (matrixtype == "many_to_many") {
-      res = matrix.SourceToTarget(path_locations, path_locations, reader,
-                                  mode_costing, mode);
-    } else {
-      res = matrix.SourceToTarget(path_locations, {path_locations.back()},
-                                  reader, mode_costing, mode);
+  float single = 0.0f;
+  threads = std::max(threads, 1u);
+  if (threads == 1 || vm.count("speedup")) {
+    t0 = std::chrono::high_resolution_clock::now();
+    for (uint32_t n = 0; n < iterations; n++) {
+      res.clear();
+      CostMatrix matrix;
+      res = matrix.SourceToTarget(sources, targets, reader, mode_costing, mode);
     }
+    t1 = std::chrono::high_resolution_clock::now();
+    ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count();
+    single = (static_cast<float>(ms) / static_cast<float>(iterations)) * 0.001f;
+    LOG_INFO("TDMatrix average time to compute: " + std::to_string(single) + " sec");
   }
-  t1 = std::chrono::high_resolution_clock::now();
-  ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count();
-  float avg = (static_cast<float>(ms) / static_cast<float>(iterations)) * 0.001f;
-  LOG_INFO("TDMatrix average time to compute: " + std::to_string(avg) + " sec");
 
-  // Log results
-  LOG_INFO("Results:");
-  if (matrixtype == "many_to_many") {
-    uint32_t idx1 = 0;
-    uint32_t idx2 = 0;
-    uint32_t nlocs = path_locations.size();
-    for (auto& td : res) {
-      LOG_INFO(std::to_string(idx1) + "," + std::to_string(idx2) +
-          ": Distance= " + std::to_string(td.dist) +
-          " Time= " + GetFormattedTime(td.time) + " secs = " + std::to_string(td.time));
-      idx2++;
-      if (idx2 == nlocs) {
-        idx2 = 0;
-        idx1++;
+  // And on all of them
+  if (threads > 1) {
+    tile_cache_t cache(pt.get<size_t>("mjolnir.max_cache_size", 1073741824));
+    t0 = std::chrono::high_resolution_clock::now();
+    std::vector<TimeDistance> parallel;
+    for (uint32_t n = 0; n < iterations; n++) {
+      parallel = ParallelSourceToTarget(sources, targets, pt, cache, costing_cache,
+                                        json_ptree, routetype, threads);
+    }
+    t1 = std::chrono::high_resolution_clock::now();
+    ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count();
+    float avg = (static_cast<float>(ms) / static_cast<float>(iterations)) * 0.001f;
+    LOG_INFO("TDMatrix average time to compute with " + std::to_string(threads) +
+             " threads: " + std::to_string(avg) + " sec");
+    if (single > 0.0f && avg > 0.0f) {
+      LOG_INFO("Speedup: " + std::to_string(single / avg) + "x");
+      size_t differ = 0;
+      for (size_t i = 0; i < res.size(); i++) {
+        if (res[i].time != parallel[i].time || res[i].dist != parallel[i].dist)
+          differ++;
       }
+      LOG_INFO("Results that differ from a single thread: " + std::to_string(differ));
     }
+    res = std::move(parallel);
+  }
 
-    // Optimize the path
-    auto t10 = std::chrono::high_resolution_clock::now();
-    std::vector<float> costs;
-    for (auto& td : res) {
-      costs.push_back(static_cast<float>(td.time));
+  // Log or write out the results
+  uint32_t nlocs = path_locations.size();
+  if (output == "log") {
+    LOG_INFO("Results:");
+    if (matrixtype == "many_to_many") {
+      uint32_t idx1 = 0;
+      uint32_t idx2 = 0;
+      for (auto& td : res) {
+        LOG_INFO(std::to_string(idx1) + "," + std::to_string(idx2) +
+            ": Distance= " + std::to_string(td.dist) +
+            " Time= " + GetFormattedTime(td.time) + " secs = " + std::to_string(td.time));
+        idx2++;
+        if (idx2 == nlocs) {
+          idx2 = 0;
+          idx1++;
+        }
+      }
+    } else {
+      uint32_t idx = 0;
+      for (auto& td : res) {
+        LOG_INFO(std::to_string(idx) + ": Distance= " + std::to_string(td.dist) +
+            " Time= " + GetFormattedTime(td.time) + " secs = " + std::to_string(td.time));
+        idx++;
+      }
+    }
+  } else {
+    t0 = std::chrono::high_resolution_clock::now();
+    FILE* file = fopen(output_file.c_str(), "wb");
+    if (file == nullptr) {
+      LOG_ERROR("Could not open " + output_file);
+      return EXIT_FAILURE;
     }
+    bool written = output == "csv" ? WriteCsv(file, targets.size(), res) :
+                   WriteBinary(file, sources.size(), targets.size(), res);
+    written = fclose(file) == 0 && written;
+    if (!written) {
+      LOG_ERROR("Could not write the matrix to " + output_file);
+      return EXIT_FAILURE;
+    }
+    t1 = std::chrono::high_resolution_clock::now();
+    ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count();
+    LogFindings(res);
+    LOG_INFO("Writing the " + output + " output took " + std::to_string(ms) + " ms");
+  }
 
-    Optimizer opt;
-    auto tour = opt.Solve(nlocs, costs);
+  if (matrixtype == "many_to_many") {
+    // Optimize the path
+    auto t10 = std::chrono::high_resolution_clock::now();
+    auto tour = OptimizeTour(nlocs, res, std::max(optimizer_runs, 1u), threads);
     LOG_INFO("Optimal Tour:");
     for (auto& loc : tour) {
       LOG_INFO("   : " + std::to_string(loc));
@@ -321,14 +543,6 @@ int main(int argc, char *argv[]) {
     auto t11 = std::chrono::high_resolution_clock::now();
     uint32_t ms1 = std::chrono::duration_cast<std::chrono::milliseconds>(t11-t10).count();
     LOG_INFO("Optimization took " + std::to_string(ms1) + " ms");
-
-  } else {
-    uint32_t idx = 0;
-    for (auto& td : res) {
-      LOG_INFO(std::to_string(idx) + ": Distance= " + std::to_string(td.dist) +
-          " Time= " + GetFormattedTime(td.time) + " secs = " + std::to_string(td.time));
-      idx++;
-    }
   }
   return EXIT_SUCCESS;
 }
@@ -1,16 +1,34 @@
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <vector>
 #include <queue>
 #include <tuple>
 #include <cmath>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <array>
+#include <map>
+#include <algorithm>
+#include <ctime>
 #include <boost/program_options.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/optional.hpp>
 #include <boost/format.hpp>
+#include <boost/filesystem/operations.hpp>
 
 #include "config.h"
+#include "tile_cache.h"
+#include "histogram.h"
+#include "costing_cache.h"
+#include "speculative_lane.h"
+#include "connectivity_file.h"
+#include "tile_prefetch.h"
+#include "trip_path_corpus.h"
 
 #include <valhalla/baldr/graphreader.h>
 #include <valhalla/baldr/pathlocation.h>
@@ -39,83 +57,289 @@ using namespace valhalla::thor;
 namespace bpo = boost::program_options;
 
 namespace {
+  // The stages of a route that get timed
+  enum stage_t { kLocationProcessing, kGetBestPath, kTripPathBuilder, kClear,
+                 kDirectionsBuilder, kStageCount };
+  const std::array<std::string, kStageCount> kStageNames {
+    { "Location Processing", "GetBestPath", "TripPathBuilder", "Clear",
+      "DirectionsBuilder" } };
+
+  // Microseconds between two points in time
+  uint64_t usecs(const std::chrono::high_resolution_clock::time_point& start,
+                 const std::chrono::high_resolution_clock::time_point& end) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+  }
+
   class PathStatistics {
     std::pair<float, float> origin;
     std::pair<float, float> destination;
     std::string success;
     uint32_t passes;
-    uint32_t runtime;
+    uint64_t runtime;
     uint32_t trip_time;
     float trip_dist;
     float arc_dist;
     uint32_t manuevers;
+    std::array<uint64_t, kStageCount> stage_times;
+    uint32_t tiles_loaded;
 
   public:
     PathStatistics (std::pair<float, float> p1, std::pair<float, float> p2)
       : origin(p1), destination(p2), success("false"),
         passes(0), runtime(), trip_time(),
-        trip_dist(), arc_dist(), manuevers() { }
+        trip_dist(), arc_dist(), manuevers(), stage_times(),
+        tiles_loaded() { }
 
     void setSuccess(std::string s) { success = s; }
     void incPasses(void) { ++passes; }
-    void addRuntime(uint32_t msec) { runtime += msec; }
+    void addRuntime(uint64_t usec) { runtime += usec; }
     void setTripTime(uint32_t t) { trip_time = t; }
     void setTripDist(float d) { trip_dist = d; }
     void setArcDist(float d) { arc_dist = d; }
     void setManuevers(uint32_t n) { manuevers = n; }
-    void log() {
-      valhalla::midgard::logging::Log(
-        (boost::format("%f,%f,%f,%f,%s,%d,%d,%d,%f,%f,%d")
+    void addStageTime(stage_t stage, uint64_t usec) { stage_times[stage] += usec; }
+    void setTilesLoaded(uint32_t n) { tiles_loaded = n; }
+    uint32_t getPasses() const { return passes; }
+    uint64_t getRuntime() const { return runtime; }
+    uint64_t getStageTime(stage_t stage) const { return stage_times[stage]; }
+    // Runtime stays in whole milliseconds for the scripts that read these,
+    // the per stage times that follow it are in microseconds
+    std::string csv() const {
+      return (boost::format("%f,%f,%f,%f,%s,%d,%d,%d,%f,%f,%d,%d,%d,%d,%d,%d,%d")
           % origin.first % origin.second % destination.first % destination.second
-          % success % passes % runtime % trip_time % trip_dist % arc_dist % manuevers).str(),
-        " [STATISTICS] ");
+          % success % passes % (runtime / 1000) % trip_time % trip_dist % arc_dist % manuevers
+          % stage_times[kLocationProcessing] % stage_times[kGetBestPath]
+          % stage_times[kTripPathBuilder] % stage_times[kClear]
+          % stage_times[kDirectionsBuilder] % tiles_loaded).str();
+    }
+    void log() const {
+      valhalla::midgard::logging::Log(csv(), " [STATISTICS] ");
+    }
+  };
+
+  // Latency distributions over a batch of routes. Each thread keeps its own
+  // and they are merged once all the routes are done
+  struct batch_histograms_t {
+    std::array<histogram_t, kStageCount> stages;
+    histogram_t runtime;
+    std::array<uint64_t, 4> passes;
+
+    batch_histograms_t() : passes() { }
+
+    void record(const PathStatistics& data) {
+      for (size_t i = 0; i < kStageCount; ++i)
+        stages[i].record(data.getStageTime(static_cast<stage_t>(i)));
+      runtime.record(data.getRuntime());
+      ++passes[std::min(data.getPasses(), static_cast<uint32_t>(passes.size() - 1))];
+    }
+
+    void merge(const batch_histograms_t& other) {
+      for (size_t i = 0; i < kStageCount; ++i)
+        stages[i].merge(other.stages[i]);
+      runtime.merge(other.runtime);
+      for (size_t i = 0; i < passes.size(); ++i)
+        passes[i] += other.passes[i];
+    }
+
+    void log() const {
+      auto line = [](const std::string& name, const histogram_t& h) {
+        LOG_INFO((boost::format("%-20s %10d %10d %10d %10d %10d") % name
+            % h.percentile(0.5) % h.percentile(0.9) % h.percentile(0.99)
+            % h.percentile(0.999) % h.max()).str());
+      };
+      LOG_INFO((boost::format("%-20s %10s %10s %10s %10s %10s") % "Stage (us)"
+          % "p50" % "p90" % "p99" % "p99.9" % "max").str());
+      for (size_t i = 0; i < kStageCount; ++i)
+        line(kStageNames[i], stages[i]);
+      line("Total", runtime);
+      for (size_t i = 1; i < passes.size(); ++i)
+        LOG_INFO("Routes with " + std::to_string(i) + " passes: " + std::to_string(passes[i]));
     }
   };
+
+  // Receives each line of the narrative as it is generated. When running a
+  // single route this goes to the log, in batch mode to a file per route
+  using narrative_t = std::function<void (const std::string&)>;
+
+  // A route request parsed either from the command line or from one line of
+  // a batch file
+  struct route_request_t {
+    std::vector<Location> locations;
+    std::string routetype;
+    DirectionsOptions directions_options;
+    boost::property_tree::ptree json_ptree;
+  };
+
+  // A thread with its own reader and path algorithms that runs one of the
+  // relaxed passes of a route while the first pass is still searching. The
+  // lane is declared last so its thread is gone before the rest of it
+  struct pass_lane_t {
+    pass_lane_t(const boost::property_tree::ptree& config, tile_cache_t* cache)
+      : reader(config.get_child("mjolnir"), cache) { }
+    cached_reader_t reader;
+    AStarPathAlgorithm astar;
+    BidirectionalAStar bd;
+    speculative_lane_t<std::vector<PathInfo> > lane;
+  };
+
+  // The tile connectivity locations are checked against, either mapped from
+  // the file valhalla_build_connectivity wrote or built at startup
+  struct connectivity_t {
+    std::unique_ptr<mapped_connectivity_t> mapped;
+    std::unique_ptr<connectivity_map_t> built;
+    std::unordered_set<size_t> get_colors(uint32_t level, const PathLocation& location,
+                                          float radius) const {
+      return mapped ? mapped->get_colors(level, location, radius) :
+                      built->get_colors(level, location, radius);
+    }
+  };
+
+  // What changes about the costing on each pass after the first
+  enum relaxation_t { kRelaxHierarchyLimits, kDisableHighwayTransitions };
+
+  // Everything needed to run routes that is worth keeping around between
+  // requests. In batch mode each thread has one of these so that its tiles
+  // stay cached and the path algorithms are reused. The threads' readers
+  // all share one tile cache and they all share one set of costing profiles.
+  // When speculating there is a lane for each of the relaxed passes. When
+  // dumping every trip path goes to the corpus the contexts share
+  struct route_context_t {
+    route_context_t(const boost::property_tree::ptree& config,
+                    costing_cache_t& costing, tile_cache_t* cache = nullptr,
+                    bool speculate = false)
+      : config(config), reader(config.get_child("mjolnir"), cache),
+        costing(costing) {
+      if (speculate) {
+        for (auto& lane : lanes)
+          lane.reset(new pass_lane_t(config, cache));
+      }
+    }
+    const boost::property_tree::ptree& config;
+    cached_reader_t reader;
+    costing_cache_t& costing;
+    AStarPathAlgorithm astar;
+    BidirectionalAStar bd;
+    MultiModalPathAlgorithm mm;
+    std::array<std::unique_ptr<pass_lane_t>, 2> lanes;
+    trip_path_corpus::writer_t* corpus = nullptr;
+  };
+
+  // The relaxations each pass after the first adds to the ones before it
+  std::vector<relaxation_t> GetRelaxations(const DynamicCost& cost, bool using_astar) {
+    std::vector<relaxation_t> relaxations;
+    if (cost.AllowMultiPass())
+      relaxations.push_back(kRelaxHierarchyLimits);
+    // Third pass only if using astar
+    if (using_astar)
+      relaxations.push_back(kDisableHighwayTransitions);
+    return relaxations;
+  }
+
+  // Apply the relaxations from first up to but not including last
+  void Relax(DynamicCost& cost, const std::vector<relaxation_t>& relaxations,
+             size_t first, size_t last, bool using_astar) {
+    for (size_t i = first; i < last; ++i) {
+      if (relaxations[i] == kRelaxHierarchyLimits) {
+        float expansion_within_factor = (using_astar) ? 4.0f : 2.0f;
+        cost.RelaxHierarchyLimits(using_astar, expansion_within_factor);
+      } else {
+        cost.DisableHighwayTransitions();
+      }
+    }
+  }
 }
 
 /**
- * Test a single path from origin to destination.
+ * Test a single path from origin to destination. If the path can't be found
+ * the search is tried again with relaxed hierarchy limits and then with
+ * highway transitions disabled. Given lanes and a way to get fresh costing
+ * the relaxed passes are started on the lanes right away, alongside the
+ * first pass, and the first pass that finds a path in that order wins.
  */
 TripPath PathTest(GraphReader& reader, PathLocation& origin,
                   PathLocation& dest, PathAlgorithm* pathalgorithm,
                   const std::shared_ptr<DynamicCost>* mode_costing,
                   const TravelMode mode, PathStatistics& data,
                   bool multi_run, uint32_t iterations,
-                  bool using_astar) {
+                  bool using_astar,
+                  std::array<std::unique_ptr<pass_lane_t>, 2>* lanes = nullptr,
+                  const std::function<cost_ptr_t ()>& fresh_cost = nullptr) {
   auto t1 = std::chrono::high_resolution_clock::now();
   std::vector<PathInfo> pathedges;
   std::vector<PathLocation> through_loc;
-  pathedges = pathalgorithm->GetBestPath(origin, dest, reader, mode_costing, mode);
   cost_ptr_t cost = mode_costing[static_cast<uint32_t>(mode)];
-  data.incPasses();
-  if (pathedges.size() == 0) {
-    if (cost->AllowMultiPass()) {
-      LOG_INFO("Try again with relaxed hierarchy limits");
+  auto relaxations = GetRelaxations(*cost, using_astar);
+
+  // Start the relaxed passes on any lanes that are free. Each gets its own
+  // costing, relaxed as far as its pass, and its own copy of the locations
+  std::array<pass_lane_t*, 2> started {{ nullptr, nullptr }};
+  if (lanes && fresh_cost) {
+    for (size_t pass = 1; pass <= relaxations.size(); ++pass) {
+      auto* lane = (*lanes)[pass - 1].get();
+      if (!lane || !lane->lane.idle())
+        continue;
+      std::array<cost_ptr_t, 4> costing;
+      std::copy(mode_costing, mode_costing + costing.size(), costing.begin());
+      costing[static_cast<uint32_t>(mode)] = fresh_cost();
+      Relax(*costing[static_cast<uint32_t>(mode)], relaxations, 0, pass, using_astar);
+      PathAlgorithm* algorithm = using_astar ? static_cast<PathAlgorithm*>(&lane->astar) : &lane->bd;
+      auto job = [lane, algorithm, origin, dest, costing, mode]() mutable {
+        lane->reader.Sync();
+        auto path = algorithm->GetBestPath(origin, dest, lane->reader, costing.data(), mode);
+        algorithm->Clear();
+        lane->reader.Share();
+        if (lane->reader.OverCommitted())
+          lane->reader.Clear();
+        return path;
+      };
+      if (lane->lane.start(job))
+        started[pass - 1] = lane;
+    }
+  }
+  // Whatever happens we don't wait on the passes we didn't need
+  struct abandon_t {
+    std::array<pass_lane_t*, 2>& started;
+    ~abandon_t() {
+      for (auto* lane : started) {
+        if (lane)
+          lane->lane.abandon();
+      }
+    }
+  } abandon { started };
+
+  // Take the passes in order until one of them finds a path
+  size_t relaxed = 0;
+  for (size_t pass = 0; pass <= relaxations.size() && pathedges.size() == 0; ++pass) {
+    data.incPasses();
+    if (pass == 0) {
+      pathedges = pathalgorithm->GetBestPath(origin, dest, reader, mode_costing, mode);
+    } else if (started[pass - 1]) {
+      pathedges = started[pass - 1]->lane.get();
+      started[pass - 1] = nullptr;
+    } else {
+      if (relaxations[pass - 1] == kRelaxHierarchyLimits)
+        LOG_INFO("Try again with relaxed hierarchy limits");
       pathalgorithm->Clear();
-      float relax_factor = (using_astar) ? 16.0f : 8.0f;
-      float expansion_within_factor = (using_astar) ? 4.0f : 2.0f;
-      cost->RelaxHierarchyLimits(using_astar, expansion_within_factor);
+      Relax(*cost, relaxations, relaxed, pass, using_astar);
+      relaxed = pass;
       pathedges = pathalgorithm->GetBestPath(origin, dest, reader, mode_costing, mode);
-      data.incPasses();
+    }
+    // Later runs should search the way the winning pass did
+    if (pathedges.size() != 0) {
+      Relax(*cost, relaxations, relaxed, pass, using_astar);
+      relaxed = pass;
     }
   }
   if (pathedges.size() == 0) {
-    // Third pass only if using astar
-    if (!using_astar) {
-      // Return an empty trip path
-      return TripPath();
-    }
-    cost->DisableHighwayTransitions();
+    // Return an empty trip path
     pathalgorithm->Clear();
-    pathedges = pathalgorithm->GetBestPath(origin, dest, reader, mode_costing, mode);
-    data.incPasses();
-    if (pathedges.size() == 0) {
-      // Return an empty trip path
-      return TripPath();
-    }
+    data.addStageTime(kGetBestPath, usecs(t1, std::chrono::high_resolution_clock::now()));
+    return TripPath();
   }
   auto t2 = std::chrono::high_resolution_clock::now();
-  uint32_t msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
+  uint64_t us = usecs(t1, t2);
+  data.addStageTime(kGetBestPath, us);
+  uint32_t msecs = us / 1000;
   LOG_INFO("PathAlgorithm GetBestPath took " + std::to_string(msecs) + " ms");
 
   // Form trip path
@@ -123,14 +347,18 @@ TripPath PathTest(GraphReader& reader, PathLocation& origin,
   TripPath trip_path = TripPathBuilder::Build(reader, pathedges, origin,
                                               dest, through_loc);
   t2 = std::chrono::high_resolution_clock::now();
-  msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
+  us = usecs(t1, t2);
+  data.addStageTime(kTripPathBuilder, us);
+  msecs = us / 1000;
   LOG_INFO("TripPathBuilder took " + std::to_string(msecs) + " ms");
 
   // Time how long it takes to clear the path
   t1 = std::chrono::high_resolution_clock::now();
   pathalgorithm->Clear();
   t2 = std::chrono::high_resolution_clock::now();
-  msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
+  us = usecs(t1, t2);
+  data.addStageTime(kClear, us);
+  msecs = us / 1000;
   LOG_INFO("PathAlgorithm Clear took " + std::to_string(msecs) + " ms");
 
   // Run again to see benefits of caching
@@ -249,99 +477,87 @@ std::string GetFormattedTime(uint32_t seconds) {
 
 TripDirections DirectionsTest(const DirectionsOptions& directions_options,
                               TripPath& trip_path, Location origin,
-                              Location destination, PathStatistics& data) {
+                              Location destination, PathStatistics& data,
+                              const narrative_t& narrative) {
+  auto t1 = std::chrono::high_resolution_clock::now();
   DirectionsBuilder directions;
   TripDirections trip_directions = directions.Build(directions_options,
                                                     trip_path);
+  data.addStageTime(kDirectionsBuilder,
+                    usecs(t1, std::chrono::high_resolution_clock::now()));
   std::string units = (
       directions_options.units()
           == DirectionsOptions::Units::DirectionsOptions_Units_kKilometers ?
           "km" : "mi");
   int m = 1;
-  valhalla::midgard::logging::Log("From: " + std::to_string(origin),
-                                  " [NARRATIVE] ");
-  valhalla::midgard::logging::Log("To: " + std::to_string(destination),
-                                  " [NARRATIVE] ");
-  valhalla::midgard::logging::Log(
-      "==============================================", " [NARRATIVE] ");
+  narrative("From: " + std::to_string(origin));
+  narrative("To: " + std::to_string(destination));
+  narrative("==============================================");
   for (int i = 0; i < trip_directions.maneuver_size(); ++i) {
     const auto& maneuver = trip_directions.maneuver(i);
 
     // Depart instruction
     if (maneuver.has_depart_instruction()) {
-      valhalla::midgard::logging::Log(
+      narrative(
           (boost::format("   %s")
-              % maneuver.depart_instruction()).str(),
-          " [NARRATIVE] ");
+              % maneuver.depart_instruction()).str());
     }
 
     // Verbal depart instruction
     if (maneuver.has_verbal_depart_instruction()) {
-      valhalla::midgard::logging::Log(
+      narrative(
           (boost::format("   VERBAL_DEPART: %s")
-              % maneuver.verbal_depart_instruction()).str(),
-          " [NARRATIVE] ");
+              % maneuver.verbal_depart_instruction()).str());
     }
 
     // Instruction
-    valhalla::midgard::logging::Log(
+    narrative(
         (boost::format("%d: %s | %.1f %s") % m++ % maneuver.text_instruction()
-            % maneuver.length() % units).str(),
-        " [NARRATIVE] ");
+            % maneuver.length() % units).str());
 
     // Verbal transition alert instruction
     if (maneuver.has_verbal_transition_alert_instruction()) {
-      valhalla::midgard::logging::Log(
+      narrative(
           (boost::format("   VERBAL_ALERT: %s")
-              % maneuver.verbal_transition_alert_instruction()).str(),
-          " [NARRATIVE] ");
+              % maneuver.verbal_transition_alert_instruction()).str());
     }
 
     // Verbal pre transition instruction
     if (maneuver.has_verbal_pre_transition_instruction()) {
-      valhalla::midgard::logging::Log(
+      narrative(
           (boost::format("   VERBAL_PRE: %s")
-              % maneuver.verbal_pre_transition_instruction()).str(),
-          " [NARRATIVE] ");
+              % maneuver.verbal_pre_transition_instruction()).str());
     }
 
     // Verbal post transition instruction
     if (maneuver.has_verbal_post_transition_instruction()) {
-      valhalla::midgard::logging::Log(
+      narrative(
           (boost::format("   VERBAL_POST: %s")
-              % maneuver.verbal_post_transition_instruction()).str(),
-          " [NARRATIVE] ");
+              % maneuver.verbal_post_transition_instruction()).str());
     }
 
     // Arrive instruction
     if (maneuver.has_arrive_instruction()) {
-      valhalla::midgard::logging::Log(
+      narrative(
           (boost::format("   %s")
-              % maneuver.arrive_instruction()).str(),
-          " [NARRATIVE] ");
+              % maneuver.arrive_instruction()).str());
     }
 
     // Verbal arrive instruction
     if (maneuver.has_verbal_arrive_instruction()) {
-      valhalla::midgard::logging::Log(
+      narrative(
           (boost::format("   VERBAL_ARRIVE: %s")
-              % maneuver.verbal_arrive_instruction()).str(),
-          " [NARRATIVE] ");
+              % maneuver.verbal_arrive_instruction()).str());
     }
 
     if (i < trip_directions.maneuver_size() - 1)
-      valhalla::midgard::logging::Log(
-          "----------------------------------------------", " [NARRATIVE] ");
-  }
-  valhalla::midgard::logging::Log(
-      "==============================================", " [NARRATIVE] ");
-  valhalla::midgard::logging::Log(
-      "Total time: " + GetFormattedTime(trip_directions.summary().time()),
-      " [NARRATIVE] ");
-  valhalla::midgard::logging::Log(
+      narrative("----------------------------------------------");
+  }
+  narrative("==============================================");
+  narrative("Total time: " + GetFormattedTime(trip_directions.summary().time()));
+  narrative(
       (boost::format("Total length: %.1f %s")
-          % trip_directions.summary().length() % units).str(),
-      " [NARRATIVE] ");
+          % trip_directions.summary().length() % units).str());
   data.setTripTime(trip_directions.summary().time());
   data.setTripDist(trip_directions.summary().length());
   data.setManuevers(trip_directions.maneuver_size());
@@ -349,229 +565,87 @@ TripDirections DirectionsTest(const DirectionsOptions& directions_options,
   return trip_directions;
 }
 
-// Returns the costing method (created from the dynamic cost factory).
-// Get the costing options. Get the base options from the config and the
-// options for the specified costing method. Merge in any request costing
-// options that override those in the config.
-valhalla::sif::cost_ptr_t get_costing(CostFactory<DynamicCost> factory,
-                                      boost::property_tree::ptree& config,
-                                      boost::property_tree::ptree& request,
-                                      const std::string& costing) {
- std::string method_options = "costing_options." + costing;
- auto config_costing = config.get_child_optional(method_options);
- if (!config_costing)
-   throw std::runtime_error("No costing method found for '" + costing + "'");
- auto request_costing = request.get_child_optional(method_options);
- if (request_costing) {
-   // If the request has any options for this costing type, merge the 2
-   // costing options - override any config options that are in the request.
-   // and add any request options not in the config.
-   for (const auto& r : *request_costing) {
-     config_costing->put_child(r.first, r.second);
-   }
- }
- return factory.Create(costing, *config_costing);
-}
-
-// Main method for testing a single path
-int main(int argc, char *argv[]) {
-  bpo::options_description options("valhalla_run_route " VERSION "\n"
-  "\n"
-  " Usage: valhalla_run_route [options]\n"
-  "\n"
-  "valhalla_run_route is a simple command line test tool for shortest path routing. "
-  "\n"
-  "Use the -o and -d options OR the -j option for specifying the locations. "
-  "\n"
-  "\n");
-
-  std::string origin, destination, routetype, json, config;
-  bool connectivity, multi_run;
-  connectivity = multi_run = false;
-  uint32_t iterations;
-
-  options.add_options()("help,h", "Print this help message.")(
-      "version,v", "Print the version of this software.")(
-      "origin,o",
-      boost::program_options::value<std::string>(&origin),
-      "Origin: lat,lng,[through|stop],[name],[street],[city/town/village],[state/province/canton/district/region/department...],[zip code],[country].")(
-      "destination,d",
-      boost::program_options::value<std::string>(&destination),
-      "Destination: lat,lng,[through|stop],[name],[street],[city/town/village],[state/province/canton/district/region/department...],[zip code],[country].")(
-      "type,t", boost::program_options::value<std::string>(&routetype),
-      "Route Type: auto|bicycle|pedestrian|auto-shorter")(
-      "json,j",
-      boost::program_options::value<std::string>(&json),
-      "JSON Example: '{\"locations\":[{\"lat\":40.748174,\"lon\":-73.984984,\"type\":\"break\",\"heading\":200,\"name\":\"Empire State Building\",\"street\":\"350 5th Avenue\",\"city\":\"New York\",\"state\":\"NY\",\"postal_code\":\"10118-0110\",\"country\":\"US\"},{\"lat\":40.749231,\"lon\":-73.968703,\"type\":\"break\",\"name\":\"United Nations Headquarters\",\"street\":\"405 East 42nd Street\",\"city\":\"New York\",\"state\":\"NY\",\"postal_code\":\"10017-3507\",\"country\":\"US\"}],\"costing\":\"auto\",\"directions_options\":{\"units\":\"miles\"}}'")
-      ("connectivity", "Generate a connectivity map before testing the route.")
-      ("multi-run", bpo::value<uint32_t>(&iterations), "Generate the route N additional times before exiting.")
-      // positional arguments
-      ("config", bpo::value<std::string>(&config), "Valhalla configuration file");
-
-
-  bpo::positional_options_description pos_options;
-  pos_options.add("config", 1);
+// Parse a json route request into its locations, costing and directions
+// options
+route_request_t ParseJsonRequest(const std::string& json) {
+  route_request_t request;
+  request.directions_options.set_units(
+      DirectionsOptions::Units::DirectionsOptions_Units_kMiles);
+  request.directions_options.set_language("en-US");
 
-  bpo::variables_map vm;
+  std::stringstream stream;
+  stream << json;
+  boost::property_tree::read_json(stream, request.json_ptree);
+  auto& json_ptree = request.json_ptree;
+  auto& locations = request.locations;
 
   try {
-    bpo::store(
-        bpo::command_line_parser(argc, argv).options(options).positional(
-            pos_options).run(),
-        vm);
-    bpo::notify(vm);
-
-  } catch (std::exception &e) {
-    std::cerr << "Unable to parse command line options because: " << e.what()
-              << "\n" << "This is a bug, please report it at " PACKAGE_BUGREPORT
-              << "\n";
-    return EXIT_FAILURE;
-  }
-
-  if (vm.count("help")) {
-    std::cout << options << "\n";
-    return EXIT_SUCCESS;
-  }
-
-  if (vm.count("version")) {
-    std::cout << "valhalla_run_route " << VERSION << "\n";
-    return EXIT_SUCCESS;
+    for (const auto& location : json_ptree.get_child("locations"))
+      locations.emplace_back(std::move(Location::FromPtree(location.second)));
+    if (locations.size() < 2)
+      throw std::runtime_error("");
+  } catch (...) {
+    throw std::runtime_error(
+        "insufficiently specified required parameter 'locations'");
   }
 
-  if (vm.count("connectivity")) {
-    connectivity = true;
-  }
-
-  if (vm.count("multi-run")) {
-    multi_run = true;
+  // Parse out the type of route - this provides the costing method to use
+  try {
+    request.routetype = json_ptree.get<std::string>("costing");
+  } catch (...) {
+    throw std::runtime_error("No edge/node costing provided");
   }
 
-  // Directions options - set defaults
-  DirectionsOptions directions_options;
-  directions_options.set_units(
-      DirectionsOptions::Units::DirectionsOptions_Units_kMiles);
-  directions_options.set_language("en-US");
-
-  // Locations
-  std::vector<Location> locations;
-
-  // argument checking and verification
-  boost::property_tree::ptree json_ptree;
-  if (vm.count("json") == 0) {
-    for (auto arg : std::vector<std::string> { "origin", "destination", "type",
-        "config" }) {
-      if (vm.count(arg) == 0) {
-        std::cerr
-            << "The <"
-            << arg
-            << "> argument was not provided, but is mandatory when json is not provided\n\n";
-        std::cerr << options << "\n";
-        return EXIT_FAILURE;
-      }
-    }
-    locations.push_back(Location::FromCsv(origin));
-    locations.push_back(Location::FromCsv(destination));
+  // Grab the directions options, if they exist
+  auto directions_options_ptree_ptr = json_ptree.get_child_optional(
+      "directions_options");
+  if (directions_options_ptree_ptr) {
+    request.directions_options = valhalla::odin::GetDirectionsOptions(
+        *directions_options_ptree_ptr);
   }
-  ////////////////////////////////////////////////////////////////////////////
-  // Process json input
-  else {
-    std::stringstream stream;
-    stream << json;
-    boost::property_tree::read_json(stream, json_ptree);
-
-    try {
-      for (const auto& location : json_ptree.get_child("locations"))
-        locations.emplace_back(std::move(Location::FromPtree(location.second)));
-      if (locations.size() < 2)
-        throw;
-    } catch (...) {
-      throw std::runtime_error(
-          "insufficiently specified required parameter 'locations'");
-    }
-
-    // Parse out the type of route - this provides the costing method to use
-    std::string costing;
-    try {
-      routetype = json_ptree.get<std::string>("costing");
-    } catch (...) {
-      throw std::runtime_error("No edge/node costing provided");
-    }
-
-    // Grab the directions options, if they exist
-    auto directions_options_ptree_ptr = json_ptree.get_child_optional(
-        "directions_options");
-    if (directions_options_ptree_ptr) {
-      directions_options = valhalla::odin::GetDirectionsOptions(
-          *directions_options_ptree_ptr);
-    }
-
-    // Grab the date_time, if is exists
-    auto date_time_ptr = json_ptree.get_child_optional("date_time");
-    if (date_time_ptr) {
-      auto date_time_type = (*date_time_ptr).get<int>("type");
-      auto date_time_value = (*date_time_ptr).get_optional<std::string>("value");
-
-      if (date_time_type == 0) // current
-        locations.front().date_time_ = "current";
-      else if (date_time_type == 1) // depart at
-        locations.front().date_time_ = date_time_value;
-      else if (date_time_type == 2) // arrive by
-        locations.back().date_time_ = date_time_value;
-    }
 
+  // Grab the date_time, if is exists
+  auto date_time_ptr = json_ptree.get_child_optional("date_time");
+  if (date_time_ptr) {
+    auto date_time_type = (*date_time_ptr).get<int>("type");
+    auto date_time_value = (*date_time_ptr).get_optional<std::string>("value");
+
+    if (date_time_type == 0) // current
+      locations.front().date_time_ = "current";
+    else if (date_time_type == 1) // depart at
+      locations.front().date_time_ = date_time_value;
+    else if (date_time_type == 2) // arrive by
+      locations.back().date_time_ = date_time_value;
   }
 
-  // TODO: remove after input files are transformed
-#ifdef LOGGING_LEVEL_DEBUG
-  std::string json_input = "-j '{\"locations\":[";
-  json_input += std::to_json(originloc);
-  json_input += ",";
-  json_input += std::to_json(destloc);
-  json_input += "],\"costing\":\"auto\",";
-  json_input += "\"directions_options\":{\"units\":\"miles\"}}'";
-  json_input += " --config ../conf/valhalla.json";
-  valhalla::midgard::logging::Log(json_input, " [JSON_INPUT] ");
-#endif
-
-  //parse the config
-  boost::property_tree::ptree pt;
-  boost::property_tree::read_json(config.c_str(), pt);
-
-  //configure logging
-  boost::optional<boost::property_tree::ptree&> logging_subtree = pt
-      .get_child_optional("thor.logging");
-  if (logging_subtree) {
-    auto logging_config = valhalla::midgard::ToMap<
-        const boost::property_tree::ptree&,
-        std::unordered_map<std::string, std::string> >(logging_subtree.get());
-    valhalla::midgard::logging::Configure(logging_config);
-  }
+  return request;
+}
 
-  // Something to hold the statistics
-  uint32_t n = locations.size() - 1;
-  PathStatistics data({locations[0].latlng_.lat(), locations[0].latlng_.lng()},
-                      {locations[n].latlng_.lat(), locations[n].latlng_.lng()});
+/**
+ * Run a route request: correlate the locations, get the path between each
+ * pair of them and build the directions, sending the narrative along the
+ * way. Returns false if the locations could not be processed.
+ */
+bool RouteTest(route_context_t& context, route_request_t& request,
+               const connectivity_t* connectivity_map, bool multi_run,
+               uint32_t iterations, PathStatistics& data,
+               const narrative_t& narrative) {
+  auto& reader = context.reader;
+  auto& locations = request.locations;
+  auto& routetype = request.routetype;
+  const auto& directions_options = request.directions_options;
 
   // Crow flies distance between locations (km)
+  uint32_t n = locations.size() - 1;
   float d1 = 0.0f;
   for (uint32_t i = 0; i < n; i++) {
     d1 += locations[i].latlng_.Distance(locations[i+1].latlng_) * kKmPerMeter;
   }
 
-  // Get something we can use to fetch tiles
-  valhalla::baldr::GraphReader reader(pt.get_child("mjolnir"));
-
   auto t0 = std::chrono::high_resolution_clock::now();
 
-  // Construct costing
-  CostFactory<DynamicCost> factory;
-  factory.Register("auto", CreateAutoCost);
-  factory.Register("auto_shorter", CreateAutoShorterCost);
-  factory.Register("bus", CreateBusCost);
-  factory.Register("bicycle", CreateBicycleCost);
-  factory.Register("pedestrian", CreatePedestrianCost);
-  factory.Register("truck", CreateTruckCost);
-  factory.Register("transit", CreateTransitCost);
+  // Pick up any tiles the other threads have loaded
+  reader.Sync();
 
   // Figure out the route type
   for (auto & c : routetype)
@@ -585,16 +659,15 @@ int main(int argc, char *argv[]) {
   if (routetype == "multimodal") {
     // Create array of costing methods per mode and set initial mode to
     // pedestrian
-    mode_costing[0] = get_costing(factory, pt, json_ptree, "auto");
-    mode_costing[1] = get_costing(factory, pt, json_ptree, "pedestrian");
-    mode_costing[2] = get_costing(factory, pt, json_ptree, "bicycle");
-    mode_costing[3] = get_costing(factory, pt, json_ptree, "transit");
+    mode_costing[0] = context.costing.get(request.json_ptree, "auto");
+    mode_costing[1] = context.costing.get(request.json_ptree, "pedestrian");
+    mode_costing[2] = context.costing.get(request.json_ptree, "bicycle");
+    mode_costing[3] = context.costing.get(request.json_ptree, "transit");
     mode = TravelMode::kPedestrian;
   } else {
     // Assign costing method, override any config options that are in the
     // json request
-    std::shared_ptr<DynamicCost> cost = get_costing(factory, pt,
-                              json_ptree, routetype);
+    std::shared_ptr<DynamicCost> cost = context.costing.get(request.json_ptree, routetype);
     mode = cost->travelmode();
     mode_costing[static_cast<uint32_t>(mode)] = cost;
   }
@@ -603,14 +676,15 @@ int main(int argc, char *argv[]) {
   auto t1 = std::chrono::high_resolution_clock::now();
   std::shared_ptr<DynamicCost> cost = mode_costing[static_cast<uint32_t>(mode)];
   std::unordered_map<size_t, size_t> color_counts;
-  connectivity_map_t connectivity_map(reader.GetTileHierarchy());
   std::vector<PathLocation> path_location;
   for (auto loc : locations) {
     try {
       path_location.push_back(Search(loc, reader, cost->GetEdgeFilter(), cost->GetNodeFilter()));
       //TODO: get transit level for transit costing
       //TODO: if transit send a non zero radius
-      auto colors = connectivity_map.get_colors(reader.GetTileHierarchy().levels().rbegin()->first, path_location.back(), 0);
+      if (!connectivity_map)
+        continue;
+      auto colors = connectivity_map->get_colors(reader.GetTileHierarchy().levels().rbegin()->first, path_location.back(), 0);
       for(auto color : colors){
         auto itr = color_counts.find(color);
         if(itr == color_counts.cend())
@@ -620,12 +694,12 @@ int main(int argc, char *argv[]) {
       }
     } catch (...) {
       data.setSuccess("fail_invalid_origin");
-      data.log();
-      return EXIT_FAILURE;
+      data.setTilesLoaded(reader.Share());
+      return false;
     }
   }
   // If we are testing connectivity
-  if (connectivity) {
+  if (connectivity_map) {
     //are all the locations in the same color regions
     bool connected = false;
     for(const auto& c : color_counts) {
@@ -637,54 +711,67 @@ int main(int argc, char *argv[]) {
     if(!connected) {
       LOG_INFO("No tile connectivity between locations");
       data.setSuccess("fail_no_connectivity");
-      data.log();
-      return EXIT_FAILURE;
+      data.setTilesLoaded(reader.Share());
+      return false;
     }
   }
   auto t2 = std::chrono::high_resolution_clock::now();
-  uint32_t msecs = std::chrono::duration_cast<std::chrono::milliseconds>(
-                  t2 - t1).count();
+  uint64_t us = usecs(t1, t2);
+  data.addStageTime(kLocationProcessing, us);
+  uint32_t msecs = us / 1000;
   LOG_INFO("Location Processing took " + std::to_string(msecs) + " ms");
 
   // Get the route
-  AStarPathAlgorithm astar;
-  BidirectionalAStar bd;
-  MultiModalPathAlgorithm mm;
   for (uint32_t i = 0; i < n; i++) {
     // Choose path algorithm
     PathAlgorithm* pathalgorithm;
     if (routetype == "multimodal") {
-      pathalgorithm = &mm;
+      pathalgorithm = &context.mm;
     } else if (routetype == "pedestrian") {
-      pathalgorithm = &bd;
+      pathalgorithm = &context.bd;
     } else {
       // Use bidirectional except for possible trivial cases
-      pathalgorithm = &bd;
+      pathalgorithm = &context.bd;
       for (auto& edge1 : path_location[i].edges) {
         for (auto& edge2 : path_location[i+1].edges) {
           if (edge1.id == edge2.id) {
-            pathalgorithm = &astar;
+            pathalgorithm = &context.astar;
           }
         }
       }
     }
-    bool using_astar = (pathalgorithm == &astar);
+    bool using_astar = (pathalgorithm == &context.astar);
 
     // Get the best path
     try {
-      trip_path = PathTest(reader, path_location[i], path_location[i + 1],
-                           pathalgorithm, mode_costing, mode, data, multi_run,
-                           iterations, using_astar);
+      if (pathalgorithm == &context.mm) {
+        trip_path = PathTest(reader, path_location[i], path_location[i + 1],
+                             pathalgorithm, mode_costing, mode, data, multi_run,
+                             iterations, using_astar);
+      } else {
+        auto fresh_cost = [&context, &request]() {
+          return context.costing.get(request.json_ptree, request.routetype);
+        };
+        trip_path = PathTest(reader, path_location[i], path_location[i + 1],
+                             pathalgorithm, mode_costing, mode, data, multi_run,
+                             iterations, using_astar, &context.lanes, fresh_cost);
+      }
     } catch (std::runtime_error& rte) {
       LOG_ERROR("trip_path not found");
+      // Leave the algorithm ready for the next request
+      pathalgorithm->Clear();
     }
 
     // If successful get directions
     if (trip_path.node().size() > 0) {
+      // Keep the path for valhalla_benchmark_odin before directions touch it
+      if (context.corpus)
+        context.corpus->write(directions_options, trip_path);
+
       // Try the the directions
       t1 = std::chrono::high_resolution_clock::now();
       TripDirections trip_directions = DirectionsTest(directions_options, trip_path,
-                        locations[i], locations[i+1], data);
+                        locations[i], locations[i+1], data, narrative);
       t2 = std::chrono::high_resolution_clock::now();
       msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
 
@@ -745,11 +832,551 @@ int main(int argc, char *argv[]) {
   // Time all stages for the stats file: location processing,
   // path computation, trip path building, and directions
   t2 = std::chrono::high_resolution_clock::now();
-  msecs = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t0).count();
+  us = usecs(t0, t2);
+  msecs = us / 1000;
   LOG_INFO("Total time= " + std::to_string(msecs) + " ms");
-  data.addRuntime(msecs);
-  data.log();
+  data.addRuntime(us);
+
+  // Let the other threads have what we loaded and keep the reader from
+  // growing without bound between requests
+  data.setTilesLoaded(reader.Share());
+  if (reader.OverCommitted())
+    reader.Clear();
+
+  return true;
+}
+
+// The numeric columns of the statistics csv, starting from #Passes
+const std::vector<std::string> kStatisticsColumns {
+  "#Passes", "runtime", "trip time", "length", "arcDistance", "#Manuevers",
+  "location_us", "path_us", "trip_path_us", "clear_us", "directions_us",
+  "#TilesLoaded" };
+
+// One row of the statistics csv, the result and its numeric columns
+struct StatisticsRow {
+  std::string result;
+  std::vector<double> values;
+
+  // Returns false for the header or anything else unparsable
+  bool parse(const std::string& line) {
+    std::vector<std::string> fields;
+    std::stringstream stream(line);
+    std::string field;
+    while (std::getline(stream, field, ','))
+      fields.push_back(field);
+    if (fields.size() < 11)
+      return false;
+    values.clear();
+    try {
+      for (size_t i = 5; i < fields.size() && values.size() < kStatisticsColumns.size(); ++i)
+        values.push_back(std::stod(fields[i]));
+    } catch (...) {
+      return false;
+    }
+    result = fields[4];
+    return true;
+  }
+};
+
+/**
+ * Totals, counts per result and percentiles per column over the rows of one
+ * or more statistics.csv files. This is what total_run_stats.sh and
+ * total_multi_run_stats.sh compute but a row parsed once can go into any
+ * number of summaries.
+ */
+class StatisticsSummary {
+  uint64_t routes;
+  uint64_t passes;
+  uint64_t runtime;
+  uint64_t trip_time;
+  double trip_length;
+  uint64_t maneuvers;
+  std::map<std::string, uint64_t> results;
+  std::vector<std::vector<double> > columns;
+
+ public:
+  StatisticsSummary()
+    : routes(0), passes(0), runtime(0), trip_time(0), trip_length(0),
+      maneuvers(0), columns(kStatisticsColumns.size()) { }
+
+  // Add one row, returns false for the header or anything else unparsable
+  bool add(const std::string& line) {
+    StatisticsRow row;
+    if (!row.parse(line))
+      return false;
+    add(row);
+    return true;
+  }
+
+  // Add a row that has already been parsed
+  void add(const StatisticsRow& row) {
+    const auto& values = row.values;
+    ++routes;
+    ++results[row.result];
+    passes += values[0];
+    runtime += values[1];
+    trip_time += values[2];
+    trip_length += values[3];
+    maneuvers += values[5];
+    for (size_t i = 0; i < values.size(); ++i)
+      columns[i].push_back(values[i]);
+  }
+
+  // The same line total_run_stats.sh writes to total_statistics.csv
+  std::string totals() const {
+    uint64_t success = 0, fail = 0;
+    for (const auto& result : results) {
+      if (result.first.find("success") != std::string::npos)
+        success += result.second;
+      else if (result.first.find("fail") != std::string::npos)
+        fail += result.second;
+    }
+    return (boost::format("%d,%d,%d,%d,%d,%d,%f,%d") % routes % success % fail
+        % passes % runtime % trip_time % trip_length % maneuvers).str();
+  }
+
+  void writeTotals(const std::string& filename) const {
+    std::ofstream file(filename);
+    file << "ROUTE_COUNT,SUCCESS_COUNT,FAIL_COUNT,NUM_PASSES,RUN_TIME,"
+            "TRIP_TIME,TRIP_LENGTH,NUM_MANEUVERS\n" << totals() << '\n';
+  }
+
+  void print(std::ostream& out) {
+    out << "ROUTE_COUNT,SUCCESS_COUNT,FAIL_COUNT,NUM_PASSES,RUN_TIME,"
+           "TRIP_TIME,TRIP_LENGTH,NUM_MANEUVERS\n" << totals() << "\n\n";
+    for (const auto& result : results) {
+      out << boost::format("%-28s %10d %6.2f%%\n") % result.first % result.second
+          % (100.0 * result.second / routes);
+    }
+    out << '\n' << boost::format("%-16s %14s %14s %14s %14s %14s\n") % "column"
+        % "p50" % "p90" % "p99" % "p99.9" % "max";
+    for (size_t i = 0; i < columns.size(); ++i) {
+      auto& values = columns[i];
+      if (values.empty())
+        continue;
+      auto percentile = [&values](double fraction) {
+        auto nth = values.begin() + static_cast<size_t>(fraction * (values.size() - 1));
+        std::nth_element(values.begin(), nth, values.end());
+        return *nth;
+      };
+      out << boost::format("%-16s %14.2f %14.2f %14.2f %14.2f %14.2f\n")
+          % kStatisticsColumns[i] % percentile(0.5) % percentile(0.9)
+          % percentile(0.99) % percentile(0.999) % percentile(1.0);
+    }
+  }
+};
+
+/**
+ * Summarize statistics from any number of runs. Each argument is either a
+ * statistics csv or a results directory containing a statistics.csv, in
+ * which case its total_statistics.csv is written as well. The combined
+ * summary of everything goes to stdout and, like total_multi_run_stats.sh,
+ * the combined totals of more than one run go to a dated
+ * <YYYYmmdd_HHMMSS>_total_statistics.csv in the current directory.
+ */
+int Summarize(const std::vector<std::string>& inputs) {
+  StatisticsSummary all;
+  StatisticsRow row;
+  for (const auto& input : inputs) {
+    bool directory = boost::filesystem::is_directory(input);
+    std::string filename = directory ? input + "/statistics.csv" : input;
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+      LOG_ERROR("Could not open statistics: " + filename);
+      return EXIT_FAILURE;
+    }
+    StatisticsSummary run;
+    std::string line;
+    while (std::getline(file, line)) {
+      if (row.parse(line)) {
+        run.add(row);
+        all.add(row);
+      }
+    }
+    if (directory)
+      run.writeTotals(input + "/total_statistics.csv");
+  }
+  if (inputs.size() > 1) {
+    char date[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y%m%d_%H%M%S", std::localtime(&now));
+    all.writeTotals(std::string(date) + "_total_statistics.csv");
+  }
+  all.print(std::cout);
+  return EXIT_SUCCESS;
+}
+
+// Pulls the json out of a request line as found in the test_requests files,
+// ie: -j '{"locations":[...]}' [--config ...]
+std::string GetJsonFromLine(const std::string& line) {
+  auto begin = line.find('\'', line.find("-j"));
+  auto end = line.rfind('\'');
+  if (begin == std::string::npos || end <= begin)
+    throw std::runtime_error("Could not find -j '{...}' in: " + line);
+  return line.substr(begin + 1, end - begin - 1);
+}
+
+/**
+ * Run every request in a batch file on a pool of threads. Each thread keeps
+ * its own reader and path algorithms for all of the requests it handles and
+ * the readers share a single tile cache bounded by mjolnir.max_cache_size. The
+ * narrative for the request on line N is written to <outdir>/N.txt and the
+ * statistics for all of the requests, in file order, to
+ * <outdir>/statistics.csv. This is the same output batch.sh produces. A
+ * request that throws still gets a row, with a result of fail_error.
+ */
+int RunBatch(const boost::property_tree::ptree& config,
+             const std::string& batch_file, const std::string& outdir,
+             size_t threads, const connectivity_t* connectivity_map,
+             bool multi_run, uint32_t iterations, bool speculate,
+             std::vector<std::string> prefetch,
+             trip_path_corpus::writer_t* corpus) {
+  // Grab all the requests up front, along with the line they came from
+  std::vector<std::string> requests;
+  std::vector<size_t> line_numbers;
+  std::ifstream stream(batch_file);
+  if (!stream.is_open()) {
+    LOG_ERROR("Could not open batch file: " + batch_file);
+    return EXIT_FAILURE;
+  }
+  std::string line;
+  for (size_t line_number = 1; std::getline(stream, line); ++line_number) {
+    if (!line.empty() && line.front() != '#') {
+      requests.emplace_back(std::move(line));
+      line_numbers.push_back(line_number);
+    }
+  }
+  boost::filesystem::create_directories(outdir);
+  LOG_INFO("Running " + std::to_string(requests.size()) + " routes from " +
+           batch_file + " with a concurrency of " + std::to_string(threads));
+
+  // Each thread claims the next request until there are none left
+  tile_cache_t cache(config.get<size_t>("mjolnir.max_cache_size", 1073741824));
+  costing_cache_t costing(config);
+
+  // Load the tiles the batch will want before timing anything
+  if (prefetch.size() == 1 && prefetch.front() == "batch")
+    prefetch.front() = batch_file;
+  prefetch_tiles(config, prefetch, {&cache}, threads);
+  std::vector<std::string> statistics(requests.size());
+  std::vector<batch_histograms_t> histograms(threads);
+  std::atomic<size_t> next(0);
+  auto work = [&](batch_histograms_t& thread_histograms) {
+    route_context_t context(config, costing, &cache, speculate);
+    context.corpus = corpus;
+    for (size_t i = next++; i < requests.size(); i = next++) {
+      auto line_number = std::to_string(line_numbers[i]);
+      std::ofstream narrative_file(outdir + "/" + line_number + ".txt");
+      narrative_t narrative = [&narrative_file](const std::string& line) {
+        narrative_file << line << '\n';
+      };
+      std::pair<float, float> origin, destination;
+      try {
+        auto request = ParseJsonRequest(GetJsonFromLine(requests[i]));
+        auto& locations = request.locations;
+        origin = {locations.front().latlng_.lat(), locations.front().latlng_.lng()};
+        destination = {locations.back().latlng_.lat(), locations.back().latlng_.lng()};
+        PathStatistics data(origin, destination);
+        RouteTest(context, request, connectivity_map, multi_run, iterations,
+                  data, narrative);
+        statistics[i] = data.csv();
+        thread_histograms.record(data);
+      } catch (const std::exception& e) {
+        LOG_ERROR("Request on line " + line_number + " failed: " + e.what());
+        narrative(std::string("Failed: ") + e.what());
+        // Still counted so the totals add up to the number of requests
+        PathStatistics data(origin, destination);
+        data.setSuccess("fail_error");
+        statistics[i] = data.csv();
+      }
+    }
+  };
+  std::list<std::thread> pool;
+  for (size_t i = 0; i < threads; ++i)
+    pool.emplace_back(work, std::ref(histograms[i]));
+  for (auto& thread : pool)
+    thread.join();
+
+  // Where the time went
+  for (size_t i = 1; i < histograms.size(); ++i)
+    histograms.front().merge(histograms[i]);
+  histograms.front().log();
+
+  // Write out the statistics in the order the requests came in
+  std::ofstream statistics_file(outdir + "/statistics.csv");
+  statistics_file << "orgLat, orgLng, destLat, destLng, result, #Passes, "
+                     "runtime, trip time, length, arcDistance, #Manuevers, "
+                     "location_us, path_us, trip_path_us, clear_us, "
+                     "directions_us, #TilesLoaded\n";
+  StatisticsSummary summary;
+  for (const auto& s : statistics) {
+    if (!s.empty()) {
+      statistics_file << s << '\n';
+      summary.add(s);
+    }
+  }
+  summary.writeTotals(outdir + "/total_statistics.csv");
+  LOG_INFO("Tiles loaded: " + std::to_string(cache.tiles_loaded()) +
+           " shared between threads: " + std::to_string(cache.tiles_handed_out()) +
+           " evicted: " + std::to_string(cache.tiles_evicted()));
+  LOG_INFO("Costing profiles with overrides reused: " + std::to_string(costing.profile_hits()) +
+           " merged: " + std::to_string(costing.profile_misses()));
+  LOG_INFO("Wrote results to " + outdir);
 
   return EXIT_SUCCESS;
 }
 
+// Main method for testing a single path
+int main(int argc, char *argv[]) {
+  bpo::options_description options("valhalla_run_route " VERSION "\n"
+  "\n"
+  " Usage: valhalla_run_route [options]\n"
+  "\n"
+  "valhalla_run_route is a simple command line test tool for shortest path routing. "
+  "\n"
+  "Use the -o and -d options OR the -j option for specifying the locations. "
+  "\n"
+  "Use the --batch option to run a whole file of -j requests in one process. "
+  "\n"
+  "\n");
+
+  std::string origin, destination, routetype, json, config;
+  std::string batch, batch_dir = ".", connectivity_path, dump_trip_paths;
+  std::vector<std::string> summarize, prefetch;
+  bool connectivity, verify_connectivity, multi_run, speculate;
+  connectivity = verify_connectivity = multi_run = speculate = false;
+  uint32_t iterations;
+  size_t threads = std::max(static_cast<size_t>(std::thread::hardware_concurrency()), static_cast<size_t>(1));
+
+  options.add_options()("help,h", "Print this help message.")(
+      "version,v", "Print the version of this software.")(
+      "origin,o",
+      boost::program_options::value<std::string>(&origin),
+      "Origin: lat,lng,[through|stop],[name],[street],[city/town/village],[state/province/canton/district/region/department...],[zip code],[country].")(
+      "destination,d",
+      boost::program_options::value<std::string>(&destination),
+      "Destination: lat,lng,[through|stop],[name],[street],[city/town/village],[state/province/canton/district/region/department...],[zip code],[country].")(
+      "type,t", boost::program_options::value<std::string>(&routetype),
+      "Route Type: auto|bicycle|pedestrian|auto-shorter")(
+      "json,j",
+      boost::program_options::value<std::string>(&json),
+      "JSON Example: '{\"locations\":[{\"lat\":40.748174,\"lon\":-73.984984,\"type\":\"break\",\"heading\":200,\"name\":\"Empire State Building\",\"street\":\"350 5th Avenue\",\"city\":\"New York\",\"state\":\"NY\",\"postal_code\":\"10118-0110\",\"country\":\"US\"},{\"lat\":40.749231,\"lon\":-73.968703,\"type\":\"break\",\"name\":\"United Nations Headquarters\",\"street\":\"405 East 42nd Street\",\"city\":\"New York\",\"state\":\"NY\",\"postal_code\":\"10017-3507\",\"country\":\"US\"}],\"costing\":\"auto\",\"directions_options\":{\"units\":\"miles\"}}'")
+      ("connectivity", "Generate a connectivity map before testing the route.")
+      ("connectivity-file", bpo::value<std::string>(&connectivity_path), "Check connectivity against this file from valhalla_build_connectivity [default=<tile_dir>/connectivity.bin if it exists and the level directories are the ones it was built from, otherwise the map is generated].")
+      ("verify-connectivity", "Also check the tile count and newest tile time the connectivity file was built from, which looks at every tile.")
+      ("multi-run", bpo::value<uint32_t>(&iterations), "Generate the route N additional times before exiting.")
+      ("speculate", "Run the relaxed passes of a route on their own threads alongside the first pass instead of after it.")
+      ("batch", bpo::value<std::string>(&batch), "File of routes, one -j '{...}' request per line, to run in this process.")
+      ("batch-dir", bpo::value<std::string>(&batch_dir), "Directory to write the narrative and statistics of a batch to [default=.].")
+      ("threads", bpo::value<size_t>(&threads), "Concurrency to use for a batch [default=hardware concurrency].")
+      ("prefetch", bpo::value<std::vector<std::string> >(&prefetch)->multitoken(), "Load the tiles wanted by the routes in these request files, or under the min_lng,min_lat,max_lng,max_lat boxes one per line in them, before routing. Use 'batch' for the batch file.")
+      ("dump-trip-paths", bpo::value<std::string>(&dump_trip_paths), "Write the trip path of every route found to this file for valhalla_benchmark_odin to replay.")
+      ("summarize", bpo::value<std::vector<std::string> >(&summarize)->multitoken(), "Summarize the statistics.csv of one or more batch results directories (or csv files) and exit. Each directory gets a total_statistics.csv and the combined totals of more than one go to a dated <YYYYmmdd_HHMMSS>_total_statistics.csv as total_multi_run_stats.sh does.")
+      // positional arguments
+      ("config", bpo::value<std::string>(&config), "Valhalla configuration file");
+
+
+  bpo::positional_options_description pos_options;
+  pos_options.add("config", 1);
+
+  bpo::variables_map vm;
+
+  try {
+    bpo::store(
+        bpo::command_line_parser(argc, argv).options(options).positional(
+            pos_options).run(),
+        vm);
+    bpo::notify(vm);
+
+  } catch (std::exception &e) {
+    std::cerr << "Unable to parse command line options because: " << e.what()
+              << "\n" << "This is a bug, please report it at " PACKAGE_BUGREPORT
+              << "\n";
+    return EXIT_FAILURE;
+  }
+
+  if (vm.count("help")) {
+    std::cout << options << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  if (vm.count("version")) {
+    std::cout << "valhalla_run_route " << VERSION << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  if (vm.count("summarize")) {
+    return Summarize(summarize);
+  }
+
+  if (vm.count("connectivity") || vm.count("connectivity-file")) {
+    connectivity = true;
+  }
+
+  if (vm.count("verify-connectivity")) {
+    connectivity = verify_connectivity = true;
+  }
+
+  if (vm.count("multi-run")) {
+    multi_run = true;
+  }
+
+  if (vm.count("speculate")) {
+    speculate = true;
+  }
+
+  // argument checking and verification
+  route_request_t request;
+  if (vm.count("batch")) {
+    if (vm.count("config") == 0) {
+      std::cerr << "The <config> argument was not provided, but is mandatory for a batch\n\n";
+      std::cerr << options << "\n";
+      return EXIT_FAILURE;
+    }
+  } else if (vm.count("json") == 0) {
+    for (auto arg : std::vector<std::string> { "origin", "destination", "type",
+        "config" }) {
+      if (vm.count(arg) == 0) {
+        std::cerr
+            << "The <"
+            << arg
+            << "> argument was not provided, but is mandatory when json is not provided\n\n";
+        std::cerr << options << "\n";
+        return EXIT_FAILURE;
+      }
+    }
+    // Directions options - set defaults
+    request.directions_options.set_units(
+        DirectionsOptions::Units::DirectionsOptions_Units_kMiles);
+    request.directions_options.set_language("en-US");
+    request.locations.push_back(Location::FromCsv(origin));
+    request.locations.push_back(Location::FromCsv(destination));
+    request.routetype = routetype;
+  }
+  ////////////////////////////////////////////////////////////////////////////
+  // Process json input
+  else {
+    request = ParseJsonRequest(json);
+  }
+
+  // TODO: remove after input files are transformed
+#ifdef LOGGING_LEVEL_DEBUG
+  std::string json_input = "-j '{\"locations\":[";
+  json_input += std::to_json(originloc);
+  json_input += ",";
+  json_input += std::to_json(destloc);
+  json_input += "],\"costing\":\"auto\",";
+  json_input += "\"directions_options\":{\"units\":\"miles\"}}'";
+  json_input += " --config ../conf/valhalla.json";
+  valhalla::midgard::logging::Log(json_input, " [JSON_INPUT] ");
+#endif
+
+  //parse the config
+  boost::property_tree::ptree pt;
+  boost::property_tree::read_json(config.c_str(), pt);
+
+  //configure logging
+  boost::optional<boost::property_tree::ptree&> logging_subtree = pt
+      .get_child_optional("thor.logging");
+  if (logging_subtree) {
+    auto logging_config = valhalla::midgard::ToMap<
+        const boost::property_tree::ptree&,
+        std::unordered_map<std::string, std::string> >(logging_subtree.get());
+    valhalla::midgard::logging::Configure(logging_config);
+  }
+
+  // Only get the connectivity if we are going to check it. Mapping the file
+  // is next to free, building the map means looking at every tile
+  valhalla::baldr::GraphReader reader(pt.get_child("mjolnir"));
+  std::unique_ptr<connectivity_t> connectivity_map;
+  if (connectivity) {
+    connectivity_map.reset(new connectivity_t);
+    const auto& tile_dir = reader.GetTileHierarchy().tile_dir();
+    std::string default_file = tile_dir + '/' + connectivity_file::kDefaultName;
+    bool explicit_file = !connectivity_path.empty();
+    if (!explicit_file && boost::filesystem::exists(default_file))
+      connectivity_path = default_file;
+    if (!connectivity_path.empty()) {
+      // A file from other tiles would reject routes that are fine
+      try {
+        connectivity_map->mapped.reset(new mapped_connectivity_t(connectivity_path));
+        if (!connectivity_map->mapped->stamped_for(tile_dir) ||
+            (verify_connectivity && !connectivity_map->mapped->built_from(tile_dir)))
+          throw std::runtime_error(connectivity_path + " was built from other tiles than those in " +
+                                   tile_dir + ", rerun valhalla_build_connectivity");
+        LOG_INFO("Mapped connectivity from " + connectivity_path);
+      } catch (const std::exception& e) {
+        connectivity_map->mapped.reset();
+        if (explicit_file) {
+          LOG_ERROR(e.what());
+          return EXIT_FAILURE;
+        }
+        LOG_WARN(std::string(e.what()) + ", generating the map instead");
+      }
+    }
+    if (!connectivity_map->mapped) {
+      connectivity_map->built.reset(new connectivity_map_t(reader.GetTileHierarchy()));
+    }
+  }
+
+  // Somewhere to keep the trip paths
+  std::unique_ptr<trip_path_corpus::writer_t> corpus;
+  // Closed explicitly once the last path is in so a failed final write is reported
+  auto close_corpus = [&corpus, &dump_trip_paths]() {
+    if (!corpus)
+      return true;
+    try {
+      corpus->close();
+    } catch (const std::exception& e) {
+      LOG_ERROR(std::string(e.what()) + " " + dump_trip_paths);
+      return false;
+    }
+    LOG_INFO("Wrote " + std::to_string(corpus->written()) + " trip paths to " + dump_trip_paths);
+    return true;
+  };
+  if (!dump_trip_paths.empty()) {
+    try {
+      corpus.reset(new trip_path_corpus::writer_t(dump_trip_paths));
+    } catch (const std::exception& e) {
+      LOG_ERROR(e.what());
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Run a whole file of routes
+  if (vm.count("batch")) {
+    int status = RunBatch(pt, batch, batch_dir, std::max(threads, static_cast<size_t>(1)),
+                          connectivity_map.get(), multi_run, iterations, speculate,
+                          prefetch, corpus.get());
+    if (!close_corpus())
+      return EXIT_FAILURE;
+    return status;
+  }
+
+  // Something to hold the statistics
+  auto& locations = request.locations;
+  PathStatistics data({locations.front().latlng_.lat(), locations.front().latlng_.lng()},
+                      {locations.back().latlng_.lat(), locations.back().latlng_.lng()});
+
+  // Get something we can use to fetch tiles, cost and compute paths
+  costing_cache_t costing(pt);
+  std::unique_ptr<tile_cache_t> cache;
+  if (!prefetch.empty()) {
+    cache.reset(new tile_cache_t(pt.get<size_t>("mjolnir.max_cache_size", 1073741824)));
+    prefetch_tiles(pt, prefetch, {cache.get()}, threads);
+  }
+  route_context_t context(pt, costing, cache.get(), speculate);
+  context.corpus = corpus.get();
+
+  // Log the narrative as it is generated
+  narrative_t narrative = [](const std::string& line) {
+    valhalla::midgard::logging::Log(line, " [NARRATIVE] ");
+  };
+  bool processed = RouteTest(context, request, connectivity_map.get(),
+                             multi_run, iterations, data, narrative);
+  data.log();
+  if (!close_corpus())
+    return EXIT_FAILURE;
+
+  return processed ? EXIT_SUCCESS : EXIT_FAILURE;
+}